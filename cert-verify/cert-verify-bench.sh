@@ -0,0 +1,334 @@
+#!/bin/bash -e
+
+#/ Usage: cert-verify-bench.sh [-r <runs>] [-n <leaves>] [-k <keys>]
+#/                             [-d <depths>] [-w <widths>] [-p <paths>]
+#/                             [-m <modes>] [-s <sample>] [-j <workers>]
+#/                             <cert-verify executable>
+#/
+#/ Benchmarks a program implemented in cert-verify.cpp and built as
+#/ <cert-verify executable>.  A synthetic PKI is generated for every
+#/ combination of key type, depth and width:
+#/
+#/    root - intermediate 1 - ... - intermediate <depth> - <leaves>
+#/
+#/ where the last level has <width> sibling intermediates and the leaves are
+#/ spread over them.  Each PKI is verified <runs> times for every path and
+#/ mode:
+#/
+#/    paths:  direct  the root is trusted
+#/            cross   only another root is trusted, which cross-signed the
+#/                    first level intermediates (both versions of them are
+#/                    untrusted)
+#/
+#/    modes:  single       a process per leaf, <sample> leaves
+#/            bulk         all leaves in a process (--bulk)
+#/            bulk-cached  like bulk with a warm chain cache (--chain-cache)
+#/
+#/ Results are printed to the standard output as CSV, one line per run:
+#/
+#/    key,depth,width,path,mode,leaves,run,seconds,leaves_per_s
+#/
+#/ Each combination is run once before measuring, which also checks that all
+#/ the leaves verify.
+#/
+#/ Options (space separated lists):
+#/    -r <runs>     number of measured runs (default: 3)
+#/    -n <leaves>   number of leaf certificates (default: 1000)
+#/    -k <keys>     key types: rsa2048 rsa4096 ec256 ed25519
+#/                  (default: rsa2048 ec256 ed25519)
+#/    -d <depths>   numbers of intermediate levels (default: 1 2 4)
+#/    -w <widths>   numbers of intermediates issuing leaves (default: 1 8)
+#/    -p <paths>    certification paths: direct cross (default: both)
+#/    -m <modes>    modes: single bulk bulk-cached (default: all of them)
+#/    -s <sample>   number of leaves verified in single mode (default: 50)
+#/    -j <workers>  cert-verify --workers (default: cert-verify's default)
+#/
+#/ Examples:
+#/    cert-verify-bench.sh /tmp/cert-verify > results.csv
+#/    cert-verify-bench.sh -n 10000 -k ec256 -d 3 -m bulk /tmp/cert-verify
+
+usage() { grep '^#/' "$0" | cut -c 4-; }
+
+runs=3
+leaves=1000
+keys="rsa2048 ec256 ed25519"
+depths="1 2 4"
+widths="1 8"
+paths="direct cross"
+modes="single bulk bulk-cached"
+sample=50
+workers=()
+
+while getopts "r:n:k:d:w:p:m:s:j:h" opt; do
+	case "$opt" in
+		r) runs="$OPTARG" ;;
+		n) leaves="$OPTARG" ;;
+		k) keys="$OPTARG" ;;
+		d) depths="$OPTARG" ;;
+		w) widths="$OPTARG" ;;
+		p) paths="$OPTARG" ;;
+		m) modes="$OPTARG" ;;
+		s) sample="$OPTARG" ;;
+		j) workers=(--workers "$OPTARG") ;;
+		h) usage; exit 0 ;;
+		*) usage >&2; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+executable="$1"
+[ -z "$executable" ] && {
+	echo "No executable specified" >&2
+	echo
+	usage
+	exit 1
+}
+
+# scratch directory
+tmpdir=$(mktemp -d)
+trap 'rm -rf "${tmpdir}"' EXIT
+
+# extensions of the generated certificates
+config="${tmpdir}/openssl.cnf"
+cat > "$config" <<EOF
+[req]
+distinguished_name = dn
+
+[dn]
+
+[ca]
+basicConstraints = critical, CA:TRUE
+keyUsage = critical, keyCertSign, cRLSign
+subjectKeyIdentifier = hash
+authorityKeyIdentifier = keyid
+
+[leaf]
+basicConstraints = CA:FALSE
+keyUsage = critical, digitalSignature
+subjectKeyIdentifier = hash
+authorityKeyIdentifier = keyid
+EOF
+
+##
+# generate private key <out> of the given type
+#
+gen_key() {
+	local type="$1"
+	local out="$2"
+	local algorithm
+
+	case "$type" in
+		rsa2048) algorithm=(-algorithm RSA -pkeyopt rsa_keygen_bits:2048) ;;
+		rsa4096) algorithm=(-algorithm RSA -pkeyopt rsa_keygen_bits:4096) ;;
+		ec256) algorithm=(-algorithm EC -pkeyopt ec_paramgen_curve:P-256) ;;
+		ed25519) algorithm=(-algorithm ED25519) ;;
+		*) echo "Unknown key type: $type" >&2; exit 1 ;;
+	esac
+
+	openssl genpkey "${algorithm[@]}" -out "$out" 2>/dev/null
+}
+
+##
+# generate self-signed root certificate <name>.pem with key <name>.key
+#
+gen_root() {
+	local type="$1"
+	local name="$2"
+
+	gen_key "$type" "${name}.key"
+	openssl req -x509 -new -key "${name}.key" -subj "/CN=$(basename "$name")" \
+	    -days 30 -config "$config" -extensions ca -out "${name}.pem"
+}
+
+##
+# issue certificate <out> for <csr> by <issuer> (.pem and .key)
+#
+issue() {
+	local csr="$1"
+	local issuer="$2"
+	local extensions="$3"
+	local serial="$4"
+	local out="$5"
+
+	openssl x509 -req -in "$csr" -CA "${issuer}.pem" -CAkey "${issuer}.key" \
+	    -set_serial "$serial" -days 30 -extfile "$config" \
+	    -extensions "$extensions" -out "$out" 2>/dev/null
+}
+
+##
+# generate CA certificate <name>.pem (and <name>.key, <name>.csr) issued by
+# <issuer>
+#
+gen_ca() {
+	local type="$1"
+	local name="$2"
+	local issuer="$3"
+
+	gen_key "$type" "${name}.key"
+	openssl req -new -key "${name}.key" -subj "/CN=$(basename "$name")" \
+	    -config "$config" -out "${name}.csr"
+	issue "${name}.csr" "$issuer" ca "$RANDOM$RANDOM" "${name}.pem"
+}
+
+##
+# generate the PKI for key <type>, <depth> and <width> in directory <dir>
+#
+gen_pki() {
+	local type="$1"
+	local depth="$2"
+	local width="$3"
+	local dir="$4"
+	local issuer level i
+
+	mkdir -p "${dir}/leaves"
+	gen_root "$type" "${dir}/root"
+	gen_root "$type" "${dir}/cross-root"
+
+	issuer="${dir}/root"
+	for level in $(seq $((depth - 1))); do
+		gen_ca "$type" "${dir}/int-${level}" "$issuer"
+		issuer="${dir}/int-${level}"
+	done
+
+	for i in $(seq "$width"); do
+		gen_ca "$type" "${dir}/int-${depth}-${i}" "$issuer"
+	done
+
+	# the same first level intermediate(s) (subject and key) issued by the
+	# other root
+	local first
+	for first in "${dir}"/int-1.csr "${dir}"/int-1-*.csr; do
+		[ -f "$first" ] || continue
+		issue "$first" "${dir}/cross-root" ca "$RANDOM$RANDOM" \
+		    "${dir}/cross-$(basename "$first" .csr).pem"
+	done
+
+	# the leaf key doesn't matter, it's the issuer's signature verified
+	gen_key "$type" "${dir}/leaf.key"
+	openssl req -new -key "${dir}/leaf.key" -subj "/CN=leaf" \
+	    -config "$config" -out "${dir}/leaf.csr"
+	for i in $(seq "$leaves"); do
+		issue "${dir}/leaf.csr" "${dir}/int-${depth}-$(( (i - 1) % width + 1 ))" \
+		    leaf "$i" "${dir}/leaves/$(printf "%06d" "$i").pem"
+	done
+
+	cat "${dir}"/leaves/*.pem > "${dir}/leaves.pem"
+}
+
+##
+# milliseconds are too coarse for single leaves
+#
+now_ns() { date +%s%N; }
+
+##
+# run the <mode> verification of <count> leaves once
+#
+verify() {
+	local mode="$1"
+	local count="$2"
+	local leaf
+
+	case "$mode" in
+		single)
+			for leaf in $(ls "${dir}"/leaves/*.pem | head -n "$count"); do
+				"$executable" "${trusted[@]}" "${untrusted[@]}" "$leaf" \
+				    >/dev/null
+			done
+			;;
+		bulk)
+			"$executable" "${workers[@]}" --bulk "${dir}/leaves.pem" \
+			    "${trusted[@]}" "${untrusted[@]}" >/dev/null
+			;;
+		bulk-cached)
+			"$executable" "${workers[@]}" --chain-cache "${dir}/cache" \
+			    --bulk "${dir}/leaves.pem" \
+			    "${trusted[@]}" "${untrusted[@]}" >/dev/null
+			;;
+		*) echo "Unknown mode: $mode" >&2; exit 1 ;;
+	esac
+}
+
+##
+# check that all the leaves verify (also warming up the cache)
+#
+check() {
+	local mode="$1"
+
+	case "$mode" in
+		single)
+			"$executable" "${trusted[@]}" "${untrusted[@]}" \
+			    "${dir}/leaves/000001.pem" >/dev/null
+			;;
+		*)
+			rm -f "${dir}/cache"
+			cache=()
+			[ "$mode" = bulk-cached ] && cache=(--chain-cache "${dir}/cache")
+			"$executable" "${workers[@]}" "${cache[@]}" \
+			    --bulk "${dir}/leaves.pem" \
+			    "${trusted[@]}" "${untrusted[@]}" >/dev/null
+			;;
+	esac || {
+		echo "Verification failed: ${dir} ${path} ${mode}" >&2
+		exit 1
+	}
+}
+
+echo "key,depth,width,path,mode,leaves,run,seconds,leaves_per_s"
+
+for key in $keys; do
+	for depth in $depths; do
+		for width in $widths; do
+			dir="${tmpdir}/${key}-${depth}-${width}"
+			echo "Generating ${key} PKI of depth ${depth} and width ${width}" >&2
+			(cd "$tmpdir" && gen_pki "$key" "$depth" "$width" "$dir")
+
+			# the intermediates from the root down to the leaves
+			intermediates=()
+			for level in $(seq $((depth - 1))); do
+				intermediates+=("${dir}/int-${level}.pem")
+			done
+			intermediates+=("${dir}"/int-"${depth}"-*.pem)
+
+			for path in $paths; do
+				case "$path" in
+					direct)
+						trusted=("${dir}/root.pem")
+						untrusted=("${intermediates[@]}")
+						;;
+					cross)
+						trusted=("${dir}/cross-root.pem")
+						untrusted=("${dir}"/cross-int-*.pem "${intermediates[@]}")
+						;;
+					*) echo "Unknown path: $path" >&2; exit 1 ;;
+				esac
+
+				for mode in $modes; do
+					count="$leaves"
+					[ "$mode" = single ] && [ "$sample" -lt "$leaves" ] && \
+					    count="$sample"
+
+					# warm-up (and sanity check)
+					check "$mode"
+
+					for run in $(seq "$runs"); do
+						start=$(now_ns)
+						verify "$mode" "$count"
+						end=$(now_ns)
+
+						awk -v key="$key" -v depth="$depth" -v width="$width" \
+						    -v path="$path" -v mode="$mode" -v count="$count" \
+						    -v run="$run" -v ns=$((end - start)) 'BEGIN {
+							s = ns / 1e9
+							printf "%s,%d,%d,%s,%s,%d,%d,%.6f,%.1f\n",
+							    key, depth, width, path, mode, count, run, s,
+							    count / s
+						}'
+					done
+				done
+			done
+
+			# don't keep thousands of certificates around longer than needed
+			rm -rf "$dir"
+		done
+	done
+done
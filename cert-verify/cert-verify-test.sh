@@ -0,0 +1,308 @@
+#!/bin/bash -e
+
+#/ Usage: cert-verify-test.sh <cert-verify executable>
+#/
+#/ Runs basic tests of a program implemented in cert-verify.cpp and built as
+#/ <cert-verify executable>.
+#/
+#/ Examples:
+#/    cert-verify-test.sh /tmp/cert-verify
+
+usage() { grep '^#/' "$0" | cut -c 4-; }
+
+executable="$1"
+[ -z "$executable" ] && {
+	echo "No executable specified" >&2
+	echo
+	usage
+	exit 1
+}
+
+# failures of expect_failure are not hidden by tee
+set -o pipefail
+
+# scratch directory
+tmpdir=$(mktemp -d)
+trap 'rm -rf "${tmpdir}"' EXIT
+
+# the CA database (revoked certificates) lives there too
+cd "${tmpdir}"
+
+# extensions of the generated certificates and CA settings for CRLs and OCSP
+config="${tmpdir}/openssl.cnf"
+cat > "${config}" <<EOF
+[ca]
+default_ca = ca_default
+
+[ca_default]
+database = index.txt
+default_md = sha256
+default_crl_days = 30
+
+[req]
+distinguished_name = dn
+
+[dn]
+
+[root]
+basicConstraints = critical, CA:TRUE
+keyUsage = critical, keyCertSign, cRLSign
+subjectKeyIdentifier = hash
+
+# a CA which mustn't sign CRLs
+[no_crl_sign]
+basicConstraints = critical, CA:TRUE
+keyUsage = critical, keyCertSign
+subjectKeyIdentifier = hash
+
+[leaf]
+basicConstraints = CA:FALSE
+keyUsage = critical, digitalSignature
+subjectKeyIdentifier = hash
+authorityKeyIdentifier = keyid
+
+# CRL extensions: an authority key ID, and ones of CRLs which aren't complete
+[crl]
+authorityKeyIdentifier = keyid
+
+[delta]
+deltaCRL = critical, DER:02:01:01
+
+[partition]
+issuingDistributionPoint = critical, @partition_idp
+
+[partition_idp]
+fullname = URI:http://example.com/partition.crl
+EOF
+
+##
+# generate self-signed root certificate <name>.pem with key <name>.key and an
+# empty CA database in directory <name> (all fake material for testing),
+# optionally with <extensions> other than root
+#
+gen_root() {
+	local name="$1"
+	local subject="$2"
+	local extensions="${3:-root}"
+
+	openssl req -x509 -newkey rsa:2048 -nodes -keyout "${name}.key" \
+	    -subj "${subject}" -days 30 -config "${config}" \
+	    -extensions "${extensions}" \
+	    -out "${name}.pem" &>/dev/null
+	mkdir "${name}"
+	touch "${name}/index.txt"
+}
+
+##
+# generate leaf certificate <name>.pem issued by root <issuer>
+#
+gen_leaf() {
+	local name="$1"
+	local issuer="$2"
+
+	openssl req -newkey rsa:2048 -nodes -keyout "${name}.key" \
+	    -subj "/CN=${name}" -out "${name}.csr" &>/dev/null
+	openssl x509 -req -in "${name}.csr" -CA "${issuer}.pem" \
+	    -CAkey "${issuer}.key" -CAcreateserial -days 10 \
+	    -extfile "${config}" -extensions leaf -out "${name}.pem" &>/dev/null
+}
+
+##
+# run openssl ca as root <issuer> (in its database)
+#
+ca() {
+	local issuer="$1"
+	shift
+
+	(cd "${issuer}" && openssl ca -config "${config}" \
+	    -keyfile "../${issuer}.key" -cert "../${issuer}.pem" "$@" &>/dev/null)
+}
+
+##
+# generate DER encoded OCSP response <out> about <cert> issued by root
+# <issuer> and signed by root <signer>
+#
+gen_ocsp() {
+	local cert="$1"
+	local issuer="$2"
+	local signer="$3"
+	local out="$4"
+
+	openssl ocsp -issuer "${issuer}.pem" -cert "${cert}.pem" -no_nonce \
+	    -reqout "${out}.req" &>/dev/null
+	openssl ocsp -index "${issuer}/index.txt" -CA "${issuer}.pem" \
+	    -rsigner "${signer}.pem" -rkey "${signer}.key" -reqin "${out}.req" \
+	    -ndays 1 -respout "${out}" &>/dev/null
+}
+
+##
+# expect <cert-verify arguments> to fail
+#
+expect_failure() {
+	if "${executable}" "$@"; then
+		echo "Verification didn't fail: $*" >&2
+		exit 1
+	fi
+}
+
+# The root, a root with the same name but another key and a leaf each.  One
+# more leaf gets revoked.
+gen_root root "/CN=Test Root"
+gen_root impostor "/CN=Test Root"
+gen_root no-crl-sign "/CN=Test Root Without CRL Signing" no_crl_sign
+gen_leaf good root
+gen_leaf revoked root
+gen_leaf other impostor
+gen_leaf unsigned-crl no-crl-sign
+
+ca root -valid ../good.pem
+ca root -revoke ../revoked.pem
+ca root -gencrl -out ../root.crl
+ca root -gencrl -crl_lastupdate 20200101000000Z \
+    -crl_nextupdate 20200201000000Z -out ../expired.crl
+ca impostor -gencrl -out ../impostor.crl
+ca impostor -gencrl -crlexts crl -out ../impostor-akid.crl
+ca root -gencrl -crlexts delta -out ../delta.crl
+ca root -gencrl -crlexts partition -out ../partition.crl
+ca no-crl-sign -gencrl -out ../no-crl-sign.crl
+
+###############
+#### tests ####
+###############
+
+##
+# test successful verification and the exit status of a failed one
+#
+echo -n "Expecting successful verification ... "
+"${executable}" root.pem good.pem
+echo -n "Expecting verification failure (wrong root) ... "
+expect_failure impostor.pem good.pem
+
+##
+# test JSON output
+#
+echo "Expecting JSON results ... "
+"${executable}" --json root.pem good.pem | tee result.json
+grep -q '^{"name":"good.pem","result":"OK"}$' result.json
+expect_failure --json impostor.pem good.pem | tee result.json
+grep -q '"result":"failed","error":' result.json
+
+##
+# test bulk verification (the exit status is a failure unless all the leaves
+# verify)
+#
+cat good.pem revoked.pem > leaves.pem
+echo "Expecting bulk verification ... "
+"${executable}" --bulk leaves.pem root.pem
+cat good.pem other.pem > leaves.pem
+echo "Expecting bulk verification with one failure ... "
+expect_failure --bulk leaves.pem root.pem | tee result.txt
+grep -q "^leaves.pem#1: failed: " result.txt
+echo "Expecting bulk verification with one failure (2 workers) ... "
+expect_failure --workers 2 --bulk leaves.pem root.pem | tee result.txt
+grep -q "^leaves.pem#1: failed: " result.txt
+for workers in 0 -1 1025 2x ""; do
+	echo -n "Expecting invalid number of workers (\"${workers}\") ... "
+	expect_failure --workers "${workers}" --bulk leaves.pem root.pem \
+	    > result.txt 2>&1
+	grep "Invalid number of workers" result.txt
+done
+
+##
+# test root certificates looked up in a hashed directory and an index
+#
+mkdir ca-dir
+cp root.pem ca-dir
+openssl rehash ca-dir
+echo -n "Expecting successful verification (hashed directory) ... "
+"${executable}" --ca-dir ca-dir good.pem
+
+echo -n "Expecting successful verification (index) ... "
+"${executable}" --build-ca-index ca.idx impostor.pem root.pem
+"${executable}" --ca-index ca.idx good.pem
+echo -n "Expecting successful verification (index, another root) ... "
+"${executable}" --ca-index ca.idx other.pem
+
+##
+# test the chain cache: the first run fills it, the second one is answered
+# from it and once the trusted root changes, the cached chain isn't used
+#
+cp root.pem trusted.pem
+echo -n "Expecting successful verification (filling cache) ... "
+"${executable}" --chain-cache chains trusted.pem good.pem
+[ -s chains ]
+echo -n "Expecting successful verification (cached) ... "
+"${executable}" --chain-cache chains trusted.pem good.pem
+cp impostor.pem trusted.pem
+echo -n "Expecting verification failure (cached, trusted root changed) ... "
+expect_failure --chain-cache chains trusted.pem good.pem
+
+# The cache isn't trusted: the chain of a leaf from another issuer (with
+# the same name) taken over from the good leaf doesn't verify.
+cp root.pem trusted.pem
+"${executable}" --chain-cache chains trusted.pem good.pem >/dev/null
+fingerprint() {
+	openssl x509 -in "$1" -outform DER | openssl dgst -sha256 -r | cut -c 1-64
+}
+sed "s/^$(fingerprint good.pem)/$(fingerprint other.pem)/" chains \
+    > chains.tampered
+echo -n "Expecting verification failure (tampered cache) ... "
+expect_failure --chain-cache chains.tampered trusted.pem other.pem
+
+##
+# test CRLs (also indexed in a cache directory, used by the second run)
+#
+mkdir -m 700 crls
+for run in 1 2; do
+	echo -n "Expecting successful verification (CRL, run ${run}) ... "
+	"${executable}" --crl root.crl --crl-cache crls root.pem good.pem
+	echo -n "Expecting verification failure (revoked, run ${run}) ... "
+	expect_failure --crl root.crl --crl-cache crls root.pem revoked.pem
+done
+[ "$(ls crls | wc -l)" -eq 1 ]
+
+echo -n "Expecting verification failure (expired CRL) ... "
+expect_failure --crl expired.crl root.pem good.pem 2>&1 | tee result.txt
+grep -q "CRL has expired" result.txt
+
+echo -n "Expecting verification failure (CRL from another issuer) ... "
+expect_failure --crl impostor.crl root.pem good.pem 2>&1 | tee result.txt
+grep -q "CRL signature failure" result.txt
+
+echo -n "Expecting successful verification (CRL of another issuer's key) ... "
+"${executable}" --crl impostor-akid.crl --crl root.crl root.pem good.pem
+
+for crl in delta partition; do
+	echo -n "Expecting error (${crl} CRL) ... "
+	expect_failure --crl "${crl}.crl" root.pem good.pem 2>&1 \
+	    | tee result.txt
+	grep -q "Not a complete CRL" result.txt
+done
+
+echo -n "Expecting verification failure (issuer can't sign CRLs) ... "
+expect_failure --crl no-crl-sign.crl no-crl-sign.pem unsigned-crl.pem 2>&1 \
+    | tee result.txt
+grep -q "key usage does not include CRL signing" result.txt
+
+##
+# test OCSP responses
+#
+gen_ocsp good root root good.ocsp
+gen_ocsp revoked root root revoked.ocsp
+gen_ocsp good root impostor forged.ocsp
+
+echo -n "Expecting successful verification (OCSP good) ... "
+"${executable}" --ocsp good.ocsp root.pem good.pem
+echo -n "Expecting verification failure (OCSP revoked) ... "
+expect_failure --ocsp revoked.ocsp root.pem revoked.pem 2>&1 | tee result.txt
+grep -q "certificate revoked" result.txt
+echo -n "Expecting verification failure (OCSP bad signature) ... "
+expect_failure --ocsp forged.ocsp root.pem good.pem 2>&1 | tee result.txt
+grep -q "OCSP verification failed" result.txt
+
+echo -n "Expecting verification failure (no OCSP response for the leaf) ... "
+expect_failure --ocsp revoked.ocsp root.pem good.pem 2>&1 | tee result.txt
+grep -q "unable to get certificate CRL" result.txt
+
+echo -n "Expecting successful verification (OCSP preferred to CRL) ... "
+"${executable}" --ocsp good.ocsp --crl expired.crl root.pem good.pem
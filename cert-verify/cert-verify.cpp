@@ -1,17 +1,55 @@
 #include <openssl/bio.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ocsp.h>
 #include <openssl/pem.h>
 #include <openssl/x509.h>
 #include <openssl/x509_vfy.h>
+#include <openssl/x509v3.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
 #include <functional>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#if OPENSSL_VERSION_NUMBER < 0x10101000L
+#error "OpenSSL 1.1.1 or newer is required"
+#endif
+
+/*
+ * The name X509_STORE lookup callbacks get: OpenSSL 3.0 made it const (and
+ * the functions taking it from there too).
+ */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef const X509_NAME LookupName;
+#else
+typedef X509_NAME LookupName;
+#endif
+
 /*
  * A handy alias for return types from functions.  Don't bother
  * specifying deleter type for std::unique_ptr any more.
@@ -82,172 +120,2465 @@ read_untrusted (char const *const *const begin, char const *const *const end)
 }
 
 /*
- * Print a message for a failed verification.
+ * Format <length> bytes of <data> as a hex string.
  */
-void
-print_verification_failure_msg (X509_STORE_CTX *const ctx, std::ostream& out)
+std::string
+to_hex (const unsigned char *const data, const std::size_t length)
 {
-  // This is the main error code
-  const int error = X509_STORE_CTX_get_error (ctx);
+  static const char HEX[] = "0123456789abcdef";
+  std::string hex;
+  hex.reserve (2 * length);
+  for (std::size_t i = 0; i < length; ++i) {
+    hex += HEX[data[i] >> 4];
+    hex += HEX[data[i] & 0xf];
+  }
 
-  // ... and a corresponding error message.
-  char const* const error_msg = X509_verify_cert_error_string (error);
-  if (!error_msg) {
-    throw std::runtime_error ("Cannot get verification failure message");
+  return hex;
+}
+
+/*
+ * SHA-256 fingerprint of <cert> as a hex string.
+ */
+std::string
+fingerprint (X509 *const cert)
+{
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int length = 0;
+  if (!X509_digest (cert, EVP_sha256 (), md, &length)) {
+    throw std::runtime_error ("Cannot calculate certificate fingerprint");
   }
 
-  // Now to get more information about the verification failure we need to call
-  // a number of functions that can only write to BIO.  So let's allocate one
-  // in memory.
-  const auto bio = make_scoped (BIO_new (BIO_s_mem ()), BIO_vfree);
-  if (!bio) {
-    throw std::runtime_error ("Cannot allocate buffer for the error message");
+  return to_hex (md, length);
+}
+
+/*
+ * Convert ASN1 <time> into seconds since the epoch.
+ */
+std::time_t
+asn1_time_to_epoch (const ASN1_TIME *const time)
+{
+  struct std::tm tm;
+  if (!ASN1_TIME_to_tm (time, &tm)) {
+    throw std::runtime_error ("Cannot convert certificate time");
   }
 
-  // Maybe we can find out something about the culprit...
-  X509* const cert = X509_STORE_CTX_get_current_cert (ctx);
-  // It is possible that the cert is deliberately set to NULL and the error
-  // is not related to any specific certificate.
-  if (cert) {
-    X509_NAME* const subj = X509_get_subject_name (cert);
-    if (!subj) {
-      throw std::runtime_error ("Cannot get certificate subject name");
+  return ::timegm (&tm);
+}
+
+/*
+ * Get the content of a key identifier as a string (usable as a key).
+ */
+std::string
+key_id_string (const ASN1_OCTET_STRING *const key_id)
+{
+  return std::string (
+    reinterpret_cast<const char*> (ASN1_STRING_get0_data (key_id)),
+    ASN1_STRING_length (key_id));
+}
+
+/*
+ * Something that identifies the content of file <path> without reading it:
+ * if the file changes, so does its identity.
+ */
+std::string
+file_identity (const std::string& path)
+{
+  struct ::stat st;
+  if (::stat (path.c_str (), &st) != 0) {
+    throw std::runtime_error ("Cannot stat file: " + path);
+  }
+
+  std::ostringstream identity;
+  identity << path << ':' << st.st_dev << ':' << st.st_ino << ':'
+	   << st.st_size << ':' << st.st_mtim.tv_sec << '.'
+	   << st.st_mtim.tv_nsec;
+
+  return identity.str ();
+}
+
+/*
+ * Replace file <path> with <content> atomically (somebody may be using it),
+ * through a temporary file of its own (other processes may be doing
+ * the same).  The file gets <mode> permissions.  <what> the file is goes to
+ * the error message.
+ */
+void
+replace_file (const std::string& path, const std::string& content,
+	      const mode_t mode, const std::string& what)
+{
+  std::string tmp = path + ".XXXXXX";
+  const int fd = ::mkostemp (&tmp[0], O_CLOEXEC);
+  if (fd < 0) {
+    throw std::runtime_error ("Cannot create " + what + ": " + tmp);
+  }
+
+  std::size_t written = 0;
+  while (written < content.size ()) {
+    const ssize_t n =
+      ::write (fd, content.data () + written, content.size () - written);
+    if (n < 0 && errno == EINTR) {
+      continue;
     }
 
-    if (X509_NAME_print_ex (bio.get (), subj, 0, XN_FLAG_ONELINE) <= 0) {
-      throw std::runtime_error ("Cannot print certificate subject name");
+    if (n <= 0) {
+      break;
     }
+
+    written += n;
   }
 
-  switch (error)
-  { 
-  case X509_V_ERR_CERT_NOT_YET_VALID:
-  case X509_V_ERR_CERT_HAS_EXPIRED:
-    // If it's something to do with certificate validity dates (one of the most
-    // common failure reasons), let's try to find out something more about them.
-    if (BIO_puts (bio.get (),"\nnotBefore: ") <= 0 ||
-	ASN1_TIME_print (bio.get (), X509_get_notBefore (cert)) <= 0 ||
-	BIO_puts (bio.get (),"\nnotAfter: ") <= 0 ||
-	ASN1_TIME_print (bio.get (), X509_get_notAfter (cert)) <= 0) {
-      throw std::runtime_error ("Cannot get certificate expiration dates");
-    }
+  // (mkostemp () creates it private)
+  const bool changed = mode == 0600 || ::fchmod (fd, mode) == 0;
+  if (::close (fd) != 0 || written != content.size () || !changed ||
+      std::rename (tmp.c_str (), path.c_str ()) != 0) {
+    ::unlink (tmp.c_str ());
+    throw std::runtime_error ("Cannot write " + what + ": " + path);
+  }
+}
 
-    break;
+/*
+ * A precompiled, memory-mapped index of root certificates.  Certificates are
+ * stored as DER and parsed only when one is actually needed as an issuer, so
+ * opening even a huge bundle costs next to nothing.  The file consists of:
+ *
+ *   Header
+ *   Entry[count]   sorted by subject name hash
+ *   DER data       referenced by the entries
+ *
+ * Numbers are in the native byte order, so the index is not portable between
+ * machines with different architectures (it's cheap to build).
+ */
+class RootIndex
+{
+public:
+  explicit RootIndex (const std::string& path);
+
+  ~RootIndex ();
+
+  RootIndex (const RootIndex&) = delete;
+  RootIndex& operator= (const RootIndex&) = delete;
+
+  /*
+   * Write an index of all certificates in the PEM <bundles> to <path>.
+   */
+  static void
+  build (const std::string& path, const std::vector<std::string>& bundles);
+
+  /*
+   * Find the issuer of <cert> or return nullptr.  The certificate returned
+   * is owned by the index.
+   */
+  X509 *
+  find_issuer (X509 *cert) const;
+
+  /*
+   * Append (new references to) all certificates with <name> to <certs>.
+   */
+  void
+  find_by_subject (LookupName *name, STACK_OF(X509) *certs) const;
+
+private:
+  static const char MAGIC[8];
+  static const std::uint32_t VERSION = 1;
+  static const std::size_t KEY_ID_SIZE = 32;
+
+  struct Header
+  {
+    char magic[sizeof (MAGIC)];
+    std::uint32_t version;
+    std::uint32_t count;
+  };
+
+  struct Entry
+  {
+    std::uint64_t subject_hash;
+    std::uint64_t offset;
+    std::uint32_t length;
+    // subject key identifier (truncated if longer)
+    std::uint32_t key_id_length;
+    unsigned char key_id[KEY_ID_SIZE];
+  };
+
+  std::pair<const Entry*, const Entry*>
+  find_subject (unsigned long hash) const;
+
+  X509 *
+  get (const Entry *entry) const;
+
+  void *m_data;
+  std::size_t m_size;
+  const Entry *m_entries;
+  std::size_t m_count;
+
+  mutable std::mutex m_mutex;
+  // certificates parsed so far by their entry index
+  mutable std::unordered_map<std::size_t, scoped_ptr<X509>> m_parsed;
+};
+
+const char RootIndex::MAGIC[8] = "CVROOTX";
+const std::uint32_t RootIndex::VERSION;
+const std::size_t RootIndex::KEY_ID_SIZE;
+
+RootIndex::RootIndex (const std::string& path)
+  : m_data (MAP_FAILED), m_size (0), m_entries (nullptr), m_count (0)
+{
+  const int fd = ::open (path.c_str (), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw std::runtime_error ("Cannot open root index: " + path);
   }
 
-  // Now let's extract everything we've collected in our BIO object
-  char* buffer;
-  const long buffer_length = BIO_get_mem_data (bio.get (), &buffer);
-  if (buffer_length < 0) {
-    throw std::runtime_error ("Cannot get error message buffer content");
+  struct ::stat st;
+  if (::fstat (fd, &st) == 0 &&
+      static_cast<std::size_t> (st.st_size) >= sizeof (Header)) {
+    m_size = st.st_size;
+    m_data = ::mmap (nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
   }
 
-  // And it's also worth to know at what certificate level the verification failed.
-  out << error_msg << " (at level " << X509_STORE_CTX_get_error_depth (ctx) << ')';
-  if (buffer_length > 0) {
-    out << '\n';
-    out.write (buffer, buffer_length);
+  ::close (fd);
+  if (m_data == MAP_FAILED) {
+    throw std::runtime_error ("Cannot map root index: " + path);
   }
 
-  out << std::endl;
+  const Header *const header = static_cast<const Header*> (m_data);
+  if (std::memcmp (header->magic, MAGIC, sizeof (MAGIC)) != 0 ||
+      header->version != VERSION ||
+      (m_size - sizeof (Header)) / sizeof (Entry) < header->count) {
+    ::munmap (m_data, m_size);
+    throw std::runtime_error ("Invalid root index: " + path);
+  }
+
+  m_entries = reinterpret_cast<const Entry*> (header + 1);
+  m_count = header->count;
+}
+
+RootIndex::~RootIndex ()
+{
+  ::munmap (m_data, m_size);
 }
 
 void
-usage (char const *const arg0, std::ostream& out)
+RootIndex::build (const std::string& path,
+		  const std::vector<std::string>& bundles)
 {
-  out <<
-"Usage:\n"
-"\n"
-"    " << arg0 << " <CA cert> [<untrusted cert>...] <leaf cert>\n"
-"\n"
-"Verifies <leaf cert> with all optional intermediate <untrusted cert>s and\n"
-"ultimately trusted root <CA cert>.  Please note that the order of certificates\n"
-"on the command line is important: root - optional intermediates - leaf.\n"
-      << std::endl;
+  std::vector<Entry> entries;
+  std::string data;
+  for (const std::string& bundle : bundles) {
+    const auto bio =
+      make_scoped (BIO_new_file (bundle.c_str (), "r"), BIO_free);
+    if (!bio) {
+      throw std::runtime_error ("Cannot open file: " + bundle);
+    }
+
+    while (X509 *const raw =
+	   PEM_read_bio_X509 (bio.get (), nullptr, nullptr, nullptr)) {
+      const auto cert = make_scoped (raw, X509_free);
+
+      unsigned char *der = nullptr;
+      const int length = i2d_X509 (cert.get (), &der);
+      if (length <= 0) {
+	throw std::runtime_error ("Cannot encode certificate from: " + bundle);
+      }
+
+      Entry entry = Entry ();
+      entry.subject_hash =
+	X509_NAME_hash (X509_get_subject_name (cert.get ()));
+      // relative to the DER data for now
+      entry.offset = data.size ();
+      entry.length = length;
+
+      const ASN1_OCTET_STRING *const key_id =
+	X509_get0_subject_key_id (cert.get ());
+      if (key_id) {
+	entry.key_id_length =
+	  std::min<std::size_t> (ASN1_STRING_length (key_id), KEY_ID_SIZE);
+	std::memcpy (entry.key_id, ASN1_STRING_get0_data (key_id),
+		     entry.key_id_length);
+      }
+
+      data.append (reinterpret_cast<const char*> (der), length);
+      OPENSSL_free (der);
+      entries.push_back (entry);
+    }
+
+    // the end of the file is reported as an error too
+    ERR_clear_error ();
+  }
+
+  if (entries.empty ()) {
+    throw std::runtime_error ("No certificates to index");
+  }
+
+  std::stable_sort (entries.begin (), entries.end (),
+		    [] (const Entry& a, const Entry& b) {
+		      return a.subject_hash < b.subject_hash;
+		    });
+
+  const std::uint64_t data_offset =
+    sizeof (Header) + entries.size () * sizeof (Entry);
+  for (Entry& entry : entries) {
+    entry.offset += data_offset;
+  }
+
+  Header header = Header ();
+  std::memcpy (header.magic, MAGIC, sizeof (MAGIC));
+  header.version = VERSION;
+  header.count = entries.size ();
+
+  std::string index (reinterpret_cast<const char*> (&header), sizeof (header));
+  index.append (reinterpret_cast<const char*> (entries.data ()),
+		entries.size () * sizeof (Entry));
+  index.append (data);
+  // (root certificates are no secret)
+  replace_file (path, index, 0644, "root index");
 }
 
-bool
-help_requested (const std::string& arg)
+std::pair<const RootIndex::Entry*, const RootIndex::Entry*>
+RootIndex::find_subject (const unsigned long hash) const
 {
-  return arg == "-h" || arg == "-help" || arg == "--help";
+  const auto compare = [] (const Entry& entry, const std::uint64_t hash) {
+    return entry.subject_hash < hash;
+  };
+
+  const Entry *const end = m_entries + m_count;
+  const Entry *const first = std::lower_bound (m_entries, end, hash, compare);
+  const Entry *last = first;
+  while (last != end && last->subject_hash == hash) {
+    ++last;
+  }
+
+  return std::make_pair (first, last);
 }
 
-int
-main (int argc, char* argv[])
+X509 *
+RootIndex::get (const Entry *const entry) const
 {
-  // help
-  if (argc == 2 && help_requested (argv[1])) {
-    usage (argv[0], std::cout);
-    return EXIT_SUCCESS;
+  const std::size_t index = entry - m_entries;
+  std::lock_guard<std::mutex> lock (m_mutex);
+  const auto it = m_parsed.find (index);
+  if (it != m_parsed.end ()) {
+    return it->second.get ();
   }
 
-  // misuse
-  if (argc < 3) {
-    usage (argv[0], std::cerr);
-    return EXIT_FAILURE;
+  if (entry->offset > m_size || m_size - entry->offset < entry->length) {
+    throw std::runtime_error ("Corrupted root index");
   }
 
-  // This has to be called before the verification where a number of cryptographic
-  // algorithms is used (they are not available by default).
-  OpenSSL_add_all_algorithms ();
+  const unsigned char *der =
+    static_cast<const unsigned char*> (m_data) + entry->offset;
+  X509 *const cert = d2i_X509 (nullptr, &der, entry->length);
+  if (!cert) {
+    throw std::runtime_error ("Cannot parse certificate from root index");
+  }
 
-  try {
-    // Let's create a certificate store for the root CA
-    const auto trusted = make_scoped (X509_STORE_new (), X509_STORE_free);
-    if (!trusted) {
-      throw std::runtime_error ("Cannot create a trusted store");
+  m_parsed.emplace (index, make_scoped (cert, X509_free));
+  return cert;
+}
+
+X509 *
+RootIndex::find_issuer (X509 *const cert) const
+{
+  const auto range =
+    find_subject (X509_NAME_hash (X509_get_issuer_name (cert)));
+  const ASN1_OCTET_STRING *const key_id = X509_get0_authority_key_id (cert);
+
+  // Don't parse certificates whose key identifier doesn't match.
+  X509 *found = nullptr;
+  for (const Entry *entry = range.first; entry != range.second; ++entry) {
+    if (key_id && entry->key_id_length &&
+	(std::min<std::size_t> (ASN1_STRING_length (key_id), KEY_ID_SIZE)
+	 != entry->key_id_length ||
+	 std::memcmp (ASN1_STRING_get0_data (key_id), entry->key_id,
+		      entry->key_id_length) != 0)) {
+      continue;
     }
 
-    // The lookup method is owned by the store once created and added to the store
-    const auto lookup = X509_STORE_add_lookup (trusted.get (), X509_LOOKUP_file ());
-    if (!lookup) {
-      throw std::runtime_error ("Cannot add file lookup");
+    X509 *const issuer = get (entry);
+    if (X509_check_issued (issuer, cert) != X509_V_OK) {
+      continue;
     }
 
-    // Load the root CA into the store
-    if (1 != X509_LOOKUP_load_file (lookup, argv[1], X509_FILETYPE_PEM)) {
-      throw std::runtime_error ("Cannot load root CA");
+    // like OpenSSL, prefer an issuer that's currently valid
+    found = issuer;
+    if (X509_cmp_current_time (X509_get0_notBefore (found)) < 0 &&
+	X509_cmp_current_time (X509_get0_notAfter (found)) > 0) {
+      break;
     }
+  }
 
-    // Create a X509 store context required for the verification
-    const auto ctx = make_scoped (X509_STORE_CTX_new (), X509_STORE_CTX_free);
-    if (!ctx) {
-      throw std::runtime_error ("Cannot create a store context");
+  return found;
+}
+
+void
+RootIndex::find_by_subject (LookupName *const name,
+			    STACK_OF(X509) *const certs) const
+{
+  const auto range = find_subject (X509_NAME_hash (name));
+  for (const Entry *entry = range.first; entry != range.second; ++entry) {
+    X509 *const cert = get (entry);
+    if (X509_NAME_cmp (X509_get_subject_name (cert), name) != 0) {
+      continue;
     }
 
-    // Now our untrusted (intermediate) certificates (if any)
-    const auto untrusted = read_untrusted (argv + 2, argv + argc - 1);
-    // And our leaf certificate we want to verify
-    const auto cert = read_x509 (argv[argc - 1]);
+    if (!X509_up_ref (cert) || !sk_X509_push (certs, cert)) {
+      throw std::runtime_error ("Cannot add certificate to the stack");
+    }
+  }
+}
+
+/*
+ * A store of trusted (root) certificates, all loaded upfront and indexed by
+ * subject name hash and subject key identifier.  The issuer of a certificate
+ * is then found with a hash lookup rather than OpenSSL's search through all
+ * the certificates with the same subject.
+ *
+ * Big sets of roots are better not loaded upfront: a precompiled RootIndex or
+ * an OpenSSL hashed directory (see `openssl rehash') are only searched when
+ * the issuer isn't among the loaded certificates.
+ */
+class TrustStore
+{
+public:
+  TrustStore ();
+
+  TrustStore (const TrustStore&) = delete;
+  TrustStore& operator= (const TrustStore&) = delete;
+
+  /*
+   * Add all certificates in PEM <bundle>.
+   */
+  void
+  load_bundle (const std::string& bundle);
+
+  /*
+   * Look issuers up in hashed directory <dir> too.
+   */
+  void
+  load_dir (const std::string& dir);
+
+  /*
+   * Look issuers up in RootIndex <path> too.
+   */
+  void
+  load_index (const std::string& path);
+
+  X509_STORE *
+  get () const
+  {
+    return m_store.get ();
+  }
+
+  /*
+   * Identity of all the trusted certificates (changes when they do).
+   */
+  const std::string&
+  identity () const
+  {
+    return m_identity;
+  }
+
+private:
+  static int
+  get_issuer (X509 **issuer, X509_STORE_CTX *ctx, X509 *cert);
+
+  static STACK_OF(X509) *
+  lookup_certs (X509_STORE_CTX *ctx, LookupName *name);
+
+  static int
+  ex_data_index ();
+
+  X509 *
+  find_issuer (X509 *cert) const;
+
+  scoped_ptr<X509_STORE> m_store;
+  std::vector<scoped_ptr<X509>> m_certs;
+  std::unordered_multimap<unsigned long, X509*> m_by_subject;
+  std::unordered_map<std::string, X509*> m_by_key_id;
+  std::unique_ptr<RootIndex> m_index;
+  // hashed directories are searched with the store's lookup
+  bool m_has_dirs = false;
+  std::string m_identity;
+};
+
+TrustStore::TrustStore ()
+  : m_store (make_scoped (X509_STORE_new (), X509_STORE_free))
+{
+  if (!m_store) {
+    throw std::runtime_error ("Cannot create a trusted store");
+  }
 
-    // Initialize the context for the verifiacion
-    if (!X509_STORE_CTX_init (
-	  ctx.get (), trusted.get (), cert.get (), untrusted.get ())) {
-      throw std::runtime_error ("Cannot initialize the store context");
+  // the callback needs to find us
+  if (!X509_STORE_set_ex_data (m_store.get (), ex_data_index (), this)) {
+    throw std::runtime_error ("Cannot attach index to the trusted store");
+  }
+
+  X509_STORE_set_get_issuer (m_store.get (), get_issuer);
+}
+
+void
+TrustStore::load_bundle (const std::string& bundle)
+{
+  const auto bio = make_scoped (BIO_new_file (bundle.c_str (), "r"), BIO_free);
+  if (!bio) {
+    throw std::runtime_error ("Cannot open file: " + bundle);
+  }
+
+  std::size_t count = 0;
+  while (X509 *const raw =
+	 PEM_read_bio_X509 (bio.get (), nullptr, nullptr, nullptr)) {
+    auto cert = make_scoped (raw, X509_free);
+
+    // The store keeps its own reference, so OpenSSL's own lookups (e.g. for
+    // a self-signed leaf) still work.
+    if (!X509_STORE_add_cert (m_store.get (), cert.get ())) {
+      throw std::runtime_error ("Cannot add certificate to the store");
     }
 
-    // Verify!
-    const int result = X509_verify_cert (ctx.get ());
-    if (result < 0) {
-      throw std::runtime_error ("Cannot verify certificates");
+    m_by_subject.emplace (X509_NAME_hash (X509_get_subject_name (cert.get ())),
+			  cert.get ());
+
+    const ASN1_OCTET_STRING *const key_id =
+      X509_get0_subject_key_id (cert.get ());
+    if (key_id) {
+      m_by_key_id.emplace (key_id_string (key_id), cert.get ());
     }
 
-    std::cout << "Verification " << (result ? "OK" : "failed") << std::endl;
-    if (!result) {
-      ERR_load_X509_strings (); // required before decoding error code into a string
+    m_certs.push_back (std::move (cert));
+    ++count;
+  }
 
-      // print something useful about the failure
-      print_verification_failure_msg (ctx.get (), std::cerr);
+  // the end of the file is reported as an error too
+  ERR_clear_error ();
+  if (count == 0) {
+    throw std::runtime_error ("Cannot load root CA");
+  }
+
+  m_identity += file_identity (bundle) + ';';
+}
+
+void
+TrustStore::load_dir (const std::string& dir)
+{
+  X509_LOOKUP *const lookup =
+    X509_STORE_add_lookup (m_store.get (), X509_LOOKUP_hash_dir ());
+  if (!lookup ||
+      !X509_LOOKUP_add_dir (lookup, dir.c_str (), X509_FILETYPE_PEM)) {
+    throw std::runtime_error ("Cannot add directory to the store: " + dir);
+  }
+
+  m_has_dirs = true;
+  // a directory changes when certificates (links) are added or removed
+  m_identity += file_identity (dir) + ';';
+}
+
+void
+TrustStore::load_index (const std::string& path)
+{
+  if (m_index) {
+    throw std::runtime_error ("Only one root index is supported");
+  }
+
+  m_index.reset (new RootIndex (path));
+  // self-signed leaves are looked up by subject rather than issuer
+  X509_STORE_set_lookup_certs (m_store.get (), lookup_certs);
+  m_identity += file_identity (path) + ';';
+}
+
+int
+TrustStore::ex_data_index ()
+{
+  static const int index =
+    X509_STORE_get_ex_new_index (0, nullptr, nullptr, nullptr, nullptr);
+
+  return index;
+}
+
+/*
+ * X509_STORE_CTX_get_issuer_fn replacing the store lookup with the index.
+ */
+int
+TrustStore::get_issuer (X509 **const issuer, X509_STORE_CTX *const ctx,
+			X509 *const cert)
+{
+  const TrustStore *const self = static_cast<const TrustStore*> (
+    X509_STORE_get_ex_data (X509_STORE_CTX_get0_store (ctx), ex_data_index ()));
+
+  X509 *found = nullptr;
+  try {
+    found = self->find_issuer (cert);
+  }
+  catch (const std::exception&) {
+    // OpenSSL can't propagate exceptions, it's not found
+  }
+
+  if (!found) {
+    // the store's own lookup searches the hashed directories
+    return
+      self->m_has_dirs ? X509_STORE_CTX_get1_issuer (issuer, ctx, cert) : 0;
+  }
+
+  if (!X509_up_ref (found)) {
+    return 0;
+  }
+
+  *issuer = found;
+  return 1;
+}
+
+/*
+ * X509_STORE_CTX_lookup_certs_fn adding the certificates from the index.
+ */
+STACK_OF(X509) *
+TrustStore::lookup_certs (X509_STORE_CTX *const ctx, LookupName *const name)
+{
+  const TrustStore *const self = static_cast<const TrustStore*> (
+    X509_STORE_get_ex_data (X509_STORE_CTX_get0_store (ctx), ex_data_index ()));
+
+  STACK_OF(X509) *certs = X509_STORE_CTX_get1_certs (ctx, name);
+  try {
+    if (!certs) {
+      certs = sk_X509_new_null ();
+    }
+
+    if (certs) {
+      self->m_index->find_by_subject (name, certs);
     }
   }
-  catch (const std::exception& e) {
-    std::cerr << "Error: " << e.what () << '\n';
-    return EXIT_FAILURE;
+  catch (const std::exception&) {
+    // just those found so far
   }
-  catch (...) {
-    std::cerr << "Unknown error\n";
-    return EXIT_FAILURE;
+
+  if (certs && sk_X509_num (certs) == 0) {
+    sk_X509_free (certs);
+    certs = nullptr;
+  }
+
+  return certs;
+}
+
+X509 *
+TrustStore::find_issuer (X509 *const cert) const
+{
+  // The authority key identifier (if any) pinpoints the issuer.
+  const ASN1_OCTET_STRING *const key_id = X509_get0_authority_key_id (cert);
+  if (key_id) {
+    const auto it = m_by_key_id.find (key_id_string (key_id));
+    if (it != m_by_key_id.end () &&
+	X509_check_issued (it->second, cert) == X509_V_OK) {
+      return it->second;
+    }
+  }
+
+  // Otherwise, like OpenSSL, prefer an issuer that's currently valid.
+  X509 *found = nullptr;
+  const auto range =
+    m_by_subject.equal_range (X509_NAME_hash (X509_get_issuer_name (cert)));
+  for (auto it = range.first; it != range.second; ++it) {
+    if (X509_check_issued (it->second, cert) != X509_V_OK) {
+      continue;
+    }
+
+    found = it->second;
+    if (X509_cmp_current_time (X509_get0_notBefore (found)) < 0 &&
+	X509_cmp_current_time (X509_get0_notAfter (found)) > 0) {
+      break;
+    }
+  }
+
+  if (!found && m_index) {
+    found = m_index->find_issuer (cert);
   }
 
-  return EXIT_SUCCESS;
+  return found;
+}
+
+/*
+ * Successfully built and verified chains remembered across runs, keyed by
+ * the leaf certificate fingerprint.
+ *
+ * An entry is only used with the same trusted and untrusted certificates it
+ * was built with (the context).  The cache file is a text file, a line per
+ * entry:
+ *
+ *   <leaf fingerprint> <context> <notAfter> <issuer fingerprint>,...
+ *
+ * The file isn't trusted: the issuers are looked up among the untrusted
+ * certificates and in the trusted store (the last one has to be trusted),
+ * and the links, their CA flags, path lengths, validity and signatures are
+ * checked again.  That's still much cheaper than building the chain: only
+ * the leaf's signature is verified every time, the issuers' ones once per
+ * process.  Name constraints and policies aren't checked again.
+ *
+ * It's loaded as a whole and written back (replaced) if anything changed.
+ * Concurrent writers don't corrupt it but only the last one's entries survive.
+ * Within a process, it can be used from many threads.
+ */
+class ChainCache
+{
+public:
+  ChainCache (const std::string& path, const std::string& context,
+	      STACK_OF(X509) *untrusted);
+
+  /*
+   * Get the chain of <leaf> to verify in <ctx> (initialised with the trusted
+   * store and the untrusted certificates) or nullptr if there's no valid
+   * entry.
+   */
+  scoped_ptr<STACK_OF(X509)>
+  find (X509_STORE_CTX *ctx, X509 *leaf) const;
+
+  void
+  insert (X509 *leaf, STACK_OF(X509) *chain);
+
+  /*
+   * Write the cache back if it changed.  Expired entries are dropped.
+   * A failure is only reported as a warning.
+   */
+  void
+  save () const;
+
+private:
+  struct Entry
+  {
+    std::string context;
+    // when the first certificate in the chain expires (to drop the entry)
+    std::time_t not_after;
+    // fingerprints of the issuers, the leaf's one first
+    std::vector<std::string> chain;
+  };
+
+  X509 *
+  find_issuer (X509_STORE_CTX *ctx, X509 *cert, const std::string& issuer,
+	       bool trusted, scoped_ptr<X509>& reference) const;
+
+  bool
+  check_link (X509 *cert, const std::string& cert_fingerprint, X509 *issuer,
+	      const std::string& issuer_fingerprint, std::size_t depth) const;
+
+  const std::string m_path;
+  const std::string m_context;
+  // by fingerprint
+  std::unordered_map<std::string, X509*> m_untrusted;
+  mutable std::mutex m_mutex;
+  std::unordered_map<std::string, std::shared_ptr<const Entry>> m_entries;
+  // certificate and issuer fingerprints of the signatures verified
+  mutable std::unordered_set<std::string> m_verified;
+  bool m_dirty;
+};
+
+ChainCache::ChainCache (const std::string& path, const std::string& context,
+			STACK_OF(X509) *const untrusted)
+  : m_path (path), m_context (context), m_dirty (false)
+{
+  for (int i = 0; i < sk_X509_num (untrusted); ++i) {
+    X509 *const cert = sk_X509_value (untrusted, i);
+    m_untrusted.emplace (fingerprint (cert), cert);
+  }
+
+  // a missing cache is just empty
+  std::ifstream in (path);
+  std::string line;
+  while (std::getline (in, line)) {
+    std::istringstream fields (line);
+    std::string leaf;
+    std::string chain;
+    std::shared_ptr<Entry> entry (new Entry);
+    if (!(fields >> leaf >> entry->context >> entry->not_after >> chain)) {
+      continue;
+    }
+
+    std::istringstream certs (chain);
+    for (std::string cert; std::getline (certs, cert, ','); ) {
+      entry->chain.push_back (cert);
+    }
+
+    m_entries[leaf] = entry;
+  }
+}
+
+/*
+ * Whether <cert> is valid now.
+ */
+bool
+valid_now (X509 *const cert)
+{
+  return X509_cmp_current_time (X509_get0_notBefore (cert)) < 0 &&
+    X509_cmp_current_time (X509_get0_notAfter (cert)) > 0;
+}
+
+/*
+ * Find the issuer of <cert> with fingerprint <issuer>, among the untrusted
+ * certificates unless it has to be <trusted>, or in the trusted store of
+ * <ctx> (keeping the <reference> it returns).
+ */
+X509 *
+ChainCache::find_issuer (X509_STORE_CTX *const ctx, X509 *const cert,
+			 const std::string& issuer, const bool trusted,
+			 scoped_ptr<X509>& reference) const
+{
+  if (!trusted) {
+    const auto it = m_untrusted.find (issuer);
+    if (it != m_untrusted.end ()) {
+      return it->second;
+    }
+  }
+
+  X509 *found = nullptr;
+  if (X509_STORE_CTX_get_get_issuer (ctx) (&found, ctx, cert) <= 0 || !found) {
+    return nullptr;
+  }
+
+  reference = make_scoped (found, X509_free);
+  return fingerprint (found) == issuer ? found : nullptr;
+}
+
+/*
+ * Check that <issuer> is a CA valid now which issued and signed <cert> with
+ * <depth> CAs between it and the leaf.  The fingerprints identify a signature
+ * already verified.
+ */
+bool
+ChainCache::check_link (X509 *const cert, const std::string& cert_fingerprint,
+			X509 *const issuer,
+			const std::string& issuer_fingerprint,
+			const std::size_t depth) const
+{
+  const long path_length = X509_get_pathlen (issuer);
+  if (X509_check_issued (issuer, cert) != X509_V_OK ||
+      X509_check_ca (issuer) <= 0 || !valid_now (issuer) ||
+      (path_length >= 0 && depth > static_cast<unsigned long> (path_length))) {
+    return false;
+  }
+
+  // The leaf's signature is verified every time, the others only once.
+  const std::string link = cert_fingerprint + issuer_fingerprint;
+  if (depth > 0) {
+    std::lock_guard<std::mutex> lock (m_mutex);
+    if (m_verified.count (link)) {
+      return true;
+    }
+  }
+
+  if (X509_verify (cert, X509_get0_pubkey (issuer)) <= 0) {
+    ERR_clear_error ();
+    return false;
+  }
+
+  if (depth > 0) {
+    std::lock_guard<std::mutex> lock (m_mutex);
+    m_verified.insert (link);
+  }
+
+  return true;
+}
+
+scoped_ptr<STACK_OF(X509)>
+ChainCache::find (X509_STORE_CTX *const ctx, X509 *const leaf) const
+{
+  const std::string key = fingerprint (leaf);
+  std::shared_ptr<const Entry> entry;
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+    const auto it = m_entries.find (key);
+    if (it == m_entries.end ()) {
+      return nullptr;
+    }
+
+    entry = it->second;
+  }
+
+  if (entry->context != m_context || entry->chain.empty () ||
+      !valid_now (leaf)) {
+    return nullptr;
+  }
+
+  scoped_ptr<STACK_OF(X509)> chain =
+    make_scoped (
+      sk_X509_new_null (),
+      [](STACK_OF(X509)* const s) { sk_X509_pop_free (s, X509_free); });
+  if (!chain || !X509_up_ref (leaf)) {
+    return nullptr;
+  }
+
+  if (!sk_X509_push (chain.get (), leaf)) {
+    X509_free (leaf);
+    return nullptr;
+  }
+
+  X509 *cert = leaf;
+  const std::string *cert_fingerprint = &key;
+  for (std::size_t i = 0; i < entry->chain.size (); ++i) {
+    const std::string& issuer_fingerprint = entry->chain[i];
+    scoped_ptr<X509> reference;
+    X509 *const issuer =
+      find_issuer (ctx, cert, issuer_fingerprint, i + 1 == entry->chain.size (),
+		   reference);
+    if (!issuer ||
+	!check_link (cert, *cert_fingerprint, issuer, issuer_fingerprint, i) ||
+	!X509_up_ref (issuer)) {
+      return nullptr;
+    }
+
+    if (!sk_X509_push (chain.get (), issuer)) {
+      X509_free (issuer);
+      return nullptr;
+    }
+
+    cert = issuer;
+    cert_fingerprint = &issuer_fingerprint;
+  }
+
+  return chain;
+}
+
+void
+ChainCache::insert (X509 *const leaf, STACK_OF(X509) *const chain)
+{
+  // (a trusted leaf has nothing to look up)
+  if (sk_X509_num (chain) < 2) {
+    return;
+  }
+
+  std::shared_ptr<Entry> entry (new Entry);
+  entry->context = m_context;
+  entry->not_after = std::numeric_limits<std::time_t>::max ();
+  for (int i = 0; i < sk_X509_num (chain); ++i) {
+    X509 *const cert = sk_X509_value (chain, i);
+    entry->not_after = std::min (
+      entry->not_after, asn1_time_to_epoch (X509_get0_notAfter (cert)));
+    if (i > 0) {
+      entry->chain.push_back (fingerprint (cert));
+    }
+  }
+
+  const std::string key = fingerprint (leaf);
+  std::lock_guard<std::mutex> lock (m_mutex);
+  m_entries[key] = entry;
+  m_dirty = true;
+}
+
+void
+ChainCache::save () const
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  if (!m_dirty) {
+    return;
+  }
+
+  std::ostringstream out;
+  const std::time_t now = std::time (nullptr);
+  for (const auto& item : m_entries) {
+    const Entry& entry = *item.second;
+    if (entry.not_after < now) {
+      continue;
+    }
+
+    out << item.first << ' ' << entry.context << ' ' << entry.not_after << ' ';
+    for (std::size_t i = 0; i < entry.chain.size (); ++i) {
+      out << (i ? "," : "") << entry.chain[i];
+    }
+
+    out << '\n';
+  }
+
+  // the cache is just an optimisation, the verification results stand
+  try {
+    replace_file (m_path, out.str (), 0600, "cache file");
+  }
+  catch (const std::exception& e) {
+    std::cerr << "Warning: " << e.what () << '\n';
+  }
+}
+
+/*
+ * The context a chain is built in: the trusted certificates and
+ * the <untrusted> ones.  It's a digest, so it's short and has no spaces.
+ */
+std::string
+chain_context (const TrustStore& trusted, STACK_OF(X509) *const untrusted)
+{
+  std::string context = trusted.identity ();
+  for (int i = 0; i < sk_X509_num (untrusted); ++i) {
+    context += fingerprint (sk_X509_value (untrusted, i)) + ';';
+  }
+
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int length = 0;
+  if (!EVP_Digest (context.data (), context.size (), md, &length,
+		   EVP_sha256 (), nullptr)) {
+    throw std::runtime_error ("Cannot calculate chain context");
+  }
+
+  return to_hex (md, length);
+}
+
+/*
+ * SHA-256 digest of <length> bytes of <data>.
+ */
+std::string
+sha256 (const void *const data, const std::size_t length)
+{
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int md_length = 0;
+  if (!EVP_Digest (data, length, md, &md_length, EVP_sha256 (), nullptr)) {
+    throw std::runtime_error ("Cannot calculate SHA-256 digest");
+  }
+
+  return std::string (reinterpret_cast<const char*> (md), md_length);
+}
+
+/*
+ * Serial numbers revoked by a CRL as a hash table.  Parsing a big CRL is
+ * slow, so with a cache directory the table is built once and then
+ * memory-mapped from file <SHA-256 of the CRL>.crlx in the directory.  The file
+ * consists of:
+ *
+ *   Header
+ *   Slot[slot_count]   open addressing, an empty slot has zero length
+ *   issuer name        DER
+ *   authority key ID   DER, if the CRL has one
+ *
+ * The table is only as trustworthy as the cache directory, which has to be
+ * private.  Nothing about the signature is recorded: it's verified again by
+ * every process, over the signed part of the CRL without parsing the revoked
+ * certificates.
+ *
+ * Only complete CRLs are indexed, as a serial number missing from any other
+ * one doesn't mean the certificate isn't revoked.
+ */
+class CrlIndex
+{
+public:
+  /*
+   * Index CRL <crl_path> in <cache_dir>, or in memory if it's empty.
+   */
+  CrlIndex (const std::string& crl_path, const std::string& cache_dir);
+
+  ~CrlIndex ();
+
+  CrlIndex (const CrlIndex&) = delete;
+  CrlIndex& operator= (const CrlIndex&) = delete;
+
+  /*
+   * Is this a CRL of <issuer> (by the name and the authority key ID)?
+   */
+  bool
+  issued_by (X509 *issuer) const;
+
+  /*
+   * Check <cert> issued by <issuer> and return X509_V_OK or a X509_V_ERR_*
+   * code (including X509_V_ERR_CERT_REVOKED).
+   */
+  int
+  check (X509 *cert, X509 *issuer) const;
+
+private:
+  static const char MAGIC[8];
+  static const std::uint32_t VERSION = 3;
+  static const std::size_t SERIAL_SIZE = 30;
+
+  struct Header
+  {
+    char magic[sizeof (MAGIC)];
+    std::uint32_t version;
+    std::uint32_t reserved;
+    // SHA-256 of the CRL (DER)
+    unsigned char digest[32];
+    std::int64_t this_update;
+    // zero if there's no next update
+    std::int64_t next_update;
+    std::uint64_t slot_count;
+    std::uint64_t issuer_offset;
+    std::uint64_t issuer_length;
+    // zero length if there's no authority key ID
+    std::uint64_t akid_offset;
+    std::uint64_t akid_length;
+  };
+
+  struct Slot
+  {
+    std::uint8_t length;
+    // serial numbers are signed (even if negative ones are invalid)
+    std::uint8_t negative;
+    unsigned char serial[SERIAL_SIZE];
+  };
+
+  static std::uint64_t
+  hash (const unsigned char *data, std::size_t length, bool negative);
+
+  void
+  read_der ();
+
+  scoped_ptr<X509_CRL>
+  parse () const;
+
+  std::string
+  build () const;
+
+  bool
+  map (const std::string& path);
+
+  static bool
+  decode_akid (const void *data, scoped_ptr<AUTHORITY_KEYID>& akid);
+
+  bool
+  verify_signature (EVP_PKEY *key) const;
+
+  const Header *
+  header () const
+  {
+    return static_cast<const Header*> (m_data);
+  }
+
+  const std::string m_crl_path;
+  std::vector<unsigned char> m_der;
+  std::string m_digest;
+  // the index built by this process (empty if it's mapped)
+  std::string m_built;
+  const void *m_data;
+  std::size_t m_size;
+  // null if the CRL has no authority key ID
+  scoped_ptr<AUTHORITY_KEYID> m_akid;
+
+  mutable std::mutex m_mutex;
+  // SHA-256 of the public key the signature was verified with (if any)
+  mutable std::string m_verified_key;
+};
+
+const char CrlIndex::MAGIC[8] = "CVCRLX";
+const std::uint32_t CrlIndex::VERSION;
+const std::size_t CrlIndex::SERIAL_SIZE;
+
+CrlIndex::CrlIndex (const std::string& crl_path, const std::string& cache_dir)
+  : m_crl_path (crl_path), m_data (nullptr), m_size (0)
+{
+  read_der ();
+  m_digest = sha256 (m_der.data (), m_der.size ());
+
+  const std::string path = cache_dir.empty ()
+    ? std::string ()
+    : cache_dir + '/' + to_hex (
+      reinterpret_cast<const unsigned char*> (m_digest.data ()),
+      m_digest.size ()) + ".crlx";
+  if (!path.empty () && map (path)) {
+    return;
+  }
+
+  m_built = build ();
+  if (!decode_akid (m_built.data (), m_akid)) {
+    throw std::runtime_error ("Cannot read CRL authority key ID: "
+			      + m_crl_path);
+  }
+
+  if (!path.empty ()) {
+    replace_file (path, m_built, 0600, "CRL index");
+  }
+
+  m_data = m_built.data ();
+  m_size = m_built.size ();
+}
+
+CrlIndex::~CrlIndex ()
+{
+  if (m_built.empty () && m_data) {
+    ::munmap (const_cast<void*> (m_data), m_size);
+  }
+}
+
+std::uint64_t
+CrlIndex::hash (const unsigned char *const data, const std::size_t length,
+		const bool negative)
+{
+  // FNV-1a
+  std::uint64_t hash = 14695981039346656037ULL;
+  for (std::size_t i = 0; i < length; ++i) {
+    hash = (hash ^ data[i]) * 1099511628211ULL;
+  }
+
+  return (hash ^ (negative ? 1 : 0)) * 1099511628211ULL;
+}
+
+void
+CrlIndex::read_der ()
+{
+  std::ifstream in (m_crl_path, std::ios::binary);
+  std::ostringstream content;
+  if (!in || !(content << in.rdbuf ())) {
+    throw std::runtime_error ("Cannot read file: " + m_crl_path);
+  }
+
+  const std::string data = content.str ();
+  const auto bio = make_scoped (
+    BIO_new_mem_buf (const_cast<char*> (data.data ()), data.size ()),
+    BIO_free);
+  if (!bio) {
+    throw std::runtime_error ("Cannot read CRL: " + m_crl_path);
+  }
+
+  // PEM or DER
+  unsigned char *der = nullptr;
+  long length = 0;
+  if (PEM_bytes_read_bio (&der, &length, nullptr, PEM_STRING_X509_CRL,
+			  bio.get (), nullptr, nullptr)) {
+    m_der.assign (der, der + length);
+    OPENSSL_free (der);
+  }
+  else {
+    m_der.assign (data.begin (), data.end ());
+  }
+
+  ERR_clear_error ();
+}
+
+scoped_ptr<X509_CRL>
+CrlIndex::parse () const
+{
+  const unsigned char *der = m_der.data ();
+  X509_CRL *const crl = d2i_X509_CRL (nullptr, &der, m_der.size ());
+  if (!crl) {
+    ERR_clear_error ();
+    throw std::runtime_error ("Cannot read CRL: " + m_crl_path);
+  }
+
+  return make_scoped (crl, X509_CRL_free);
+}
+
+/*
+ * Do CRL or CRL entry <extensions> limit what the CRL says about the issuer's
+ * certificates?  Delta CRLs, partitions (issuing distribution points),
+ * entries of other issuers (indirect CRLs) and anything else critical do.
+ */
+bool
+limits_crl_scope (const STACK_OF(X509_EXTENSION) *const extensions)
+{
+  for (int i = 0; i < sk_X509_EXTENSION_num (extensions); ++i) {
+    X509_EXTENSION *const extension = sk_X509_EXTENSION_value (extensions, i);
+    const int nid = OBJ_obj2nid (X509_EXTENSION_get_object (extension));
+    if (X509_EXTENSION_get_critical (extension) || nid == NID_delta_crl ||
+	nid == NID_issuing_distribution_point ||
+	nid == NID_certificate_issuer) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+std::string
+CrlIndex::build () const
+{
+  const auto crl = parse ();
+  if (limits_crl_scope (X509_CRL_get0_extensions (crl.get ()))) {
+    throw std::runtime_error ("Not a complete CRL: " + m_crl_path);
+  }
+
+  STACK_OF(X509_REVOKED) *const revoked = X509_CRL_get_REVOKED (crl.get ());
+  const std::size_t count = std::max (0, sk_X509_REVOKED_num (revoked));
+
+  // at most half full
+  std::size_t slot_count = 16;
+  while (slot_count < 2 * count) {
+    slot_count *= 2;
+  }
+
+  std::vector<Slot> slots (slot_count, Slot ());
+  for (std::size_t i = 0; i < count; ++i) {
+    const X509_REVOKED *const entry = sk_X509_REVOKED_value (revoked, i);
+    if (limits_crl_scope (X509_REVOKED_get0_extensions (entry))) {
+      throw std::runtime_error ("Not a complete CRL: " + m_crl_path);
+    }
+
+    const ASN1_INTEGER *const serial = X509_REVOKED_get0_serialNumber (entry);
+    const std::size_t length = ASN1_STRING_length (serial);
+    if (length == 0 || length > SERIAL_SIZE) {
+      throw std::runtime_error ("Unsupported serial number in CRL: "
+				+ m_crl_path);
+    }
+
+    const unsigned char *const data = ASN1_STRING_get0_data (serial);
+    const bool negative = ASN1_STRING_type (serial) == V_ASN1_NEG_INTEGER;
+    for (std::size_t n = hash (data, length, negative); ; ++n) {
+      Slot& slot = slots[n & (slot_count - 1)];
+      if (slot.length == 0) {
+	slot.length = length;
+	slot.negative = negative;
+	std::memcpy (slot.serial, data, length);
+	break;
+      }
+
+      if (slot.length == length && slot.negative == negative &&
+	  std::memcmp (slot.serial, data, length) == 0) {
+	break;
+      }
+    }
+  }
+
+  unsigned char *issuer = nullptr;
+  const int issuer_length = i2d_X509_NAME (X509_CRL_get_issuer (crl.get ()),
+					   &issuer);
+  if (issuer_length <= 0) {
+    throw std::runtime_error ("Cannot encode CRL issuer: " + m_crl_path);
+  }
+
+  const auto issuer_guard = make_scoped (issuer, [](unsigned char *const p) {
+      OPENSSL_free (p);
+    }
+  );
+
+  // the extension value is the DER of the AuthorityKeyIdentifier
+  const int akid_index =
+    X509_CRL_get_ext_by_NID (crl.get (), NID_authority_key_identifier, -1);
+  const ASN1_OCTET_STRING *const akid = akid_index < 0
+    ? nullptr
+    : X509_EXTENSION_get_data (X509_CRL_get_ext (crl.get (), akid_index));
+  const std::size_t akid_length = akid ? ASN1_STRING_length (akid) : 0;
+
+  Header header = Header ();
+  std::memcpy (header.magic, MAGIC, sizeof (MAGIC));
+  header.version = VERSION;
+  std::memcpy (header.digest, m_digest.data (), sizeof (header.digest));
+  header.this_update =
+    asn1_time_to_epoch (X509_CRL_get0_lastUpdate (crl.get ()));
+  const ASN1_TIME *const next_update = X509_CRL_get0_nextUpdate (crl.get ());
+  header.next_update = next_update ? asn1_time_to_epoch (next_update) : 0;
+  header.slot_count = slot_count;
+  header.issuer_offset = sizeof (Header) + slot_count * sizeof (Slot);
+  header.issuer_length = issuer_length;
+  header.akid_offset = header.issuer_offset + issuer_length;
+  header.akid_length = akid_length;
+
+  std::string index (reinterpret_cast<const char*> (&header), sizeof (header));
+  index.append (reinterpret_cast<const char*> (slots.data ()),
+		slot_count * sizeof (Slot));
+  index.append (reinterpret_cast<const char*> (issuer), issuer_length);
+  if (akid) {
+    index.append (reinterpret_cast<const char*> (ASN1_STRING_get0_data (akid)),
+		  akid_length);
+  }
+
+  return index;
+}
+
+/*
+ * Map index <path> (read-only) if it's valid and built from our CRL.
+ */
+bool
+CrlIndex::map (const std::string& path)
+{
+  const int fd = ::open (path.c_str (), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct ::stat st;
+  void *data = MAP_FAILED;
+  if (::fstat (fd, &st) == 0 &&
+      static_cast<std::size_t> (st.st_size) >= sizeof (Header)) {
+    data = ::mmap (nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+
+  ::close (fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+
+  const std::size_t size = st.st_size;
+  const Header *const h = static_cast<const Header*> (data);
+  const std::uint64_t slot_count = h->slot_count;
+  if (std::memcmp (h->magic, MAGIC, sizeof (MAGIC)) != 0 ||
+      h->version != VERSION ||
+      std::memcmp (h->digest, m_digest.data (), sizeof (h->digest)) != 0 ||
+      slot_count == 0 || (slot_count & (slot_count - 1)) != 0 ||
+      (size - sizeof (Header)) / sizeof (Slot) < slot_count ||
+      h->issuer_offset != sizeof (Header) + slot_count * sizeof (Slot) ||
+      size - h->issuer_offset < h->issuer_length ||
+      h->akid_offset != h->issuer_offset + h->issuer_length ||
+      size - h->akid_offset < h->akid_length ||
+      !decode_akid (data, m_akid)) {
+    ::munmap (data, size);
+    return false;
+  }
+
+  m_data = data;
+  m_size = size;
+  return true;
+}
+
+/*
+ * Decode the authority key ID of index <data> into <akid> (null if there's
+ * none).
+ */
+bool
+CrlIndex::decode_akid (const void *const data,
+		       scoped_ptr<AUTHORITY_KEYID>& akid)
+{
+  const Header *const h = static_cast<const Header*> (data);
+  if (h->akid_length == 0) {
+    akid.reset ();
+    return true;
+  }
+
+  const unsigned char *p =
+    static_cast<const unsigned char*> (data) + h->akid_offset;
+  akid = make_scoped (d2i_AUTHORITY_KEYID (nullptr, &p, h->akid_length),
+		      AUTHORITY_KEYID_free);
+  ERR_clear_error ();
+  return akid != nullptr;
+}
+
+/*
+ * Verify the CRL signature with <key>.  Only the outer structure of the CRL
+ * is decoded and the signed part (tbsCertList) is digested as it is.
+ */
+bool
+CrlIndex::verify_signature (EVP_PKEY *const key) const
+{
+  // CertificateList ::= SEQUENCE { tbsCertList, signatureAlgorithm, signature }
+  const unsigned char *p = m_der.data ();
+  long length = 0;
+  int tag = 0;
+  int xclass = 0;
+  if (ASN1_get_object (&p, &length, &tag, &xclass, m_der.size ())
+      != V_ASN1_CONSTRUCTED || tag != V_ASN1_SEQUENCE) {
+    return false;
+  }
+
+  const unsigned char *const end = p + length;
+  const unsigned char *const tbs = p;
+  if (ASN1_get_object (&p, &length, &tag, &xclass, end - p)
+      != V_ASN1_CONSTRUCTED || tag != V_ASN1_SEQUENCE) {
+    return false;
+  }
+
+  p += length;
+  const std::size_t tbs_length = p - tbs;
+  const auto algorithm =
+    make_scoped (d2i_X509_ALGOR (nullptr, &p, end - p), X509_ALGOR_free);
+  const auto signature =
+    make_scoped (d2i_ASN1_BIT_STRING (nullptr, &p, end - p),
+		 ASN1_BIT_STRING_free);
+  if (!algorithm || !signature || (signature->flags & 0x07) != 0) {
+    return false;
+  }
+
+  int md_nid = NID_undef;
+  int key_nid = NID_undef;
+  if (!OBJ_find_sigid_algs (OBJ_obj2nid (algorithm->algorithm), &md_nid,
+			    &key_nid) || md_nid == NID_undef) {
+    // RSA-PSS, EdDSA...  OpenSSL knows what to do with them
+    return X509_CRL_verify (parse ().get (), key) > 0;
+  }
+
+  const EVP_MD *const md = EVP_get_digestbynid (md_nid);
+  if (!md || EVP_PKEY_type (key_nid) != EVP_PKEY_base_id (key)) {
+    return false;
+  }
+
+  const auto ctx = make_scoped (EVP_MD_CTX_new (), EVP_MD_CTX_free);
+  return ctx &&
+    EVP_DigestVerifyInit (ctx.get (), nullptr, md, nullptr, key) > 0 &&
+    EVP_DigestVerifyUpdate (ctx.get (), tbs, tbs_length) > 0 &&
+    EVP_DigestVerifyFinal (ctx.get (), signature->data, signature->length) > 0;
+}
+
+bool
+CrlIndex::issued_by (X509 *const issuer) const
+{
+  unsigned char *name = nullptr;
+  const int length = i2d_X509_NAME (X509_get_subject_name (issuer), &name);
+  if (length <= 0) {
+    return false;
+  }
+
+  const bool issued =
+    static_cast<std::uint64_t> (length) == header ()->issuer_length &&
+    std::memcmp (static_cast<const char*> (m_data) + header ()->issuer_offset,
+		 name, length) == 0;
+  OPENSSL_free (name);
+
+  // a CA with the same name (e.g. after a key rollover) isn't the issuer;
+  // X509_check_akid () looks at the cached extensions
+  X509_get_extension_flags (issuer);
+  return issued && X509_check_akid (issuer, m_akid.get ()) == X509_V_OK;
+}
+
+int
+CrlIndex::check (X509 *const cert, X509 *const issuer) const
+{
+  // all key usages if there's no extension
+  if (!(X509_get_key_usage (issuer) & KU_CRL_SIGN)) {
+    return X509_V_ERR_KEYUSAGE_NO_CRL_SIGN;
+  }
+
+  // Is the CRL really from the issuer?
+  unsigned char key[EVP_MAX_MD_SIZE];
+  unsigned int key_length = 0;
+  if (!X509_pubkey_digest (issuer, EVP_sha256 (), key, &key_length)) {
+    throw std::runtime_error ("Cannot calculate issuer key digest");
+  }
+
+  {
+    const std::string key_digest (reinterpret_cast<const char*> (key),
+				  key_length);
+    std::lock_guard<std::mutex> lock (m_mutex);
+    if (m_verified_key != key_digest) {
+      EVP_PKEY *const issuer_key = X509_get_pubkey (issuer);
+      const bool verified = issuer_key && verify_signature (issuer_key);
+      EVP_PKEY_free (issuer_key);
+      ERR_clear_error ();
+      if (!verified) {
+	return X509_V_ERR_CRL_SIGNATURE_FAILURE;
+      }
+
+      // no need to verify again in this process
+      m_verified_key = key_digest;
+    }
+  }
+
+  const std::time_t now = std::time (nullptr);
+  if (now < header ()->this_update) {
+    return X509_V_ERR_CRL_NOT_YET_VALID;
+  }
+
+  if (header ()->next_update && header ()->next_update < now) {
+    return X509_V_ERR_CRL_HAS_EXPIRED;
+  }
+
+  const ASN1_INTEGER *const serial = X509_get0_serialNumber (cert);
+  const std::size_t length = ASN1_STRING_length (serial);
+  const unsigned char *const data = ASN1_STRING_get0_data (serial);
+  const bool negative = ASN1_STRING_type (serial) == V_ASN1_NEG_INTEGER;
+  const Slot *const slots = reinterpret_cast<const Slot*> (header () + 1);
+  const std::uint64_t mask = header ()->slot_count - 1;
+  for (std::uint64_t n = hash (data, length, negative); ; ++n) {
+    const Slot& slot = slots[n & mask];
+    if (slot.length == 0) {
+      return X509_V_OK;
+    }
+
+    if (slot.length == length && slot.negative == negative &&
+	std::memcmp (slot.serial, data, length) == 0) {
+      return X509_V_ERR_CERT_REVOKED;
+    }
+  }
+}
+
+/*
+ * Offline revocation checking of verified chains with local CRLs and
+ * (stapled) OCSP responses.  Like X509_V_FLAG_CRL_CHECK, the status of
+ * the leaf certificate must be known; intermediate certificates are checked
+ * if there's a CRL or OCSP response for them.  An OCSP response is preferred
+ * to a CRL.
+ */
+class RevocationChecker
+{
+public:
+  explicit RevocationChecker (const TrustStore& trusted);
+
+  /*
+   * Add CRL <path>, indexed in <cache_dir> (if it's not empty).
+   */
+  void
+  add_crl (const std::string& path, const std::string& cache_dir);
+
+  void
+  add_ocsp (const std::string& path);
+
+  /*
+   * Check all certificates in (verified) <chain>.  On failure, the error,
+   * its depth and the certificate are set in <ctx>.
+   */
+  bool
+  check (X509_STORE_CTX *ctx, STACK_OF(X509) *chain) const;
+
+private:
+  // X509_V_OK, X509_V_ERR_*, or -1 if there's no status
+  int
+  check_ocsp (X509 *cert, X509 *issuer, STACK_OF(X509) *chain) const;
+
+  int
+  check_crl (X509 *cert, X509 *issuer) const;
+
+  const TrustStore& m_trusted;
+  std::vector<std::unique_ptr<CrlIndex>> m_crls;
+  std::vector<scoped_ptr<OCSP_BASICRESP>> m_responses;
+};
+
+RevocationChecker::RevocationChecker (const TrustStore& trusted)
+  : m_trusted (trusted)
+{
+}
+
+void
+RevocationChecker::add_crl (const std::string& path,
+			    const std::string& cache_dir)
+{
+  m_crls.emplace_back (new CrlIndex (path, cache_dir));
+}
+
+void
+RevocationChecker::add_ocsp (const std::string& path)
+{
+  const auto bio = make_scoped (BIO_new_file (path.c_str (), "r"), BIO_free);
+  if (!bio) {
+    throw std::runtime_error ("Cannot open file: " + path);
+  }
+
+  const auto response =
+    make_scoped (d2i_OCSP_RESPONSE_bio (bio.get (), nullptr),
+		 OCSP_RESPONSE_free);
+  if (!response) {
+    throw std::runtime_error ("Cannot read OCSP response: " + path);
+  }
+
+  if (OCSP_response_status (response.get ())
+      != OCSP_RESPONSE_STATUS_SUCCESSFUL) {
+    throw std::runtime_error ("Unsuccessful OCSP response: " + path);
+  }
+
+  OCSP_BASICRESP *const basic = OCSP_response_get1_basic (response.get ());
+  if (!basic) {
+    throw std::runtime_error ("Cannot decode OCSP response: " + path);
+  }
+
+  m_responses.push_back (make_scoped (basic, OCSP_BASICRESP_free));
+}
+
+int
+RevocationChecker::check_ocsp (X509 *const cert, X509 *const issuer,
+			       STACK_OF(X509) *const chain) const
+{
+  const auto id =
+    make_scoped (OCSP_cert_to_id (nullptr, cert, issuer), OCSP_CERTID_free);
+  if (!id) {
+    throw std::runtime_error ("Cannot create OCSP certificate ID");
+  }
+
+  for (const auto& response : m_responses) {
+    int status = -1;
+    int reason = -1;
+    ASN1_GENERALIZEDTIME *revoked = nullptr;
+    ASN1_GENERALIZEDTIME *this_update = nullptr;
+    ASN1_GENERALIZEDTIME *next_update = nullptr;
+    if (!OCSP_resp_find_status (response.get (), id.get (), &status, &reason,
+				&revoked, &this_update, &next_update)) {
+      continue;
+    }
+
+    // signed by the issuer or a responder it delegated to
+    if (OCSP_basic_verify (response.get (), chain, m_trusted.get (), 0) <= 0 ||
+	!OCSP_check_validity (this_update, next_update, 5 * 60, -1)) {
+      ERR_clear_error ();
+      return X509_V_ERR_OCSP_VERIFY_FAILED;
+    }
+
+    switch (status) {
+    case V_OCSP_CERTSTATUS_GOOD:
+      return X509_V_OK;
+
+    case V_OCSP_CERTSTATUS_REVOKED:
+      return X509_V_ERR_CERT_REVOKED;
+
+    default:
+      // maybe there's a CRL
+      return -1;
+    }
+  }
+
+  return -1;
+}
+
+int
+RevocationChecker::check_crl (X509 *const cert, X509 *const issuer) const
+{
+  for (const auto& crl : m_crls) {
+    if (crl->issued_by (issuer)) {
+      return crl->check (cert, issuer);
+    }
+  }
+
+  return -1;
+}
+
+bool
+RevocationChecker::check (X509_STORE_CTX *const ctx,
+			  STACK_OF(X509) *const chain) const
+{
+  // the root (the last one) is trusted as it is
+  for (int depth = 0; depth < sk_X509_num (chain) - 1; ++depth) {
+    X509 *const cert = sk_X509_value (chain, depth);
+    X509 *const issuer = sk_X509_value (chain, depth + 1);
+
+    int error = check_ocsp (cert, issuer, chain);
+    if (error < 0) {
+      error = check_crl (cert, issuer);
+    }
+
+    if (error < 0) {
+      error = depth == 0 ? X509_V_ERR_UNABLE_TO_GET_CRL : X509_V_OK;
+    }
+
+    if (error != X509_V_OK) {
+      X509_STORE_CTX_set_error_depth (ctx, depth);
+      X509_STORE_CTX_set_current_cert (ctx, cert);
+      X509_STORE_CTX_set_error (ctx, error);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/*
+ * What went wrong in a failed verification.  It's filled in without any
+ * intermediate buffers, so that it's cheap even if most of many
+ * verifications fail (e.g. because of expired certificates).
+ */
+struct VerificationFailure
+{
+  int error;
+  // at what certificate level the verification failed
+  int depth;
+  // The rest is about the culprit certificate, zero (empty) if the error is
+  // not related to any specific certificate.
+  unsigned long subject_hash;
+  // seconds since the epoch
+  std::time_t not_before;
+  std::time_t not_after;
+  // X509_NAME_oneline() format, truncated if too long
+  char subject[256];
+};
+
+/*
+ * Convert ASN1 <time> into seconds since the epoch, zero on failure.
+ */
+std::time_t
+asn1_time_to_epoch_or_zero (const ASN1_TIME *const time)
+{
+  struct std::tm tm;
+  return time && ASN1_TIME_to_tm (time, &tm) ? ::timegm (&tm) : 0;
+}
+
+/*
+ * Fill in <failure> from the failed verification in <ctx>.
+ */
+void
+get_verification_failure (X509_STORE_CTX *const ctx,
+			  VerificationFailure& failure)
+{
+  failure.error = X509_STORE_CTX_get_error (ctx);
+  failure.depth = X509_STORE_CTX_get_error_depth (ctx);
+  failure.subject_hash = 0;
+  failure.not_before = 0;
+  failure.not_after = 0;
+  failure.subject[0] = '\0';
+
+  // It is possible that the cert is deliberately set to NULL and the error
+  // is not related to any specific certificate.
+  X509 *const cert = X509_STORE_CTX_get_current_cert (ctx);
+  if (!cert) {
+    return;
+  }
+
+  X509_NAME *const subject = X509_get_subject_name (cert);
+  if (subject) {
+    failure.subject_hash = X509_NAME_hash (subject);
+    X509_NAME_oneline (subject, failure.subject, sizeof (failure.subject));
+  }
+
+  failure.not_before = asn1_time_to_epoch_or_zero (X509_get0_notBefore (cert));
+  failure.not_after = asn1_time_to_epoch_or_zero (X509_get0_notAfter (cert));
+}
+
+/*
+ * Print <time> like ASN1_TIME_print() does.
+ */
+void
+print_time (const std::time_t time, std::ostream& out)
+{
+  struct std::tm tm;
+  char buffer[32];
+  if (::gmtime_r (&time, &tm) &&
+      std::strftime (buffer, sizeof (buffer), "%b %e %H:%M:%S %Y GMT", &tm)) {
+    out << buffer;
+  }
+}
+
+/*
+ * Print a message for a failed verification.
+ */
+void
+print_verification_failure_msg (const VerificationFailure& failure,
+				std::ostream& out)
+{
+  // It's worth to know at what certificate level the verification failed.
+  out << X509_verify_cert_error_string (failure.error)
+      << " (at level " << failure.depth << ')';
+
+  // Maybe we know something about the culprit...
+  if (failure.subject[0]) {
+    out << '\n' << failure.subject;
+  }
+
+  switch (failure.error)
+  {
+  case X509_V_ERR_CERT_NOT_YET_VALID:
+  case X509_V_ERR_CERT_HAS_EXPIRED:
+    // If it's something to do with certificate validity dates (one of the most
+    // common failure reasons), let's tell more about them.
+    if (failure.not_before || failure.not_after) {
+      out << "\nnotBefore: ";
+      print_time (failure.not_before, out);
+      out << "\nnotAfter: ";
+      print_time (failure.not_after, out);
+    }
+
+    break;
+  }
+
+  out << std::endl;
+}
+
+/*
+ * Print <str> as a JSON string.
+ */
+void
+print_json_string (char const *str, std::ostream& out)
+{
+  static const char HEX[] = "0123456789abcdef";
+  out << '"';
+  for (; *str; ++str) {
+    const unsigned char c = *str;
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    }
+    else if (c < 0x20) {
+      out << "\\u00" << HEX[c >> 4] << HEX[c & 0xf];
+    }
+    else {
+      out << c;
+    }
+  }
+
+  out << '"';
+}
+
+/*
+ * Print the result of verifying <name> as a single line JSON object:
+ * successful if <failure> and <error> are null, failed verification if
+ * <failure> isn't null or an <error> (exception message) otherwise.
+ */
+void
+print_json_result (char const *const name,
+		   const VerificationFailure *const failure,
+		   char const *const error, std::ostream& out)
+{
+  out << "{\"name\":";
+  print_json_string (name, out);
+  if (failure) {
+    out << ",\"result\":\"failed\",\"error\":" << failure->error
+	<< ",\"message\":";
+    print_json_string (X509_verify_cert_error_string (failure->error), out);
+    out << ",\"depth\":" << failure->depth;
+    if (failure->subject[0]) {
+      char hash[sizeof (unsigned long) * 2 + 1];
+      std::snprintf (hash, sizeof (hash), "%08lx", failure->subject_hash);
+      out << ",\"subject\":";
+      print_json_string (failure->subject, out);
+      out << ",\"subject_hash\":\"" << hash << "\",\"not_before\":"
+	  << failure->not_before << ",\"not_after\":" << failure->not_after;
+    }
+  }
+  else if (error) {
+    out << ",\"result\":\"error\",\"message\":";
+    print_json_string (error, out);
+  }
+  else {
+    out << ",\"result\":\"OK\"";
+  }
+
+  out << "}\n";
+}
+
+/*
+ * Verify <leaf> with <untrusted> intermediates and <trusted> roots, trying
+ * the <cache> (if any) first, and check the chain for revocation with
+ * <revocation> (if any).  The store context <ctx> is reused: it's cleaned up
+ * and initialised again, so that its buffers don't have to be allocated for
+ * every leaf.  If the verification fails, <ctx> holds the details.
+ */
+bool
+verify_leaf (X509_STORE_CTX *const ctx, const TrustStore& trusted,
+	     X509 *const leaf, STACK_OF(X509) *const untrusted,
+	     ChainCache *const cache,
+	     const RevocationChecker *const revocation)
+{
+  X509_STORE_CTX_cleanup (ctx);
+  if (!X509_STORE_CTX_init (ctx, trusted.get (), leaf, untrusted)) {
+    throw std::runtime_error ("Cannot initialize the store context");
+  }
+
+  scoped_ptr<STACK_OF(X509)> cached;
+  if (cache) {
+    cached = cache->find (ctx, leaf);
+  }
+
+  if (cached) {
+    // as if it was just built (and to keep the certificates for errors)
+    X509_STORE_CTX_set0_verified_chain (ctx, cached.release ());
+  }
+  else {
+    const int result = X509_verify_cert (ctx);
+    if (result < 0) {
+      throw std::runtime_error ("Cannot verify certificates");
+    }
+
+    if (!result) {
+      return false;
+    }
+
+    if (cache) {
+      cache->insert (leaf, X509_STORE_CTX_get0_chain (ctx));
+    }
+  }
+
+  // a revoked certificate doesn't invalidate the cached chain
+  return
+    !revocation || revocation->check (ctx, X509_STORE_CTX_get0_chain (ctx));
+}
+
+/*
+ * A leaf certificate verified in bulk.
+ */
+struct BulkLeaf
+{
+  // file name (and the position in a bundle)
+  std::string name;
+  scoped_ptr<X509> cert;
+  bool verified;
+  // if not verified, either failure or a non-empty error is set
+  VerificationFailure failure;
+  std::string error;
+};
+
+/*
+ * Read all certificates from PEM file <path>, naming them <path>#<n> if there
+ * are more than one.
+ */
+void
+read_bulk_leaves (const std::string& path, std::vector<BulkLeaf>& leaves)
+{
+  const auto bio = make_scoped (BIO_new_file (path.c_str (), "r"), BIO_free);
+  if (!bio) {
+    throw std::runtime_error ("Cannot open file: " + path);
+  }
+
+  const std::size_t first = leaves.size ();
+  while (X509 *const cert =
+	 PEM_read_bio_X509 (bio.get (), nullptr, nullptr, nullptr)) {
+    leaves.push_back (BulkLeaf ());
+    leaves.back ().name = path;
+    leaves.back ().cert = make_scoped (cert, X509_free);
+  }
+
+  // the end of the file is reported as an error too
+  ERR_clear_error ();
+  if (leaves.size () == first) {
+    // report it rather than give up on all the other leaves
+    leaves.push_back (BulkLeaf ());
+    leaves.back ().name = path;
+    leaves.back ().error = "Cannot read certificate";
+  }
+  else if (leaves.size () - first > 1) {
+    for (std::size_t i = first; i < leaves.size (); ++i) {
+      leaves[i].name += '#' + std::to_string (i - first);
+    }
+  }
+}
+
+/*
+ * Read leaf certificates from all regular files in directory <path> or from
+ * a PEM bundle <path>.
+ */
+std::vector<BulkLeaf>
+read_bulk (const std::string& path)
+{
+  std::vector<BulkLeaf> leaves;
+
+  struct ::stat st;
+  if (::stat (path.c_str (), &st) != 0) {
+    throw std::runtime_error ("Cannot stat file: " + path);
+  }
+
+  if (!S_ISDIR (st.st_mode)) {
+    read_bulk_leaves (path, leaves);
+    return leaves;
+  }
+
+  const auto dir = make_scoped (::opendir (path.c_str ()), ::closedir);
+  if (!dir) {
+    throw std::runtime_error ("Cannot open directory: " + path);
+  }
+
+  std::vector<std::string> files;
+  while (const struct ::dirent *const entry = ::readdir (dir.get ())) {
+    const std::string file = path + '/' + entry->d_name;
+    if (::stat (file.c_str (), &st) == 0 && S_ISREG (st.st_mode)) {
+      files.push_back (file);
+    }
+  }
+
+  // stable output whatever the directory order
+  std::sort (files.begin (), files.end ());
+  for (const std::string& file : files) {
+    read_bulk_leaves (file, leaves);
+  }
+
+  return leaves;
+}
+
+void
+usage (char const *const arg0, std::ostream& out)
+{
+  out <<
+"Usage:\n"
+"\n"
+"    " << arg0 << " [<options>] <CA cert> [<untrusted cert>...] <leaf cert>\n"
+"    " << arg0 << " [<options>] --bulk <leaves> <CA cert> [<untrusted cert>...]\n"
+"    " << arg0 << " --build-ca-index <index> <CA bundle>...\n"
+"\n"
+"Verifies <leaf cert> with all optional intermediate <untrusted cert>s and\n"
+"ultimately trusted root <CA cert>.  Please note that the order of certificates\n"
+"on the command line is important: root - optional intermediates - leaf.\n"
+"<CA cert> can be a bundle of many root certificates.  It's omitted if the\n"
+"roots come from --ca-dir or --ca-index instead.\n"
+"\n"
+"With --bulk, all leaf certificates in <leaves>, a PEM bundle or a directory\n"
+"of PEM files, are verified concurrently and a result is printed for each.\n"
+"\n"
+"The exit status is zero only if all the leaf certificates are verified.\n"
+"\n"
+"Options:\n"
+"\n"
+"    --ca-dir <dir>\n"
+"        Look root certificates up in hashed directory <dir> (as prepared by\n"
+"        `openssl rehash').  Can be given more than once.\n"
+"\n"
+"    --ca-index <index>\n"
+"        Look root certificates up in <index> built by --build-ca-index.\n"
+"        Only the certificates needed are parsed.\n"
+"\n"
+"    --build-ca-index <index>\n"
+"        Write an index of all certificates in <CA bundle>s to <index>.\n"
+"\n"
+"    -c, --chain-cache <cache file>\n"
+"        Remember successfully verified chains in <cache file> (created if it\n"
+"        doesn't exist).  While the same <CA cert> and <untrusted cert>s\n"
+"        are used, the chain of <leaf cert> isn't built again, just checked:\n"
+"        the validity, CA flags and path lengths of its certificates and\n"
+"        the signature of <leaf cert> (the others' once per run).  Name\n"
+"        constraints and policies aren't checked again.\n"
+"\n"
+"    --crl <CRL file>\n"
+"        Check the revocation of the verified chain with <CRL file> (PEM or\n"
+"        DER).  Can be given more than once.  Only complete CRLs are\n"
+"        supported: delta CRLs, partitioned or indirect ones (with an\n"
+"        issuing distribution point or certificate issuers) and CRLs with\n"
+"        other critical extensions are rejected.  The issuer's key usage\n"
+"        must allow signing CRLs.\n"
+"\n"
+"    --crl-cache <dir>\n"
+"        Keep the revoked serial numbers of every <CRL file> indexed in <dir>\n"
+"        so that each CRL is parsed only once.  The index is trusted, so <dir>\n"
+"        has to be private.  CRL signatures are verified every time anyway.\n"
+"\n"
+"    --ocsp <response file>\n"
+"        Check the revocation with (stapled) DER encoded OCSP\n"
+"        <response file>.  Can be given more than once.\n"
+"\n"
+"        With --crl or --ocsp, the status of <leaf cert> must be known;\n"
+"        intermediate certificates are checked if it is.\n"
+"\n"
+"    -w, --workers <count>\n"
+"        Number of threads verifying leaves with --bulk, 1 to 1024\n"
+"        (default: number of CPUs).\n"
+"\n"
+"    -j, --json\n"
+"        Print a JSON object per verified leaf, a line each, with \"name\"\n"
+"        and \"result\" (\"OK\", \"failed\" or \"error\").  Failures have\n"
+"        the numeric \"error\", \"message\", \"depth\" and, if the failure\n"
+"        is about a certificate, its \"subject\", \"subject_hash\",\n"
+"        \"not_before\" and \"not_after\" (seconds since the epoch).\n"
+      << std::endl;
+}
+
+bool
+help_requested (const std::string& arg)
+{
+  return arg == "-h" || arg == "-help" || arg == "--help";
+}
+
+/*
+ * Command line options.
+ */
+struct Options
+{
+  // hashed directories with root certificates
+  std::vector<std::string> ca_dirs;
+  // empty if no root index is used
+  std::string ca_index;
+  // empty unless the root index is to be built
+  std::string build_ca_index;
+  // empty if no cache is used
+  std::string chain_cache;
+  // revocation information
+  std::vector<std::string> crls;
+  // empty if CRLs are indexed in memory
+  std::string crl_cache;
+  std::vector<std::string> ocsp_responses;
+  // empty if a single leaf is verified
+  std::string bulk;
+  unsigned workers = std::max (1u, std::thread::hardware_concurrency ());
+  // print results as JSON lines
+  bool json = false;
+};
+
+constexpr unsigned long MAX_WORKERS = 1024;
+
+/*
+ * Parse the number of workers <arg> into <workers>, which must be a plain
+ * decimal number between 1 and MAX_WORKERS.
+ */
+bool
+parse_workers (char const *const arg, unsigned& workers)
+{
+  // strtoul skips white space and negates "-1" into a huge count
+  if (*arg < '0' || *arg > '9') {
+    return false;
+  }
+
+  char *end = nullptr;
+  errno = 0;
+  const unsigned long count = std::strtoul (arg, &end, 10);
+  if (errno != 0 || *end != '\0' || count < 1 || count > MAX_WORKERS) {
+    return false;
+  }
+
+  workers = count;
+  return true;
+}
+
+/*
+ * Parse command line options.  On success, optind points at the first
+ * positional argument.
+ */
+bool
+parse_options (int argc, char* argv[], Options& options)
+{
+  const struct ::option long_options[] = {
+    {"chain-cache", required_argument, nullptr, 'c'},
+    {"bulk", required_argument, nullptr, 'b'},
+    {"workers", required_argument, nullptr, 'w'},
+    {"json", no_argument, nullptr, 'j'},
+    {"ca-dir", required_argument, nullptr, 'A'},
+    {"ca-index", required_argument, nullptr, 'I'},
+    {"build-ca-index", required_argument, nullptr, 'B'},
+    {"crl", required_argument, nullptr, 'R'},
+    {"crl-cache", required_argument, nullptr, 'C'},
+    {"ocsp", required_argument, nullptr, 'O'},
+    {nullptr, 0, nullptr, 0}
+  };
+
+  int opt;
+  while ((opt = ::getopt_long (argc, argv, "+c:b:w:j", long_options, nullptr))
+	 != -1) {
+    switch (opt) {
+    case 'c':
+      options.chain_cache = optarg;
+      break;
+
+    case 'b':
+      options.bulk = optarg;
+      break;
+
+    case 'j':
+      options.json = true;
+      break;
+
+    case 'A':
+      options.ca_dirs.push_back (optarg);
+      break;
+
+    case 'I':
+      options.ca_index = optarg;
+      break;
+
+    case 'B':
+      options.build_ca_index = optarg;
+      break;
+
+    case 'R':
+      options.crls.push_back (optarg);
+      break;
+
+    case 'C':
+      options.crl_cache = optarg;
+      break;
+
+    case 'O':
+      options.ocsp_responses.push_back (optarg);
+      break;
+
+    case 'w':
+      if (!parse_workers (optarg, options.workers)) {
+	std::cerr << "Invalid number of workers: " << optarg << '\n';
+	return false;
+      }
+
+      break;
+
+    default:
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/*
+ * Create a revocation checker if there's any revocation information.
+ */
+std::unique_ptr<RevocationChecker>
+make_revocation_checker (const Options& options, const TrustStore& trusted)
+{
+  std::unique_ptr<RevocationChecker> revocation;
+  if (options.crls.empty () && options.ocsp_responses.empty ()) {
+    return revocation;
+  }
+
+  revocation.reset (new RevocationChecker (trusted));
+  for (const std::string& crl : options.crls) {
+    revocation->add_crl (crl, options.crl_cache);
+  }
+
+  for (const std::string& response : options.ocsp_responses) {
+    revocation->add_ocsp (response);
+  }
+
+  return revocation;
+}
+
+/*
+ * Verify a single <leaf path> certificate.
+ */
+int
+run_single (const Options& options, const TrustStore& trusted,
+	    STACK_OF(X509) *const untrusted, char const *const leaf_path)
+{
+  // Create a X509 store context required for the verification
+  const auto ctx = make_scoped (X509_STORE_CTX_new (), X509_STORE_CTX_free);
+  if (!ctx) {
+    throw std::runtime_error ("Cannot create a store context");
+  }
+
+  // And our leaf certificate we want to verify
+  const auto cert = read_x509 (leaf_path);
+
+  // Maybe we've done it all before...
+  std::unique_ptr<ChainCache> cache;
+  if (!options.chain_cache.empty ()) {
+    cache.reset (new ChainCache (options.chain_cache,
+				 chain_context (trusted, untrusted), untrusted));
+  }
+
+  const auto revocation = make_revocation_checker (options, trusted);
+
+  // Verify!
+  const bool result = verify_leaf (ctx.get (), trusted, cert.get (), untrusted,
+				   cache.get (), revocation.get ());
+
+  VerificationFailure failure;
+  if (!result) {
+    ERR_load_X509_strings (); // required before decoding error code into a string
+    get_verification_failure (ctx.get (), failure);
+  }
+
+  if (options.json) {
+    print_json_result (leaf_path, result ? nullptr : &failure, nullptr,
+		       std::cout);
+    std::cout.flush ();
+  }
+  else {
+    std::cout << "Verification " << (result ? "OK" : "failed") << std::endl;
+    if (!result) {
+      // print something useful about the failure
+      print_verification_failure_msg (failure, std::cerr);
+    }
+  }
+
+  if (cache) {
+    cache->save ();
+  }
+
+  return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Verify all leaf certificates from <options.bulk> with a pool of threads,
+ * each reusing its own store context.
+ */
+int
+run_bulk (const Options& options, const TrustStore& trusted,
+	  STACK_OF(X509) *const untrusted)
+{
+  std::vector<BulkLeaf> leaves = read_bulk (options.bulk);
+
+  std::unique_ptr<ChainCache> cache;
+  if (!options.chain_cache.empty ()) {
+    cache.reset (new ChainCache (options.chain_cache,
+				 chain_context (trusted, untrusted), untrusted));
+  }
+
+  const auto revocation = make_revocation_checker (options, trusted);
+
+  ERR_load_X509_strings (); // required before decoding error code into a string
+
+  std::atomic<std::size_t> next (0);
+  const auto work = [&] () {
+    const auto ctx = make_scoped (X509_STORE_CTX_new (), X509_STORE_CTX_free);
+    for (std::size_t i; (i = next++) < leaves.size (); ) {
+      BulkLeaf& leaf = leaves[i];
+      if (!leaf.cert) {
+	continue;
+      }
+
+      try {
+	if (!ctx) {
+	  throw std::runtime_error ("Cannot create a store context");
+	}
+
+	leaf.verified = verify_leaf (ctx.get (), trusted, leaf.cert.get (),
+				     untrusted, cache.get (), revocation.get ());
+	if (!leaf.verified) {
+	  get_verification_failure (ctx.get (), leaf.failure);
+	}
+      }
+      catch (const std::exception& e) {
+	leaf.error = e.what ();
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  const std::size_t count =
+    std::min<std::size_t> (options.workers, leaves.size ());
+  for (std::size_t i = 1; i < count; ++i) {
+    threads.emplace_back (work);
+  }
+
+  work ();
+  for (std::thread& t : threads) {
+    t.join ();
+  }
+
+  bool all_verified = true;
+  for (const BulkLeaf& leaf : leaves) {
+    all_verified = all_verified && leaf.verified;
+    const bool failed = !leaf.verified && leaf.error.empty ();
+    if (options.json) {
+      print_json_result (leaf.name.c_str (), failed ? &leaf.failure : nullptr,
+			 leaf.error.empty () ? nullptr : leaf.error.c_str (),
+			 std::cout);
+    }
+    else if (failed) {
+      std::cout << leaf.name << ": failed: "
+		<< X509_verify_cert_error_string (leaf.failure.error)
+		<< " (at level " << leaf.failure.depth << ")\n";
+    }
+    else if (!leaf.error.empty ()) {
+      std::cout << leaf.name << ": error: " << leaf.error << '\n';
+    }
+    else {
+      std::cout << leaf.name << ": OK\n";
+    }
+  }
+
+  std::cout.flush ();
+
+  if (cache) {
+    cache->save ();
+  }
+
+  return all_verified ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int
+main (int argc, char* argv[])
+{
+  // help
+  if (argc == 2 && help_requested (argv[1])) {
+    usage (argv[0], std::cout);
+    return EXIT_SUCCESS;
+  }
+
+  // misuse
+  Options options;
+  if (!parse_options (argc, argv, options)) {
+    usage (argv[0], std::cerr);
+    return EXIT_FAILURE;
+  }
+
+  // the root CA bundle comes first unless there are other sources
+  const bool ca_bundle = options.ca_dirs.empty () && options.ca_index.empty ();
+  const int required = options.build_ca_index.empty ()
+    ? (ca_bundle ? 1 : 0) + (options.bulk.empty () ? 1 : 0)
+    : 1;
+  if (argc - optind < required) {
+    usage (argv[0], std::cerr);
+    return EXIT_FAILURE;
+  }
+
+  // This has to be called before the verification where a number of cryptographic
+  // algorithms is used (they are not available by default).
+  OpenSSL_add_all_algorithms ();
+
+  try {
+    if (!options.build_ca_index.empty ()) {
+      RootIndex::build (options.build_ca_index,
+			std::vector<std::string> (argv + optind, argv + argc));
+      return EXIT_SUCCESS;
+    }
+
+    // Let's create an (indexed) certificate store for the root CA(s)
+    TrustStore trusted;
+    for (const std::string& dir : options.ca_dirs) {
+      trusted.load_dir (dir);
+    }
+
+    if (!options.ca_index.empty ()) {
+      trusted.load_index (options.ca_index);
+    }
+
+    char const *const *first = argv + optind;
+    if (ca_bundle) {
+      trusted.load_bundle (*first++);
+    }
+
+    if (!options.bulk.empty ()) {
+      // all the remaining certificates are untrusted (intermediate) ones
+      const auto untrusted = read_untrusted (first, argv + argc);
+      return run_bulk (options, trusted, untrusted.get ());
+    }
+
+    // Now our untrusted (intermediate) certificates (if any)
+    const auto untrusted = read_untrusted (first, argv + argc - 1);
+    return run_single (options, trusted, untrusted.get (), argv[argc - 1]);
+  }
+  catch (const std::exception& e) {
+    std::cerr << "Error: " << e.what () << '\n';
+    return EXIT_FAILURE;
+  }
+  catch (...) {
+    std::cerr << "Unknown error\n";
+    return EXIT_FAILURE;
+  }
 }
@@ -1,8 +1,15 @@
 #include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
 #include <glib-unix.h>
 
+#include <errno.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 static GstElement *
 get_element_by_name (GstElement * pipeline, gchar * name)
@@ -15,24 +22,313 @@ get_element_by_name (GstElement * pipeline, gchar * name)
   return element;
 }
 
+/* Number of buffer arrivals (by PTS) remembered by a pad for a downstream
+ * pad measuring latency from it */
+#define ARRIVALS 1024
+
+#define COUNTER_ADD(counter, value) \
+  atomic_fetch_add_explicit (&(counter), (value), memory_order_relaxed)
+#define COUNTER_GET(counter) \
+  atomic_load_explicit (&(counter), memory_order_relaxed)
+
+typedef struct
+{
+  /* 2 * index + 1 while being written, 2 * index + 2 once written */
+  atomic_uint_fast64_t seq;
+  atomic_uint_fast64_t pts;
+  atomic_int_fast64_t time;
+} Arrival;
+
+typedef struct
+{
+  guint64 buffers;
+  guint64 bytes;
+  /* inter-arrival intervals (in microseconds) */
+  guint64 intervals;
+  guint64 interval_sum;
+  guint64 interval_sq_sum;
+  /* latencies (in microseconds) */
+  guint64 latencies;
+  guint64 latency_sum;
+  gint64 time;
+} PadCounters;
+
+typedef struct _PadStats PadStats;
+
+/* Statistics of the buffers going through a pad.  The counters are only
+ * written by the pad's streaming thread and read by the main loop without
+ * locking. */
+struct _PadStats
+{
+  gchar *name;
+  GstPad *pad;
+  gulong probe_id;
+
+  atomic_uint_fast64_t buffers;
+  atomic_uint_fast64_t bytes;
+  atomic_uint_fast64_t intervals;
+  atomic_uint_fast64_t interval_sum;
+  atomic_uint_fast64_t interval_sq_sum;
+  atomic_uint_fast64_t latencies;
+  atomic_uint_fast64_t latency_sum;
+  atomic_uint_fast64_t latency_max;
+
+  /* (streaming thread only) */
+  gint64 last_arrival;
+
+  /* arrivals recorded for a downstream pad, if any */
+  gboolean record_arrivals;
+  Arrival arrivals[ARRIVALS];
+  atomic_uint_fast64_t arrivals_head;
+
+  /* upstream pad the latency is measured from, if any, and the next of its
+   * arrivals to look at (streaming thread only) */
+  PadStats *from;
+  guint64 from_tail;
+
+  /* (main loop only) */
+  gint64 created;
+  PadCounters reported;
+};
+
+static PadStats *
+pad_stats_new (const gchar * name)
+{
+  PadStats *stats = g_new0 (PadStats, 1);
+
+  stats->name = g_strdup (name);
+  stats->created = g_get_monotonic_time ();
+  stats->reported.time = stats->created;
+
+  return stats;
+}
+
+static void
+pad_stats_free (PadStats * stats)
+{
+  if (stats->pad) {
+    gst_pad_remove_probe (stats->pad, stats->probe_id);
+    gst_object_unref (stats->pad);
+  }
+
+  g_free (stats->name);
+  g_free (stats);
+}
+
+static void
+pad_stats_record_arrival (PadStats * stats, GstClockTime pts, gint64 now)
+{
+  guint64 head = COUNTER_GET (stats->arrivals_head);
+  Arrival *arrival = &stats->arrivals[head % ARRIVALS];
+
+  /* readers check seq is the same before and after reading the arrival */
+  atomic_store_explicit (&arrival->seq, 2 * head + 1, memory_order_relaxed);
+  atomic_thread_fence (memory_order_release);
+  atomic_store_explicit (&arrival->pts, pts, memory_order_relaxed);
+  atomic_store_explicit (&arrival->time, now, memory_order_relaxed);
+  atomic_store_explicit (&arrival->seq, 2 * head + 2, memory_order_release);
+
+  atomic_store_explicit (&stats->arrivals_head, head + 1,
+      memory_order_release);
+}
+
+static gboolean
+pad_stats_read_arrival (PadStats * stats, guint64 index, GstClockTime * pts,
+    gint64 * time)
+{
+  Arrival *arrival = &stats->arrivals[index % ARRIVALS];
+  guint64 seq = atomic_load_explicit (&arrival->seq, memory_order_acquire);
+
+  if (seq != 2 * index + 2) {
+    /* overwritten already */
+    return FALSE;
+  }
+
+  *pts = atomic_load_explicit (&arrival->pts, memory_order_relaxed);
+  *time = atomic_load_explicit (&arrival->time, memory_order_relaxed);
+  atomic_thread_fence (memory_order_acquire);
+
+  return seq == atomic_load_explicit (&arrival->seq, memory_order_relaxed);
+}
+
+/* Measure latency of the buffer with <pts> from its arrival on the upstream
+ * pad (buffers are expected in the same order on both pads) */
+static void
+pad_stats_match_arrival (PadStats * stats, GstClockTime pts, gint64 now)
+{
+  PadStats *from = stats->from;
+  guint64 head = atomic_load_explicit (&from->arrivals_head,
+      memory_order_acquire);
+  guint64 i;
+
+  /* the oldest arrivals are gone if this pad fell behind */
+  if (head - stats->from_tail > ARRIVALS) {
+    stats->from_tail = head - ARRIVALS;
+  }
+
+  for (i = stats->from_tail; i < head; i++) {
+    GstClockTime arrival_pts;
+    gint64 arrival_time;
+    guint64 latency;
+
+    if (!pad_stats_read_arrival (from, i, &arrival_pts, &arrival_time) ||
+        arrival_pts != pts) {
+      continue;
+    }
+
+    latency = MAX (now - arrival_time, 0);
+    COUNTER_ADD (stats->latencies, 1);
+    COUNTER_ADD (stats->latency_sum, latency);
+    if (latency > COUNTER_GET (stats->latency_max)) {
+      atomic_store_explicit (&stats->latency_max, latency,
+          memory_order_relaxed);
+    }
+
+    stats->from_tail = i + 1;
+    break;
+  }
+}
+
+static void
+pad_stats_add_buffer (PadStats * stats, GstBuffer * buffer, gint64 now)
+{
+  GstClockTime pts = GST_BUFFER_PTS (buffer);
+
+  COUNTER_ADD (stats->buffers, 1);
+  COUNTER_ADD (stats->bytes, gst_buffer_get_size (buffer));
+
+  if (0 != stats->last_arrival) {
+    guint64 interval = MAX (now - stats->last_arrival, 0);
+
+    COUNTER_ADD (stats->intervals, 1);
+    COUNTER_ADD (stats->interval_sum, interval);
+    COUNTER_ADD (stats->interval_sq_sum, interval * interval);
+  }
+  stats->last_arrival = now;
+
+  if (GST_CLOCK_TIME_IS_VALID (pts)) {
+    if (stats->record_arrivals) {
+      pad_stats_record_arrival (stats, pts, now);
+    }
+    if (stats->from) {
+      pad_stats_match_arrival (stats, pts, now);
+    }
+  }
+}
+
+static void
+pad_stats_get_counters (PadStats * stats, PadCounters * counters)
+{
+  counters->buffers = COUNTER_GET (stats->buffers);
+  counters->bytes = COUNTER_GET (stats->bytes);
+  counters->intervals = COUNTER_GET (stats->intervals);
+  counters->interval_sum = COUNTER_GET (stats->interval_sum);
+  counters->interval_sq_sum = COUNTER_GET (stats->interval_sq_sum);
+  counters->latencies = COUNTER_GET (stats->latencies);
+  counters->latency_sum = COUNTER_GET (stats->latency_sum);
+  counters->time = g_get_monotonic_time ();
+}
+
+/* Print statistics of the buffers since the last report, or all of them
+ * if <total> */
+static void
+pad_stats_report (PadStats * stats, gboolean total)
+{
+  PadCounters now;
+  PadCounters since = { 0 };
+  gdouble seconds;
+  guint64 intervals;
+  gdouble mean = 0;
+  gdouble jitter = 0;
+
+  pad_stats_get_counters (stats, &now);
+  if (total) {
+    since.time = stats->created;
+  } else {
+    since = stats->reported;
+    stats->reported = now;
+  }
+
+  seconds = MAX (now.time - since.time, 1) / (gdouble) G_USEC_PER_SEC;
+  intervals = now.intervals - since.intervals;
+  if (0 != intervals) {
+    /* (standard deviation of the inter-arrival intervals) */
+    mean = (now.interval_sum - since.interval_sum) / (gdouble) intervals;
+    jitter = (now.interval_sq_sum - since.interval_sq_sum) /
+        (gdouble) intervals - mean * mean;
+    jitter = jitter > 0 ? sqrt (jitter) : 0;
+  }
+
+  g_print ("%s%s: %" G_GUINT64_FORMAT " buffers, %.1f buffers/s, "
+      "%.1f kB/s, interval %.3f ms, jitter %.3f ms", total ? "Total " : "",
+      stats->name, now.buffers - since.buffers,
+      (now.buffers - since.buffers) / seconds,
+      (now.bytes - since.bytes) / seconds / 1000, mean / 1000,
+      jitter / 1000);
+
+  if (stats->from) {
+    guint64 latencies = now.latencies - since.latencies;
+
+    g_print (", latency from %s %.3f ms (max %.3f ms)", stats->from->name,
+        latencies ? (now.latency_sum - since.latency_sum) /
+        (gdouble) latencies / 1000 : 0,
+        COUNTER_GET (stats->latency_max) / 1000.0);
+  }
+
+  g_print ("\n");
+}
+
+static gboolean
+report_stats (gpointer user_data)
+{
+  GPtrArray *probes = (GPtrArray *) user_data;
+  guint i;
+
+  for (i = 0; i < probes->len; i++) {
+    pad_stats_report (g_ptr_array_index (probes, i), FALSE);
+  }
+
+  return TRUE;
+}
+
 static GstPadProbeReturn
-event_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+pad_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
 {
-  GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
-  g_print ("Got event: %s\n", GST_EVENT_TYPE_NAME (event));
+  PadStats *stats = (PadStats *) user_data;
+  GstPadProbeType type = GST_PAD_PROBE_INFO_TYPE (info);
+
+  if (type & GST_PAD_PROBE_TYPE_BUFFER) {
+    pad_stats_add_buffer (stats, GST_PAD_PROBE_INFO_BUFFER (info),
+        g_get_monotonic_time ());
+  } else if (type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+    GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST (info);
+    gint64 now = g_get_monotonic_time ();
+    guint i;
 
-  g_warning ("TODO: Implement me!!!");
+    for (i = 0; i < gst_buffer_list_length (list); i++) {
+      pad_stats_add_buffer (stats, gst_buffer_list_get (list, i), now);
+    }
+  } else if (type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+    g_print ("%s: got event: %s\n", stats->name, GST_EVENT_TYPE_NAME (event));
+  } else if ((type & GST_PAD_PROBE_TYPE_QUERY_BOTH) &&
+      (type & GST_PAD_PROBE_TYPE_PUSH)) {
+    /* (not again when it's answered) */
+    GstQuery *query = GST_PAD_PROBE_INFO_QUERY (info);
+    g_print ("%s: got %s query: %s\n", stats->name,
+        type & GST_PAD_PROBE_TYPE_QUERY_DOWNSTREAM ? "downstream" : "upstream",
+        GST_QUERY_TYPE_NAME (query));
+  }
 
-  /* TODO:  Decide what to return */
+  /* just looking */
   return GST_PAD_PROBE_OK;
 }
 
 static gulong
 setup_probe_on_elem (GstElement * element, const gchar * pad_name,
-    GstPadProbeType mask)
+    GstPadProbeType mask, PadStats * stats)
 {
   GstPad *pad;
-  gulong probe_id;
 
   pad = gst_element_get_static_pad (element, pad_name);
   if (!pad) {
@@ -41,40 +337,346 @@ setup_probe_on_elem (GstElement * element, const gchar * pad_name,
     return 0;
   }
 
-  probe_id = gst_pad_add_probe (pad, mask, event_probe, NULL, NULL);
-  gst_object_unref (pad);
+  /* the pad is kept to remove the probe later */
+  stats->pad = pad;
+  stats->probe_id = gst_pad_add_probe (pad, mask, pad_probe, stats, NULL);
 
-  return probe_id;
+  return stats->probe_id;
 }
 
-static void
+/* Parse comma separated probe <types>, 0 if any is unknown */
+static GstPadProbeType
+parse_probe_types (const gchar * types)
+{
+  static const struct
+  {
+    const gchar *name;
+    GstPadProbeType type;
+  } probe_types[] = {
+    {"buffer", GST_PAD_PROBE_TYPE_BUFFER},
+    {"buffer-list", GST_PAD_PROBE_TYPE_BUFFER_LIST},
+    {"event", GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM},
+    {"query", GST_PAD_PROBE_TYPE_QUERY_BOTH},
+  };
+  gchar **names;
+  guint i, j;
+  GstPadProbeType mask = 0;
+
+  names = g_strsplit (types, ",", -1);
+  for (i = 0; names[i]; i++) {
+    for (j = 0; j < G_N_ELEMENTS (probe_types); j++) {
+      if (0 == strcmp (names[i], probe_types[j].name)) {
+        mask |= probe_types[j].type;
+        break;
+      }
+    }
+
+    if (j == G_N_ELEMENTS (probe_types)) {
+      g_warning ("Unknown probe type: '%s'", names[i]);
+      mask = 0;
+      break;
+    }
+  }
+
+  g_strfreev (names);
+  return mask;
+}
+
+static PadStats *
 setup_probe (GstElement * pipeline, const gchar * probed_pad)
 {
   gchar **names;
+  gchar *pad_name;
   GstElement *elem;
+  PadStats *stats = NULL;
 
-  /* TODO:  Choose what to probe */
-  GstPadProbeType probe_mask = GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM;
+  GstPadProbeType probe_mask = GST_PAD_PROBE_TYPE_BUFFER |
+      GST_PAD_PROBE_TYPE_BUFFER_LIST | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM;
 
   if (NULL == strchr (probed_pad, ':')) {
-    g_warning ("Invalid pad name: '%s'.  Should be 'elem:pad'", probed_pad);
-    return;
+    g_warning ("Invalid pad name: '%s'.  Should be 'elem:pad[:type,...]'",
+        probed_pad);
+    return NULL;
   }
 
-  names = g_strsplit (probed_pad, ":", 2);
+  names = g_strsplit (probed_pad, ":", 3);
+  if (names[2]) {
+    probe_mask = parse_probe_types (names[2]);
+  }
 
-  elem = get_element_by_name (pipeline, names[0]);
+  elem = probe_mask ? get_element_by_name (pipeline, names[0]) : NULL;
   if (elem) {
-    if (0 != setup_probe_on_elem (elem, names[1], probe_mask)) {
+    pad_name = g_strdup_printf ("%s:%s", names[0], names[1]);
+    stats = pad_stats_new (pad_name);
+    if (0 != setup_probe_on_elem (elem, names[1], probe_mask, stats)) {
       g_message ("Successfully installed probe on '%s'", probed_pad);
     } else {
       g_warning ("Failed to install probe on pad '%s'", probed_pad);
+      pad_stats_free (stats);
+      stats = NULL;
     }
 
+    g_free (pad_name);
     gst_object_unref (elem);
   }
 
   g_strfreev (names);
+
+  return stats;
+}
+
+/* Whether <element> is a queue of any kind, by its factory */
+static gboolean
+is_queue (GstElement * element)
+{
+  GstElementFactory *factory = gst_element_get_factory (element);
+  const gchar *name =
+      factory ? gst_plugin_feature_get_name (GST_PLUGIN_FEATURE (factory)) :
+      NULL;
+
+  return name && (0 == strcmp (name, "queue") || 0 == strcmp (name, "queue2")
+      || 0 == strcmp (name, "multiqueue"));
+}
+
+/* Fill levels of all queues (queue and queue2, multiqueue only has them per
+ * pad) of a pipeline sampled periodically */
+typedef struct
+{
+  GstElement *pipeline;
+  FILE *out;
+  gint64 start;
+} QueueMonitor;
+
+static void
+sample_queue_level (const GValue * item, gpointer user_data)
+{
+  GstElement *element = g_value_get_object (item);
+  QueueMonitor *monitor = (QueueMonitor *) user_data;
+  guint buffers, max_buffers, bytes, max_bytes;
+  guint64 time, max_time;
+
+  /* (appsrc has current-level-buffers too, multiqueue doesn't) */
+  if (!is_queue (element) ||
+      !g_object_class_find_property (G_OBJECT_GET_CLASS (element),
+          "current-level-buffers")) {
+    return;
+  }
+
+  g_object_get (element,
+      "current-level-buffers", &buffers, "max-size-buffers", &max_buffers,
+      "current-level-bytes", &bytes, "max-size-bytes", &max_bytes,
+      "current-level-time", &time, "max-size-time", &max_time, NULL);
+
+  fprintf (monitor->out, "%.3f,%s,%u,%u,%u,%u,%" G_GUINT64_FORMAT ",%"
+      G_GUINT64_FORMAT "\n",
+      (g_get_monotonic_time () - monitor->start) / 1000.0,
+      GST_ELEMENT_NAME (element), buffers, max_buffers, bytes, max_bytes,
+      time, max_time);
+}
+
+static gboolean
+sample_queue_levels (gpointer user_data)
+{
+  QueueMonitor *monitor = (QueueMonitor *) user_data;
+  GstIterator *it;
+
+  /* (all over again each time as queues may come and go) */
+  it = gst_bin_iterate_recurse (GST_BIN (monitor->pipeline));
+  while (GST_ITERATOR_RESYNC ==
+      gst_iterator_foreach (it, sample_queue_level, monitor)) {
+    gst_iterator_resync (it);
+  }
+  gst_iterator_free (it);
+
+  fflush (monitor->out);
+  return TRUE;
+}
+
+static QueueMonitor *
+setup_queue_monitor (GstElement * pipeline, const gchar * file)
+{
+  QueueMonitor *monitor;
+  FILE *out = 0 == strcmp (file, "-") ? stdout : fopen (file, "w");
+
+  if (!out) {
+    g_warning ("Cannot open '%s': %s", file, strerror (errno));
+    return NULL;
+  }
+
+  monitor = g_new0 (QueueMonitor, 1);
+  monitor->pipeline = pipeline;
+  monitor->out = out;
+  monitor->start = g_get_monotonic_time ();
+
+  fprintf (out, "time_ms,queue,buffers,max_buffers,bytes,max_bytes,"
+      "time_ns,max_time_ns\n");
+
+  return monitor;
+}
+
+static void
+queue_monitor_free (QueueMonitor * monitor)
+{
+  if (monitor->out != stdout) {
+    fclose (monitor->out);
+  }
+
+  g_free (monitor);
+}
+
+/* Buffers pulled from an appsink are pushed into an appsrc of the same
+ * pipeline, passing through the application on the way.  The buffers are
+ * never copied, just referenced, so their memory (from a buffer pool,
+ * dmabuf, memfd...) goes downstream as it is.  The appsink doesn't answer
+ * ALLOCATION queries, so it's upstream that decides how it's allocated.
+ *
+ * The appsink syncs buffers to the clock (sync=true) by default, so
+ * the upstream half runs in real time; set sync=false on it for the full
+ * frame rate the upstream half can do.  Only buffers, caps and EOS are
+ * passed on, not segments or flushes, so timestamps downstream go wrong
+ * after a seek. */
+typedef struct
+{
+  GstAppSink *sink;
+  GstAppSrc *src;
+  /* caps last set on the appsrc */
+  GstCaps *caps;
+  guint64 buffers;
+} Bridge;
+
+static void
+bridge_report_memory (GstBuffer * buffer)
+{
+  guint i;
+
+  g_message ("Bridging buffers %s a pool, %u memory block(s):",
+      buffer->pool ? "from" : "not from", gst_buffer_n_memory (buffer));
+  for (i = 0; i < gst_buffer_n_memory (buffer); i++) {
+    GstMemory *mem = gst_buffer_peek_memory (buffer, i);
+
+    g_message ("  #%u: %s, %" G_GSIZE_FORMAT " bytes", i,
+        mem->allocator ? mem->allocator->mem_type : "unknown", mem->size);
+  }
+}
+
+/* Where the application gets at every bridged buffer, passing it on as it
+ * is.  An application would gst_buffer_map() it GST_MAP_READ to look at
+ * the data, or gst_buffer_make_writable() it (which copies it only if it's
+ * still used elsewhere) to change it, and return NULL to drop it. */
+static GstBuffer *
+bridge_process (Bridge * bridge, GstBuffer * buffer)
+{
+  return buffer;
+}
+
+static GstFlowReturn
+bridge_new_sample (GstAppSink * sink, gpointer user_data)
+{
+  Bridge *bridge = (Bridge *) user_data;
+  GstSample *sample;
+  GstCaps *caps;
+  GstBuffer *buffer;
+
+  sample = gst_app_sink_pull_sample (sink);
+  if (!sample) {
+    /* flushing or EOS */
+    return GST_FLOW_EOS;
+  }
+
+  caps = gst_sample_get_caps (sample);
+  if (caps && (!bridge->caps || !gst_caps_is_equal (caps, bridge->caps))) {
+    gst_caps_replace (&bridge->caps, caps);
+    gst_app_src_set_caps (bridge->src, caps);
+  }
+
+  /* keep just the buffer (and so its memory) alive, not the whole sample */
+  buffer = gst_buffer_ref (gst_sample_get_buffer (sample));
+  gst_sample_unref (sample);
+
+  if (0 == bridge->buffers++) {
+    bridge_report_memory (buffer);
+  }
+
+  buffer = bridge_process (bridge, buffer);
+  if (!buffer) {
+    return GST_FLOW_OK;
+  }
+
+  /* takes the buffer over, blocking while the appsrc's queue is full so
+   * the downstream half of the pipeline throttles the upstream one */
+  return gst_app_src_push_buffer (bridge->src, buffer);
+}
+
+static void
+bridge_eos (GstAppSink * sink, gpointer user_data)
+{
+  Bridge *bridge = (Bridge *) user_data;
+
+  gst_app_src_end_of_stream (bridge->src);
+}
+
+static void
+bridge_free (Bridge * bridge)
+{
+  g_message ("Bridged %" G_GUINT64_FORMAT " buffers", bridge->buffers);
+
+  gst_caps_replace (&bridge->caps, NULL);
+  gst_object_unref (bridge->sink);
+  gst_object_unref (bridge->src);
+  g_free (bridge);
+}
+
+static Bridge *
+setup_bridge (GstElement * pipeline, const gchar * bridged)
+{
+  gchar **names;
+  GstElement *sink = NULL;
+  GstElement *src = NULL;
+  Bridge *bridge = NULL;
+  GstAppSinkCallbacks callbacks = { NULL };
+
+  if (NULL == strchr (bridged, ':')) {
+    g_warning ("Invalid bridge: '%s'.  Should be 'appsink:appsrc'", bridged);
+    return NULL;
+  }
+
+  names = g_strsplit (bridged, ":", 2);
+
+  sink = get_element_by_name (pipeline, names[0]);
+  src = get_element_by_name (pipeline, names[1]);
+  if (sink && !GST_IS_APP_SINK (sink)) {
+    g_warning ("'%s' is not an appsink", names[0]);
+  } else if (src && !GST_IS_APP_SRC (src)) {
+    g_warning ("'%s' is not an appsrc", names[1]);
+  } else if (sink && src) {
+    bridge = g_new0 (Bridge, 1);
+    bridge->sink = GST_APP_SINK (sink);
+    bridge->src = GST_APP_SRC (src);
+    sink = src = NULL;
+
+    /* timestamps of the buffers are passed on, and pushing blocks rather
+     * than queueing buffers without limits.  The appsrc is live, so
+     * the pipeline doesn't wait in PAUSED for the sinks after it to
+     * preroll: they'd never get a buffer, as the appsink passes them on
+     * (new_sample) only in PLAYING. */
+    g_object_set (bridge->src, "format", GST_FORMAT_TIME, "block", TRUE,
+        "is-live", TRUE, NULL);
+
+    /* callbacks rather than signals, called from the streaming thread */
+    callbacks.eos = bridge_eos;
+    callbacks.new_sample = bridge_new_sample;
+    gst_app_sink_set_callbacks (bridge->sink, &callbacks, bridge, NULL);
+
+    g_message ("Successfully installed bridge '%s'", bridged);
+  }
+
+  if (sink)
+    gst_object_unref (sink);
+  if (src)
+    gst_object_unref (src);
+  g_strfreev (names);
+
+  return bridge;
 }
 
 static gboolean
@@ -173,21 +775,611 @@ create_pipeline (int argc, char *argv[])
   return pipeline;
 }
 
+/* Maximum number of buffers in an inserted queue: enough to even out
+ * the pace of the threads on both sides without piling up frames (and
+ * latency) when the downstream one can't keep up */
+#define AUTO_QUEUE_BUFFERS 4
+
+/* Whether <element> is likely to keep a CPU busy, judging by its class */
+static gboolean
+is_cpu_heavy (GstElement * element)
+{
+  static const gchar *heavy[] = {
+    "Encoder", "Decoder", "Converter", "Effect", "Compositor", "Mixer",
+  };
+  GstElementFactory *factory = gst_element_get_factory (element);
+  const gchar *klass;
+  guint i;
+
+  if (!factory || GST_IS_BIN (element))
+    return FALSE;
+
+  klass = gst_element_factory_get_metadata (factory,
+      GST_ELEMENT_METADATA_KLASS);
+  for (i = 0; klass && i < G_N_ELEMENTS (heavy); i++) {
+    if (strstr (klass, heavy[i]))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+static void
+collect_heavy_sink_pads (const GValue * item, gpointer user_data)
+{
+  GstElement *element = g_value_get_object (item);
+  GPtrArray *pads = (GPtrArray *) user_data;
+  GList *l;
+
+  if (!is_cpu_heavy (element))
+    return;
+
+  GST_OBJECT_LOCK (element);
+  for (l = element->sinkpads; l; l = l->next) {
+    g_ptr_array_add (pads, gst_object_ref (l->data));
+  }
+  GST_OBJECT_UNLOCK (element);
+}
+
+static void
+find_live_source (const GValue * item, gpointer user_data)
+{
+  GstElement *element = g_value_get_object (item);
+  gboolean *live = (gboolean *) user_data;
+  gboolean is_live = FALSE;
+
+  if (g_object_class_find_property (G_OBJECT_GET_CLASS (element), "is-live")) {
+    g_object_get (element, "is-live", &is_live, NULL);
+    *live = *live || is_live;
+  }
+}
+
+/* Insert a queue in front of <sinkpad> unless there's one already */
+static gboolean
+insert_queue (GstPad * sinkpad, guint n, gboolean leaky)
+{
+  GstPad *peer = gst_pad_get_peer (sinkpad);
+  GstElement *element = gst_pad_get_parent_element (sinkpad);
+  GstElement *upstream = peer ? gst_pad_get_parent_element (peer) : NULL;
+  GstObject *bin = element ? gst_object_get_parent (GST_OBJECT (element)) :
+      NULL;
+  GstElement *queue = NULL;
+  GstPad *queue_sink = NULL;
+  GstPad *queue_src = NULL;
+  gchar *name;
+  gboolean inserted = FALSE;
+
+  /* (ghost pads of bins are left alone) */
+  if (!upstream || is_queue (upstream) || !bin ||
+      GST_OBJECT_PARENT (upstream) != bin) {
+    goto done;
+  }
+
+  name = g_strdup_printf ("autoqueue%u", n);
+  queue = gst_element_factory_make ("queue", name);
+  g_free (name);
+  if (!queue) {
+    g_warning ("Cannot create a queue");
+    goto done;
+  }
+
+  /* bounded by buffers only, dropping the oldest ones if live */
+  g_object_set (queue, "max-size-buffers", AUTO_QUEUE_BUFFERS,
+      "max-size-bytes", 0, "max-size-time", (guint64) 0,
+      "leaky", leaky ? 2 : 0, NULL);
+
+  gst_bin_add (GST_BIN (bin), queue);
+  queue_sink = gst_element_get_static_pad (queue, "sink");
+  queue_src = gst_element_get_static_pad (queue, "src");
+  gst_pad_unlink (peer, sinkpad);
+  if (GST_PAD_LINK_FAILED (gst_pad_link (peer, queue_sink)) ||
+      GST_PAD_LINK_FAILED (gst_pad_link (queue_src, sinkpad))) {
+    g_warning ("Cannot insert a queue in front of '%s'",
+        GST_ELEMENT_NAME (element));
+    gst_pad_unlink (peer, queue_sink);
+    gst_pad_unlink (queue_src, sinkpad);
+    gst_bin_remove (GST_BIN (bin), queue);
+    gst_pad_link (peer, sinkpad);
+    goto done;
+  }
+
+  g_message ("Inserted %s between '%s' and '%s'", GST_ELEMENT_NAME (queue),
+      GST_ELEMENT_NAME (upstream), GST_ELEMENT_NAME (element));
+  inserted = TRUE;
+
+done:
+  if (queue_sink)
+    gst_object_unref (queue_sink);
+  if (queue_src)
+    gst_object_unref (queue_src);
+  if (bin)
+    gst_object_unref (bin);
+  if (upstream)
+    gst_object_unref (upstream);
+  if (element)
+    gst_object_unref (element);
+  if (peer)
+    gst_object_unref (peer);
+
+  return inserted;
+}
+
+/* Append the elements run by the thread entering <element> to <layout> */
+static void
+describe_thread (GstElement * element, GString * layout)
+{
+  GPtrArray *branches = g_ptr_array_new_with_free_func (g_free);
+  GList *pads = NULL;
+  GList *l;
+  guint i;
+
+  GST_OBJECT_LOCK (element);
+  for (l = element->srcpads; l; l = l->next) {
+    pads = g_list_prepend (pads, gst_object_ref (l->data));
+  }
+  GST_OBJECT_UNLOCK (element);
+
+  pads = g_list_reverse (pads);
+  for (l = pads; l; l = l->next) {
+    GstPad *peer = gst_pad_get_peer (GST_PAD (l->data));
+    GstElement *next = peer ? gst_pad_get_parent_element (peer) : NULL;
+    GString *branch;
+
+    if (next) {
+      branch = g_string_new (GST_ELEMENT_NAME (next));
+      /* a queue is where the next thread takes over */
+      if (!is_queue (next)) {
+        describe_thread (next, branch);
+      }
+      g_ptr_array_add (branches, g_string_free (branch, FALSE));
+      gst_object_unref (next);
+    }
+
+    if (peer)
+      gst_object_unref (peer);
+  }
+  g_list_free_full (pads, gst_object_unref);
+
+  if (1 == branches->len) {
+    g_string_append_printf (layout, " ! %s",
+        (gchar *) g_ptr_array_index (branches, 0));
+  } else if (branches->len > 1) {
+    g_string_append (layout, " ! {");
+    for (i = 0; i < branches->len; i++) {
+      g_string_append_printf (layout, "%s%s", i ? " | " : "",
+          (gchar *) g_ptr_array_index (branches, i));
+    }
+    g_string_append (layout, "}");
+  }
+
+  g_ptr_array_unref (branches);
+}
+
+static void
+describe_thread_start (const GValue * item, gpointer user_data)
+{
+  GstElement *element = g_value_get_object (item);
+  guint *threads = (guint *) user_data;
+  GString *layout;
+
+  /* threads start at sources and queues (ignoring demuxers, which start
+   * them on their pads added later) */
+  if (GST_IS_BIN (element) || (0 != element->numsinkpads &&
+          !is_queue (element))) {
+    return;
+  }
+
+  layout = g_string_new (GST_ELEMENT_NAME (element));
+  describe_thread (element, layout);
+  g_print ("  thread %u: %s\n", ++*threads, layout->str);
+  g_string_free (layout, TRUE);
+}
+
+static void
+report_thread_layout (GstElement * pipeline)
+{
+  GstIterator *it;
+  guint threads = 0;
+
+  g_message ("Thread layout:");
+  it = gst_bin_iterate_recurse (GST_BIN (pipeline));
+  while (GST_ITERATOR_RESYNC ==
+      gst_iterator_foreach (it, describe_thread_start, &threads)) {
+    gst_iterator_resync (it);
+  }
+  gst_iterator_free (it);
+}
+
+/* Insert queues in front of the CPU-heavy elements of <pipeline> so they
+ * run in streaming threads of their own, in parallel */
+static void
+insert_queues (GstElement * pipeline)
+{
+  GPtrArray *pads = g_ptr_array_new_with_free_func (gst_object_unref);
+  GstIterator *it;
+  gboolean live = FALSE;
+  guint i, n = 0;
+
+  it = gst_bin_iterate_recurse (GST_BIN (pipeline));
+  while (GST_ITERATOR_RESYNC ==
+      gst_iterator_foreach (it, collect_heavy_sink_pads, pads)) {
+    g_ptr_array_set_size (pads, 0);
+    gst_iterator_resync (it);
+  }
+  gst_iterator_free (it);
+
+  it = gst_bin_iterate_sources (GST_BIN (pipeline));
+  while (GST_ITERATOR_RESYNC ==
+      gst_iterator_foreach (it, find_live_source, &live)) {
+    gst_iterator_resync (it);
+  }
+  gst_iterator_free (it);
+
+  for (i = 0; i < pads->len; i++) {
+    if (insert_queue (g_ptr_array_index (pads, i), n, live)) {
+      n++;
+    }
+  }
+  g_ptr_array_unref (pads);
+
+  g_message ("Inserted %u queue(s)%s", n, live ? " (leaky, live source)" : "");
+  report_thread_layout (pipeline);
+}
+
+/* Benchmark mode: the pipeline is created and run to EOS a number of times,
+ * measuring each run */
+typedef struct
+{
+  gint tid;
+  gchar name[16];
+  /* user and system CPU time in clock ticks */
+  guint64 ticks;
+} ThreadTimes;
+
+typedef struct
+{
+  gdouble seconds;
+  guint64 frames;
+  gdouble frames_per_second;
+  gdouble cpu_seconds;
+  gdouble peak_rss_kb;
+} BenchmarkRun;
+
+/* CPU times of all threads of the process */
+static GArray *
+get_thread_times (void)
+{
+  GArray *threads = g_array_new (FALSE, TRUE, sizeof (ThreadTimes));
+  GDir *dir = g_dir_open ("/proc/self/task", 0, NULL);
+  const gchar *tid;
+
+  while (dir && (tid = g_dir_read_name (dir))) {
+    gchar *path = g_strdup_printf ("/proc/self/task/%s/stat", tid);
+    gchar *contents;
+
+    if (g_file_get_contents (path, &contents, NULL, NULL)) {
+      /* the name is in parentheses (and can have any in it) */
+      gchar *name = strchr (contents, '(');
+      gchar *fields = strrchr (contents, ')');
+      ThreadTimes thread = { 0 };
+      unsigned long utime, stime;
+
+      if (name && fields && 2 == sscanf (fields + 1,
+              " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+              &utime, &stime)) {
+        thread.tid = atoi (tid);
+        g_strlcpy (thread.name, name + 1,
+            MIN ((gsize) (fields - name), sizeof (thread.name)));
+        thread.ticks = utime + stime;
+        g_array_append_val (threads, thread);
+      }
+
+      g_free (contents);
+    }
+
+    g_free (path);
+  }
+
+  if (dir)
+    g_dir_close (dir);
+
+  return threads;
+}
+
+/* Print CPU time used by each thread between <before> and <after>, return
+ * the total */
+static gdouble
+report_thread_times (GArray * before, GArray * after)
+{
+  gdouble tick = 1.0 / sysconf (_SC_CLK_TCK);
+  gdouble total = 0;
+  guint i, j;
+
+  for (i = 0; i < after->len; i++) {
+    ThreadTimes *thread = &g_array_index (after, ThreadTimes, i);
+    guint64 ticks = thread->ticks;
+
+    for (j = 0; j < before->len; j++) {
+      if (g_array_index (before, ThreadTimes, j).tid == thread->tid) {
+        ticks -= g_array_index (before, ThreadTimes, j).ticks;
+        break;
+      }
+    }
+
+    if (0 != ticks) {
+      g_print ("  thread %d (%s): %.2f s CPU\n", thread->tid, thread->name,
+          ticks * tick);
+      total += ticks * tick;
+    }
+  }
+
+  return total;
+}
+
+/* Peak resident set size (in kB) since reset_peak_rss() */
+static gdouble
+get_peak_rss (void)
+{
+  gchar *status;
+  gchar *hwm;
+  gdouble kb = 0;
+
+  if (g_file_get_contents ("/proc/self/status", &status, NULL, NULL)) {
+    hwm = strstr (status, "VmHWM:");
+    if (hwm) {
+      kb = g_ascii_strtod (hwm + strlen ("VmHWM:"), NULL);
+    }
+    g_free (status);
+  }
+
+  return kb;
+}
+
+static void
+reset_peak_rss (void)
+{
+  /* (Linux 4.0 and later, otherwise it's the peak of the process) */
+  FILE *clear_refs = fopen ("/proc/self/clear_refs", "w");
+
+  if (clear_refs) {
+    fputs ("5", clear_refs);
+    fclose (clear_refs);
+  }
+}
+
+static GstPadProbeReturn
+count_frames_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  atomic_uint_fast64_t *frames = (atomic_uint_fast64_t *) user_data;
+
+  if (GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+    COUNTER_ADD (*frames,
+        gst_buffer_list_length (GST_PAD_PROBE_INFO_BUFFER_LIST (info)));
+  } else {
+    COUNTER_ADD (*frames, 1);
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+count_frames_on_pad (const GValue * item, gpointer user_data)
+{
+  gst_pad_add_probe (GST_PAD (g_value_get_object (item)),
+      GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+      count_frames_probe, user_data, NULL);
+}
+
+static void
+count_frames_on_sink (const GValue * item, gpointer user_data)
+{
+  GstIterator *it =
+      gst_element_iterate_sink_pads (GST_ELEMENT (g_value_get_object (item)));
+
+  while (GST_ITERATOR_RESYNC ==
+      gst_iterator_foreach (it, count_frames_on_pad, user_data)) {
+    gst_iterator_resync (it);
+  }
+  gst_iterator_free (it);
+}
+
+static gboolean
+benchmark_run (int argc, char *argv[], gboolean auto_queue, guint n,
+    BenchmarkRun * run)
+{
+  GstElement *pipeline;
+  GstBus *bus;
+  GstMessage *msg = NULL;
+  GstIterator *it;
+  GArray *threads_before, *threads_after;
+  atomic_uint_fast64_t frames = 0;
+  gint64 start;
+  gboolean ok = FALSE;
+
+  pipeline = create_pipeline (argc, argv);
+  if (!pipeline) {
+    return FALSE;
+  }
+
+  if (auto_queue) {
+    insert_queues (pipeline);
+  }
+
+  /* frames are the buffers reaching the sinks */
+  it = gst_bin_iterate_sinks (GST_BIN (pipeline));
+  while (GST_ITERATOR_RESYNC ==
+      gst_iterator_foreach (it, count_frames_on_sink, &frames)) {
+    gst_iterator_resync (it);
+  }
+  gst_iterator_free (it);
+
+  threads_before = get_thread_times ();
+  reset_peak_rss ();
+  start = g_get_monotonic_time ();
+
+  bus = gst_element_get_bus (pipeline);
+  if (GST_STATE_CHANGE_FAILURE == gst_element_set_state (pipeline,
+          GST_STATE_PLAYING)) {
+    g_printerr ("Failed to play the pipeline\n");
+  } else {
+    msg = gst_bus_timed_pop_filtered (bus, GST_CLOCK_TIME_NONE,
+        GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  }
+
+  run->seconds = (g_get_monotonic_time () - start) / (gdouble) G_USEC_PER_SEC;
+  run->peak_rss_kb = get_peak_rss ();
+  run->frames = COUNTER_GET (frames);
+  run->frames_per_second = run->frames / MAX (run->seconds, 1e-6);
+
+  if (msg && GST_MESSAGE_TYPE (msg) == GST_MESSAGE_ERROR) {
+    gchar *debug;
+    GError *error;
+
+    gst_message_parse_error (msg, &error, &debug);
+    g_printerr ("Error: %s\n\t%s\n",
+        GST_STR_NULL (error->message), GST_STR_NULL (debug));
+    g_error_free (error);
+    g_free (debug);
+  } else if (msg) {
+    g_print ("Run %u: %.3f s, %" G_GUINT64_FORMAT " frames, %.1f frames/s, "
+        "peak RSS %.0f kB\n", n, run->seconds, run->frames,
+        run->frames_per_second, run->peak_rss_kb);
+
+    /* (before stopping, while the streaming threads are still there) */
+    threads_after = get_thread_times ();
+    run->cpu_seconds = report_thread_times (threads_before, threads_after);
+    g_array_free (threads_after, TRUE);
+    ok = TRUE;
+  }
+
+  if (msg)
+    gst_message_unref (msg);
+  gst_object_unref (bus);
+  g_array_free (threads_before, TRUE);
+
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (pipeline);
+
+  return ok;
+}
+
+static int
+compare_doubles (gconstpointer a, gconstpointer b)
+{
+  gdouble x = *(const gdouble *) a;
+  gdouble y = *(const gdouble *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Print min, median, mean, max and standard deviation of <count> values
+ * at <offset> in <runs> */
+static void
+report_summary (const gchar * what, BenchmarkRun * runs, guint count,
+    gsize offset)
+{
+  gdouble *values = g_new (gdouble, count);
+  gdouble mean = 0;
+  gdouble variance = 0;
+  guint i;
+
+  for (i = 0; i < count; i++) {
+    values[i] = *(gdouble *) ((gchar *) (runs + i) + offset);
+    mean += values[i] / count;
+  }
+  for (i = 0; i < count; i++) {
+    variance += (values[i] - mean) * (values[i] - mean);
+  }
+  variance = count > 1 ? variance / (count - 1) : 0;
+
+  qsort (values, count, sizeof (gdouble), compare_doubles);
+  g_print ("%-12s min %.3f  median %.3f  mean %.3f  max %.3f  stddev %.3f\n",
+      what, values[0], count % 2 ? values[count / 2]
+      : (values[count / 2 - 1] + values[count / 2]) / 2, mean,
+      values[count - 1], sqrt (variance));
+
+  g_free (values);
+}
+
+static int
+run_benchmark (int argc, char *argv[], gboolean auto_queue, guint runs)
+{
+  BenchmarkRun *results = g_new0 (BenchmarkRun, runs);
+  guint i;
+
+  for (i = 0; i < runs; i++) {
+    if (!benchmark_run (argc, argv, auto_queue, i + 1, &results[i])) {
+      g_free (results);
+      return EXIT_FAILURE;
+    }
+  }
+
+  g_print ("Summary of %u runs:\n", runs);
+  report_summary ("seconds", results, runs,
+      G_STRUCT_OFFSET (BenchmarkRun, seconds));
+  report_summary ("frames/s", results, runs,
+      G_STRUCT_OFFSET (BenchmarkRun, frames_per_second));
+  report_summary ("CPU seconds", results, runs,
+      G_STRUCT_OFFSET (BenchmarkRun, cpu_seconds));
+  report_summary ("peak RSS kB", results, runs,
+      G_STRUCT_OFFSET (BenchmarkRun, peak_rss_kb));
+
+  g_free (results);
+  return EXIT_SUCCESS;
+}
+
 int
 main (int argc, char *argv[])
 {
   GstElement *pipeline;
-  GMainLoop *loop;
+  GMainLoop *loop = NULL;
+  Bridge *bridge = NULL;
+  GPtrArray *probes =
+      g_ptr_array_new_with_free_func ((GDestroyNotify) pad_stats_free);
+  PadStats *stats;
+  QueueMonitor *queue_monitor = NULL;
 
   gboolean eos_on_shutdown = FALSE;
-  gchar *probed_pad = NULL;
+  gchar **probed_pads = NULL;
+  gchar *latency_pad = NULL;
+  gint stats_interval = 0;
+  gchar *queue_levels = NULL;
+  gint queue_interval = 100;
+  gint benchmark_runs = 0;
+  gboolean auto_queue = FALSE;
+  gchar *bridged = NULL;
   gboolean verbose = FALSE;
 
   GOptionEntry options[] = {
     {"eos-on-shutdown", 'e', 0, G_OPTION_ARG_NONE, &eos_on_shutdown,
         "Force EOS on sources before shutting the pipeline down", NULL},
-    {"probe-pad", 'p', 0, G_OPTION_ARG_STRING, &probed_pad,
-        "name of the pad to install probe on", "elem:pad"},
+    {"probe-pad", 'p', 0, G_OPTION_ARG_STRING_ARRAY, &probed_pads,
+        "name of a pad to install probe on (can be repeated), probing "
+        "buffer, buffer-list, event and/or query (default: all but query)",
+        "elem:pad[:type,...]"},
+    {"latency-pad", 'l', 0, G_OPTION_ARG_STRING, &latency_pad,
+        "name of a pad downstream of the first probed one to measure "
+        "latency to", "elem:pad"},
+    {"stats-interval", 'i', 0, G_OPTION_ARG_INT, &stats_interval,
+        "print statistics of probed pads every N seconds (and on exit)",
+        "N"},
+    {"queue-levels", 'q', 0, G_OPTION_ARG_STRING, &queue_levels,
+        "write fill levels of queues as CSV to FILE (- for standard output)",
+        "FILE"},
+    {"queue-interval", 0, 0, G_OPTION_ARG_INT, &queue_interval,
+        "sample queue levels every N milliseconds (default: 100)", "N"},
+    {"bridge", 'b', 0, G_OPTION_ARG_STRING, &bridged,
+        "pass buffers from appsink to appsrc through the application "
+        "(set sync=false on the appsink not to run in real time)",
+        "appsink:appsrc"},
+    {"benchmark", 'B', 0, G_OPTION_ARG_INT, &benchmark_runs,
+        "run the pipeline to EOS N times, measuring wall time, frames per "
+        "second, CPU time per thread and peak RSS (other options but "
+        "--auto-queue are ignored)", "N"},
+    {"auto-queue", 'a', 0, G_OPTION_ARG_NONE, &auto_queue,
+        "insert queues in front of CPU-heavy elements (encoders, decoders, "
+        "converters, effects...) to run them in threads of their own, "
+        "printing the resulting thread layout", NULL},
     {"verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose,
         "output status information and property notifications", NULL},
     {NULL}
@@ -196,6 +1388,9 @@ main (int argc, char *argv[])
   GstBus *bus = NULL;
   guint bus_watch_id = 0;
   guint signal_watch_id = 0;
+  guint stats_timeout_id = 0;
+  guint queue_timeout_id = 0;
+  guint i;
 
   int ret = EXIT_FAILURE;
 
@@ -205,13 +1400,41 @@ main (int argc, char *argv[])
 
   gst_init (&argc, &argv);
 
+  if (benchmark_runs > 0) {
+    return run_benchmark (argc, argv, auto_queue, benchmark_runs);
+  }
+
   pipeline = create_pipeline (argc, argv);
   if (!pipeline) {
     return ret;
   }
 
-  if (probed_pad && '\0' != probed_pad[0]) {
-    setup_probe (pipeline, probed_pad);
+  if (auto_queue) {
+    insert_queues (pipeline);
+  }
+
+  for (i = 0; probed_pads && probed_pads[i]; i++) {
+    if ('\0' != probed_pads[i][0] &&
+        (stats = setup_probe (pipeline, probed_pads[i]))) {
+      g_ptr_array_add (probes, stats);
+    }
+  }
+
+  if (latency_pad && '\0' != latency_pad[0]) {
+    if (0 == probes->len) {
+      g_warning ("Latency can only be measured from a probed pad");
+    } else if ((stats = setup_probe (pipeline, latency_pad))) {
+      stats->from = g_ptr_array_index (probes, 0);
+      stats->from->record_arrivals = TRUE;
+      g_ptr_array_add (probes, stats);
+    }
+  }
+
+  if (bridged && '\0' != bridged[0]) {
+    bridge = setup_bridge (pipeline, bridged);
+    if (!bridge) {
+      goto untergang;
+    }
   }
 
   if (eos_on_shutdown) {
@@ -226,6 +1449,19 @@ main (int argc, char *argv[])
 
   loop = g_main_loop_new (NULL, FALSE);
 
+  if (stats_interval > 0 && 0 != probes->len) {
+    stats_timeout_id =
+        g_timeout_add_seconds (stats_interval, report_stats, probes);
+  }
+
+  if (queue_levels && '\0' != queue_levels[0]) {
+    queue_monitor = setup_queue_monitor (pipeline, queue_levels);
+    if (queue_monitor) {
+      queue_timeout_id = g_timeout_add (MAX (queue_interval, 1),
+          sample_queue_levels, queue_monitor);
+    }
+  }
+
   // bus callback
   bus = gst_pipeline_get_bus (GST_PIPELINE (pipeline));
   bus_watch_id = gst_bus_add_watch (bus, bus_call, loop);
@@ -247,9 +1483,19 @@ main (int argc, char *argv[])
     goto untergang;
   }
 
+  for (i = 0; i < probes->len; i++) {
+    pad_stats_report (g_ptr_array_index (probes, i), TRUE);
+  }
+
   ret = EXIT_SUCCESS;
 
 untergang:
+  if (0 != queue_timeout_id)
+    g_source_remove (queue_timeout_id);
+  if (queue_monitor)
+    queue_monitor_free (queue_monitor);
+  if (0 != stats_timeout_id)
+    g_source_remove (stats_timeout_id);
   if (0 != signal_watch_id)
     g_source_remove (signal_watch_id);
   if (0 != bus_watch_id)
@@ -258,6 +1504,9 @@ untergang:
     g_main_loop_unref (loop);
   if (pipeline)
     gst_object_unref (GST_OBJECT (pipeline));
+  if (bridge)
+    bridge_free (bridge);
+  g_ptr_array_unref (probes);
 
   return ret;
 }
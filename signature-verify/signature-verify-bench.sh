@@ -0,0 +1,142 @@
+#!/bin/bash -e
+
+#/ Usage: signature-verify-bench.sh [-r <runs>] [-s <sizes>] [-k <keys>]
+#/                                  [-d <digests>] [-i <I/O modes>]
+#/                                  <signature-verify executable>
+#/
+#/ Benchmarks a program implemented in signature-verify.cpp and built as
+#/ <signature-verify executable>.  Keys and random data files of various sizes
+#/ are generated and signed, then each file is verified <runs> times for every
+#/ combination of key, digest and I/O mode.
+#/
+#/ Results are printed to the standard output as CSV, one line per run:
+#/
+#/    key,digest,io,size_bytes,run,seconds,mib_per_s
+#/
+#/ mib_per_s is in MiB (1048576 bytes) per second.  The time includes
+#/ the process start-up (exec, dynamic linking and initialising OpenSSL) and
+#/ loading the certificate, so it's the per-file latency seen by a caller;
+#/ for small files it's mostly start-up, and only big ones show the hashing
+#/ throughput.  Each combination is run once before measuring so the data
+#/ file is in the page cache.
+#/
+#/ The 4G file goes past 32-bit offsets and sizes, so it needs that much
+#/ free space in TMPDIR and, to be measured from the page cache (and read
+#/ whole by the 'stream' I/O mode), twice as much memory.  Drop it with -s on
+#/ smaller machines.
+#/
+#/ Options (space separated lists):
+#/    -r <runs>       number of measured runs (default: 3)
+#/    -s <sizes>      data file sizes as accepted by head -c
+#/                    (default: 1K 1M 64M 1G 4G)
+#/    -k <keys>       key types: rsa2048 rsa4096 ec256 (default: all of them)
+#/    -d <digests>    digest algorithms (default: sha1 sha256 sha512)
+#/    -i <I/O modes>  signature-verify I/O modes (default: stream read mmap)
+#/
+#/ Examples:
+#/    signature-verify-bench.sh /tmp/signature-verify > results.csv
+#/    signature-verify-bench.sh -s "1K 1G" -k rsa2048 -d sha256 /tmp/signature-verify
+
+usage() { grep '^#/' "$0" | cut -c 4-; }
+
+runs=3
+sizes="1K 1M 64M 1G 4G"
+keys="rsa2048 rsa4096 ec256"
+digests="sha1 sha256 sha512"
+io_modes="stream read mmap"
+
+while getopts "r:s:k:d:i:h" opt; do
+	case "$opt" in
+		r) runs="$OPTARG" ;;
+		s) sizes="$OPTARG" ;;
+		k) keys="$OPTARG" ;;
+		d) digests="$OPTARG" ;;
+		i) io_modes="$OPTARG" ;;
+		h) usage; exit 0 ;;
+		*) usage >&2; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+executable="$1"
+[ -z "$executable" ] && {
+	echo "No executable specified" >&2
+	echo
+	usage
+	exit 1
+}
+
+# scratch directory
+tmpdir=$(mktemp -d)
+trap 'rm -rf "${tmpdir}"' EXIT
+
+##
+# generate private key and certificate of the given type
+#
+gen_key() {
+	local type="$1"
+	local newkey
+
+	case "$type" in
+		rsa2048) newkey=(-newkey rsa:2048) ;;
+		rsa4096) newkey=(-newkey rsa:4096) ;;
+		ec256) newkey=(-newkey ec -pkeyopt ec_paramgen_curve:prime256v1) ;;
+		*) echo "Unknown key type: $type" >&2; exit 1 ;;
+	esac
+
+	openssl req -x509 "${newkey[@]}" -nodes \
+	    -keyout "${tmpdir}/${type}-key-priv.pem" -subj "/CN=FakeSigner" \
+	    -out "${tmpdir}/${type}-cert.pem" &>/dev/null
+}
+
+##
+# milliseconds are too coarse for small files
+#
+now_ns() { date +%s%N; }
+
+for key in $keys; do
+	echo "Generating ${key} key" >&2
+	gen_key "$key"
+done
+
+echo "key,digest,io,size_bytes,run,seconds,mib_per_s"
+
+for size in $sizes; do
+	data="${tmpdir}/data-${size}"
+	echo "Generating ${size} of data" >&2
+	head -c "$size" /dev/urandom > "$data"
+	size_bytes=$(stat -c %s "$data")
+
+	for key in $keys; do
+		for digest in $digests; do
+			signature="${data}.${key}.${digest}.sig"
+			openssl dgst "-${digest}" -sign "${tmpdir}/${key}-key-priv.pem" \
+			    -out "$signature" "$data"
+
+			for io in $io_modes; do
+				cmd=("$executable" --digest "$digest" --io "$io" \
+				    "${tmpdir}/${key}-cert.pem" "$data" "$signature")
+
+				# warm-up (and sanity check)
+				"${cmd[@]}" >/dev/null
+
+				for run in $(seq "$runs"); do
+					start=$(now_ns)
+					"${cmd[@]}" >/dev/null
+					end=$(now_ns)
+
+					awk -v key="$key" -v digest="$digest" -v io="$io" \
+					    -v size="$size_bytes" -v run="$run" \
+					    -v ns=$((end - start)) 'BEGIN {
+						s = ns / 1e9
+						printf "%s,%s,%s,%d,%d,%.6f,%.2f\n",
+						    key, digest, io, size, run, s, size / 1048576 / s
+					}'
+				done
+			done
+		done
+	done
+
+	# don't keep several GBs around longer than needed
+	rm -f "$data" "${data}".*.sig
+done
@@ -61,6 +61,155 @@ openssl dgst -sha1 -sign "${key_priv}" -passin pass:"${pass}" \
 echo -n "Expecting successful verification ... "
 "${executable}" "${cert}" "${data}" "${signature}"
 
+##
+# test successful verification with every I/O mode
+#
+for io in stream read mmap; do
+	echo -n "Expecting successful verification (${io} I/O) ... "
+	"${executable}" --digest sha1 --io "${io}" "${cert}" "${data}" "${signature}"
+done
+
+##
+# test data piped through the standard input (not mapped even with mmap I/O)
+#
+for io in read mmap; do
+	echo -n "Expecting successful verification (${io} I/O, pipe) ... "
+	cat "${data}" | "${executable}" --digest sha1 --io "${io}" "${cert}" \
+	    /dev/stdin "${signature}"
+done
+
+##
+# test verification with a cache (the first run fills it, the second one
+# is answered from it)
+#
+cache="${tmpdir}/cache"
+data_cached="${data}.cached"
+cp -a "${data}" "${data_cached}"
+echo -n "Expecting successful verification (filling cache) ... "
+"${executable}" --cache "${cache}" "${cert}" "${data_cached}" "${signature}"
+echo -n "Expecting successful verification (cached) ... "
+"${executable}" --cache "${cache}" "${cert}" "${data_cached}" "${signature}"
+
+##
+# test the cached result isn't used once the data changes
+#
+echo "whoa" >> "${data_cached}"
+echo -n "Expecting verification failure (stale cache entry) ... "
+if "${executable}" --cache "${cache}" "${cert}" "${data_cached}" "${signature}"
+then
+	echo "Tampered data verified with a stale cache entry" >&2
+	exit 1
+fi
+
+##
+# test a file changed no earlier than the verification isn't cached, as it
+# could still change unnoticed (a modification time in the future stands in
+# for one within the current timestamp tick)
+#
+data_racy="${data}.racy"
+cp "${data}" "${data_racy}"
+touch -d "+1 hour" "${data_racy}"
+cp "${cache}" "${cache}.before"
+echo -n "Expecting successful verification (not cached) ... "
+"${executable}" --cache "${cache}" "${cert}" "${data_racy}" "${signature}"
+if ! cmp -s "${cache}" "${cache}.before"; then
+	echo "Racily clean file was cached" >&2
+	exit 1
+fi
+
+##
+# test batch verification (one good and one tampered file)
+#
+batch="${tmpdir}/batch"
+printf "%s %s\n" "${data}" "${signature}" "${data_cached}" "${signature}" \
+    > "${batch}"
+echo "Expecting batch verification with one failure ... "
+if "${executable}" --batch "${batch}" "${cert}"; then
+	echo "Tampered data verified in a batch" >&2
+	exit 1
+fi
+
+##
+# test the number of workers is checked
+#
+for workers in 0 -1 1025 2x ""; do
+	echo -n "Expecting invalid number of workers (\"${workers}\") ... "
+	if "${executable}" --workers "${workers}" --batch "${batch}" "${cert}" \
+	    > "${tmpdir}/result" 2>&1; then
+		echo "Invalid number of workers accepted" >&2
+		exit 1
+	fi
+	grep "Invalid number of workers" "${tmpdir}/result"
+done
+
+##
+# test the digest implementation report
+#
+echo "Expecting digest implementation report ... "
+"${executable}" --digest sha256 --hash-info
+
+##
+# test Merkle tree verification (the signature is made over the 96 bytes long
+# root record at the beginning of the tree file)
+#
+data_merkle="${tmpdir}/data.merkle"
+tree="${tmpdir}/tree"
+tree_signature="${tree}.sig"
+head -c 10000 /dev/urandom > "${data_merkle}"
+"${executable}" --chunk-size 4096 --merkle-build "${tree}" "${data_merkle}"
+head -c 96 "${tree}" | \
+openssl dgst -sha1 -sign "${key_priv}" -passin pass:"${pass}" \
+    -out "${tree_signature}"
+echo -n "Expecting successful verification (Merkle tree) ... "
+"${executable}" --merkle "${tree}" \
+    "${cert}" "${data_merkle}" "${tree_signature}"
+
+# tamper with the last chunk
+printf "X" | dd of="${data_merkle}" bs=1 seek=9000 conv=notrunc 2>/dev/null
+echo -n "Expecting verification failure (Merkle tree) ... "
+if "${executable}" --merkle "${tree}" \
+    "${cert}" "${data_merkle}" "${tree_signature}"
+then
+	echo "Tampered data verified with a Merkle tree" >&2
+	exit 1
+fi
+
+echo -n "Expecting successful verification (Merkle tree range) ... "
+"${executable}" --merkle "${tree}" --range 0:8192 \
+    "${cert}" "${data_merkle}" "${tree_signature}"
+
+echo -n "Expecting failure (Merkle tree range at the end of data) ... "
+if "${executable}" --merkle "${tree}" --range 10000:10 \
+    "${cert}" "${data_merkle}" "${tree_signature}"
+then
+	echo "Range beyond the data verified" >&2
+	exit 1
+fi
+
+##
+# test verification requested from a daemon
+#
+socket="${tmpdir}/socket"
+"${executable}" --daemon "${socket}" "${cert}" 2>/dev/null &
+daemon_pid=$!
+trap 'kill ${daemon_pid} 2>/dev/null' EXIT
+for i in $(seq 50); do
+	[ -S "${socket}" ] && break
+	sleep 0.1
+done
+
+echo -n "Expecting successful verification (daemon) ... "
+"${executable}" --connect "${socket}" "${data}" "${signature}"
+echo -n "Expecting verification failure (daemon) ... "
+if "${executable}" --connect "${socket}" "${data_cached}" "${signature}"
+then
+	echo "Tampered data verified by the daemon" >&2
+	exit 1
+fi
+
+kill "${daemon_pid}"
+wait "${daemon_pid}"
+
 ##
 # test tampered data verification
 #
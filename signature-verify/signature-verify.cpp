@@ -1,17 +1,53 @@
 #include <openssl/bio.h>
+#include <openssl/err.h>
 #include <openssl/evp.h>
+#include <openssl/objects.h>
 #include <openssl/pem.h>
 #include <openssl/x509.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#elif defined(__aarch64__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cctype>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <iterator>
 #include <memory>
+#include <mutex>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 
 /**
@@ -71,94 +107,2364 @@ read_file (const std::string& path)
     std::istreambuf_iterator<char> (in), std::istreambuf_iterator<char> ());
 }
 
+/*
+ * Throw an exception describing the last failed system call.
+ */
+[[noreturn]] void
+throw_system_error (const std::string& what)
+{
+  throw std::runtime_error (what + ": " + std::strerror (errno));
+}
+
+/*
+ * Size of SHA-256 digests used for identifying certificates and signatures
+ * in the verification cache.
+ */
+constexpr std::size_t CACHE_DIGEST_SIZE = 32;
+
+/*
+ * Identity of a successfully verified data file.  If none of the fields
+ * changes, the file content, the certificate and the signature are assumed to
+ * be the same as when the file was verified.  It's stored in a memory mapped
+ * file as is, so only fixed size fields and no padding.
+ */
+struct CacheKey
+{
+  std::uint64_t dev;
+  std::uint64_t ino;
+  std::uint64_t size;
+  std::int64_t mtime_sec;
+  std::int64_t mtime_nsec;
+  // ctime can't be set back by the user like mtime (e.g. with touch)
+  std::int64_t ctime_sec;
+  std::int64_t ctime_nsec;
+  byte_t cert_fingerprint[CACHE_DIGEST_SIZE];
+  byte_t signature_hash[CACHE_DIGEST_SIZE];
+  // a signature checked with one digest says nothing about another one
+  std::int32_t digest_nid;
+  std::int32_t reserved;
+};
+
+/*
+ * Fill in the file identity part of a cache key.
+ */
 void
-usage (char const *const arg0, std::ostream& out)
+set_file_identity (CacheKey& key, const struct ::stat& st)
 {
-  out <<
-"Usage:\n"
-"\n"
-"    " << arg0 << " <PEM cert> <data file> <signature file>\n"
-"\n"
-"Verifies <data file> signature stored in <signature file> with certificate\n"
-"in <PEM cert>.\n"
-      << std::endl;
+  key.dev = st.st_dev;
+  key.ino = st.st_ino;
+  key.size = st.st_size;
+  key.mtime_sec = st.st_mtim.tv_sec;
+  key.mtime_nsec = st.st_mtim.tv_nsec;
+  key.ctime_sec = st.st_ctim.tv_sec;
+  key.ctime_nsec = st.st_ctim.tv_nsec;
 }
 
+/*
+ * Get the time against which to check file timestamps for a verification
+ * starting now.  The file system stamps files with the coarse clock, so a
+ * file written after this call is never stamped earlier than its result.
+ */
+struct ::timespec
+verification_start ()
+{
+  struct ::timespec now;
+  if (::clock_gettime (CLOCK_REALTIME_COARSE, &now) != 0) {
+    throw_system_error ("Cannot get the current time");
+  }
+  return now;
+}
+
+/*
+ * Whether the file identified by <key> was last changed strictly before
+ * <start>.  Otherwise it may still be rewritten with the same size within
+ * the same timestamp tick and look unchanged, so it mustn't be cached (git
+ * calls this "racily clean").
+ */
 bool
-help_requested (const std::string& arg)
+changed_before (const CacheKey& key, const struct ::timespec& start)
 {
-  return arg == "-h" || arg == "-help" || arg == "--help";
+  const auto before = [&start] (std::int64_t sec, std::int64_t nsec) {
+    return sec < start.tv_sec || (sec == start.tv_sec && nsec < start.tv_nsec);
+  };
+  return before (key.mtime_sec, key.mtime_nsec) &&
+	 before (key.ctime_sec, key.ctime_nsec);
 }
 
-int
-main (int argc, char* argv[])
+/*
+ * Get the fingerprint of <cert> identifying it in cache keys.
+ */
+void
+get_cert_fingerprint (X509 *const cert, byte_t *const fingerprint)
 {
-  // help
-  if (argc == 2 && help_requested (argv[1])) {
-    usage (argv[0], std::cout);
-    return EXIT_SUCCESS;
+  unsigned int length = 0;
+  if (!X509_digest (cert, EVP_sha256 (), fingerprint, &length) ||
+      length != CACHE_DIGEST_SIZE) {
+    throw std::runtime_error ("Cannot calculate certificate fingerprint");
   }
+}
 
-  // misuse
-  if (argc != 4) {
-    usage (argv[0], std::cerr);
-    return EXIT_FAILURE;
+/*
+ * Build a cache key for data file with status <st> verified with <cert> and
+ * <digest> against <signature>.
+ */
+CacheKey
+make_cache_key (const struct ::stat& st, X509 *const cert,
+		const EVP_MD *const digest, const std::vector<byte_t>& signature)
+{
+  CacheKey key;
+  // zero everything so the key can be compared and hashed byte by byte
+  std::memset (&key, 0, sizeof (key));
+
+  set_file_identity (key, st);
+  get_cert_fingerprint (cert, key.cert_fingerprint);
+
+  unsigned int length = 0;
+  if (!EVP_Digest (signature.data (), signature.size (), key.signature_hash,
+		   &length, EVP_sha256 (), nullptr) ||
+      length != CACHE_DIGEST_SIZE) {
+    throw std::runtime_error ("Cannot calculate signature hash");
   }
 
-  // This has to be called before the verification where a number of cryptographic
-  // algorithms is used (they might not be available by default).
-  OpenSSL_add_all_algorithms ();
+  key.digest_nid = EVP_MD_type (digest);
+
+  return key;
+}
+
+/*
+ * Build a cache key for <data path> verified with <cert> and <digest> against
+ * <signature>.
+ */
+CacheKey
+make_cache_key (const std::string& data_path, X509 *const cert,
+		const EVP_MD *const digest, const std::vector<byte_t>& signature)
+{
+  struct ::stat st;
+  if (::stat (data_path.c_str (), &st) != 0) {
+    throw_system_error ("Cannot stat file: " + data_path);
+  }
+
+  return make_cache_key (st, cert, digest, signature);
+}
+
+/*
+ * A persistent cache of successful verifications shared by all processes
+ * using the same cache file.
+ *
+ * The file is memory mapped and holds a fixed size open addressing hash table
+ * of CacheKeys.  Only successful verifications are remembered, so a lookup
+ * miss (or a lost entry) always falls back to the full verification.  An
+ * advisory lock on the file makes concurrent processes safe, a mutex does
+ * the same for threads (they share the lock).
+ */
+class VerificationCache
+{
+public:
+  explicit VerificationCache (const std::string& path);
+
+  ~VerificationCache ();
+
+  VerificationCache (const VerificationCache&) = delete;
+  VerificationCache& operator= (const VerificationCache&) = delete;
+
+  bool
+  contains (const CacheKey& key) const;
+
+  void
+  insert (const CacheKey& key);
+
+private:
+  struct Header
+  {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t slot_count;
+  };
+
+  struct Slot
+  {
+    // zero means an empty slot
+    std::uint64_t hash;
+    CacheKey key;
+  };
+
+  static constexpr char MAGIC[8] = "SIGVRFC";
+  static constexpr std::uint32_t VERSION = 2;
+  static constexpr std::uint32_t SLOT_COUNT = 1 << 16;
+  // how far to look for a key (or a free slot) from its home slot
+  static constexpr std::uint32_t MAX_PROBES = 16;
+
+  static std::uint64_t
+  hash (const CacheKey& key);
+
+  void
+  lock (int operation) const;
+
+  mutable std::mutex m_mutex;
+  int m_fd;
+  std::size_t m_size;
+  void *m_data;
+  Header *m_header;
+  Slot *m_slots;
+};
+
+constexpr char VerificationCache::MAGIC[8];
+
+VerificationCache::VerificationCache (const std::string& path)
+  : m_fd (-1), m_size (sizeof (Header) + SLOT_COUNT * sizeof (Slot)),
+    m_data (MAP_FAILED), m_header (nullptr), m_slots (nullptr)
+{
+  m_fd = ::open (path.c_str (), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (m_fd < 0) {
+    throw_system_error ("Cannot open cache file: " + path);
+  }
 
   try {
-    // read the certificate
-    const auto cert = read_x509 (argv[1]);
-    // get the public key from the certificate (the signature was created with
-    // the private key)
-    const auto key = make_scoped (X509_get_pubkey (cert.get ()), EVP_PKEY_free);
-    if (!key) {
-      throw std::runtime_error ("Cannot get public key");
+    // only one process can initialise a new cache file
+    lock (LOCK_EX);
+
+    struct ::stat st;
+    if (::fstat (m_fd, &st) != 0) {
+      throw_system_error ("Cannot stat cache file: " + path);
+    }
+
+    const bool fresh = st.st_size == 0;
+    if (fresh) {
+      // the file is sparse so unused slots don't take any disk space
+      if (::ftruncate (m_fd, m_size) != 0) {
+	throw_system_error ("Cannot resize cache file: " + path);
+      }
+    }
+    else if (static_cast<std::size_t> (st.st_size) != m_size) {
+      throw std::runtime_error ("Invalid cache file size: " + path);
+    }
+
+    m_data =
+      ::mmap (nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (m_data == MAP_FAILED) {
+      throw_system_error ("Cannot map cache file: " + path);
+    }
+
+    m_header = static_cast<Header*> (m_data);
+    m_slots = reinterpret_cast<Slot*> (m_header + 1);
+
+    if (fresh) {
+      std::memcpy (m_header->magic, MAGIC, sizeof (MAGIC));
+      m_header->version = VERSION;
+      m_header->slot_count = SLOT_COUNT;
+    }
+    else if (std::memcmp (m_header->magic, MAGIC, sizeof (MAGIC)) != 0 ||
+	     m_header->version != VERSION ||
+	     m_header->slot_count != SLOT_COUNT) {
+      throw std::runtime_error ("Invalid cache file: " + path);
+    }
+
+    lock (LOCK_UN);
+  }
+  catch (...) {
+    if (m_data != MAP_FAILED) {
+      ::munmap (m_data, m_size);
     }
 
-    // create an enveloped message digest context
-    const auto ctx = make_scoped (EVP_MD_CTX_create (), EVP_MD_CTX_destroy);
+    ::close (m_fd);
+    throw;
+  }
+}
+
+VerificationCache::~VerificationCache ()
+{
+  ::munmap (m_data, m_size);
+  ::close (m_fd);
+}
+
+bool
+VerificationCache::contains (const CacheKey& key) const
+{
+  const std::uint64_t h = hash (key);
 
-    // initialize the MD context with SHA1 algorithm (the choice of the
-    // algorithm should be more flexible in most real cases)
-    if (!EVP_VerifyInit_ex (ctx.get (), EVP_sha1 (), nullptr)) {
-      throw std::runtime_error("Cannot initialize verification");
+  std::lock_guard<std::mutex> guard (m_mutex);
+  lock (LOCK_SH);
+  bool found = false;
+  for (std::uint32_t i = 0; i < MAX_PROBES && !found; ++i) {
+    const Slot& slot = m_slots[(h + i) % SLOT_COUNT];
+    if (slot.hash == 0) {
+      break;
     }
 
-    // the data about to be digested
-    const std::vector<byte_t> data = read_file (argv[2]);
+    found =
+      slot.hash == h && std::memcmp (&slot.key, &key, sizeof (key)) == 0;
+  }
+  lock (LOCK_UN);
+
+  return found;
+}
+
+void
+VerificationCache::insert (const CacheKey& key)
+{
+  const std::uint64_t h = hash (key);
+
+  std::lock_guard<std::mutex> guard (m_mutex);
+  lock (LOCK_EX);
+  // If all the probed slots are taken, evict the entry in the home slot.
+  // It's just a cache after all.
+  Slot* target = &m_slots[h % SLOT_COUNT];
+  for (std::uint32_t i = 0; i < MAX_PROBES; ++i) {
+    Slot& slot = m_slots[(h + i) % SLOT_COUNT];
+    if (slot.hash == 0 ||
+	(slot.hash == h && std::memcmp (&slot.key, &key, sizeof (key)) == 0)) {
+      target = &slot;
+      break;
+    }
+  }
 
-    // the signature signed by the private key paired with the public key we're
-    // about to use (the public key is delivered with the certificate so it's
-    // authenticity can be verified)
-    const std::vector<byte_t> signature = read_file (argv[3]);
+  target->key = key;
+  target->hash = h;
+  lock (LOCK_UN);
+}
 
-    // calculate the digest
-    if (!EVP_VerifyUpdate (ctx.get (), data.data (), data.size ())) {
-      throw std::runtime_error("Failed to process data");
+/*
+ * FNV-1a over the whole key.  Never returns zero as it marks empty slots.
+ */
+std::uint64_t
+VerificationCache::hash (const CacheKey& key)
+{
+  std::uint64_t h = 14695981039346656037ULL;
+  byte_t const* const bytes = reinterpret_cast<byte_t const*> (&key);
+  std::for_each (bytes, bytes + sizeof (key), [&h] (const byte_t b) {
+      h = (h ^ b) * 1099511628211ULL;
     }
+  );
 
-    // verify the digest
-    const int result =
-      EVP_VerifyFinal (
-	ctx.get (), signature.data (), signature.size (), key.get ());
+  return h ? h : 1;
+}
 
-    if (result < 0) {
-      throw std::runtime_error ("Verification error");
+void
+VerificationCache::lock (const int operation) const
+{
+  while (::flock (m_fd, operation) != 0) {
+    if (errno != EINTR) {
+      throw_system_error ("Cannot lock cache file");
     }
+  }
+}
 
-    if (result != 0) {
-      std::cout << "Verification OK" << std::endl;
-      return EXIT_SUCCESS;
+/*
+ * An open file descriptor closed when going out of scope.
+ */
+class FileDescriptor
+{
+public:
+  FileDescriptor (const std::string& path, const int flags)
+    : m_fd (::open (path.c_str (), flags | O_CLOEXEC))
+  {
+    if (m_fd < 0) {
+      throw_system_error ("Cannot open file: " + path);
+    }
+  }
+
+  // takes over an already open <fd>
+  explicit FileDescriptor (const int fd)
+    : m_fd (fd)
+  {
+  }
+
+  ~FileDescriptor ()
+  {
+    ::close (m_fd);
+  }
+
+  FileDescriptor (const FileDescriptor&) = delete;
+  FileDescriptor& operator= (const FileDescriptor&) = delete;
+
+  int
+  get () const
+  {
+    return m_fd;
+  }
+
+private:
+  const int m_fd;
+};
+
+/*
+ * The ways data can be read for verification.
+ */
+enum class IoMode
+{
+  // the whole file read into memory with a C++ stream
+  STREAM,
+  // the file read and digested in fixed size chunks (bounded memory)
+  READ,
+  // the file memory mapped and digested in one go (no copying)
+  MMAP
+};
+
+/*
+ * Size of chunks the data is read in with IoMode::READ.
+ */
+constexpr std::size_t READ_CHUNK_SIZE = 1 << 20;
+
+/*
+ * Feed the verification context <ctx> with the content of open file <fd>
+ * (called <name> in error messages) read in chunks, from the beginning of
+ * a regular file (without changing the file offset) or from the current
+ * position of anything else (e.g. a pipe).
+ */
+void
+verify_update_by_reading (EVP_MD_CTX *const ctx, const int fd,
+			  const std::string& name, const bool regular)
+{
+  // just a hint, don't care if it's ignored
+  (void) ::posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  std::vector<byte_t> buffer (READ_CHUNK_SIZE);
+  for (off_t offset = 0;;) {
+    const ssize_t bytes = regular
+      ? ::pread (fd, buffer.data (), buffer.size (), offset)
+      : ::read (fd, buffer.data (), buffer.size ());
+    if (bytes < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+
+      throw_system_error ("Cannot read file: " + name);
+    }
+
+    if (bytes == 0) {
+      break;
+    }
+
+    if (!EVP_VerifyUpdate (ctx, buffer.data (), bytes)) {
+      throw std::runtime_error ("Failed to process data");
+    }
+
+    offset += bytes;
+  }
+}
+
+/*
+ * Feed the verification context <ctx> with the content of open file <fd>
+ * (called <name> in error messages).  The data of a regular file is always
+ * read from the beginning and the file offset isn't changed, so <fd> can be
+ * shared with another process.  Anything else (e.g. a pipe) is read, even
+ * with IoMode::MMAP, as it can't be mapped.  IoMode::STREAM needs a path so
+ * it's not supported.
+ */
+void
+verify_update_from_fd (EVP_MD_CTX *const ctx, const int fd,
+		       const std::string& name, const IoMode mode)
+{
+  if (mode == IoMode::STREAM) {
+    throw std::logic_error ("Cannot stream from a file descriptor");
+  }
+
+  struct ::stat st;
+  if (::fstat (fd, &st) != 0) {
+    throw_system_error ("Cannot stat file: " + name);
+  }
+
+  if (mode == IoMode::READ || !S_ISREG (st.st_mode)) {
+    verify_update_by_reading (ctx, fd, name, S_ISREG (st.st_mode));
+    return;
+  }
+
+  // there's nothing to map in an empty file
+  if (st.st_size == 0) {
+    return;
+  }
+
+  void *const data =
+    ::mmap (nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    throw_system_error ("Cannot map file: " + name);
+  }
+
+  const auto mapping = make_scoped (data, [&st] (void *const p) {
+      ::munmap (p, st.st_size);
+    }
+  );
+  (void) ::madvise (data, st.st_size, MADV_SEQUENTIAL);
+
+  if (!EVP_VerifyUpdate (ctx, data, st.st_size)) {
+    throw std::runtime_error ("Failed to process data");
+  }
+}
+
+/*
+ * Feed the verification context <ctx> with the content of file <path>.
+ */
+void
+verify_update_from_file (EVP_MD_CTX *const ctx, const std::string& path,
+			 const IoMode mode)
+{
+  if (mode == IoMode::STREAM) {
+    const std::vector<byte_t> data = read_file (path);
+    if (!EVP_VerifyUpdate (ctx, data.data (), data.size ())) {
+      throw std::runtime_error ("Failed to process data");
+    }
+  }
+  else {
+    const FileDescriptor fd (path, O_RDONLY);
+    verify_update_from_fd (ctx, fd.get (), path, mode);
+  }
+}
+
+/*
+ * Verify <signature> of the content of file <path> with public <key> and
+ * <digest> algorithm.
+ */
+bool
+verify_file (EVP_PKEY *const key, const EVP_MD *const digest,
+	     const std::string& path, const IoMode mode,
+	     const std::vector<byte_t>& signature)
+{
+  // create an enveloped message digest context
+  const auto ctx = make_scoped (EVP_MD_CTX_create (), EVP_MD_CTX_destroy);
+
+  // initialize the MD context with the digest algorithm the data was signed
+  // with
+  if (!EVP_VerifyInit_ex (ctx.get (), digest, nullptr)) {
+    throw std::runtime_error("Cannot initialize verification");
+  }
+
+  // calculate the digest
+  verify_update_from_file (ctx.get (), path, mode);
+
+  // verify the digest
+  const int result =
+    EVP_VerifyFinal (ctx.get (), signature.data (), signature.size (), key);
+
+  if (result < 0) {
+    throw std::runtime_error ("Verification error");
+  }
+
+  return result != 0;
+}
+
+/*
+ * CPU extensions accelerating the digests, detected at run time.
+ */
+struct CpuFeatures
+{
+  // x86
+  bool sha_ext = false;
+  bool avx2 = false;
+  bool avx = false;
+  bool ssse3 = false;
+  // ARMv8
+  bool arm_sha1 = false;
+  bool arm_sha256 = false;
+  bool arm_sha512 = false;
+};
+
+/*
+ * Apply an OpenSSL capability override <env> ("[~]<value>", "~" clearing
+ * the bits rather than setting the whole vector) to <caps>.
+ */
+std::uint64_t
+apply_cap_override (const std::uint64_t caps, char const *const env)
+{
+  const bool clear = env[0] == '~';
+  const std::uint64_t value = std::strtoull (env + clear, nullptr, 0);
+
+  return clear ? caps & ~value : value;
+}
+
+/*
+ * Detect the CPU features the same way OpenSSL does, including the overrides
+ * from the OPENSSL_ia32cap (x86) or OPENSSL_armcap (ARM) environment variable
+ * (see OpenSSL documentation).
+ */
+CpuFeatures
+detect_cpu_features ()
+{
+  CpuFeatures features;
+
+#if defined(__x86_64__) || defined(__i386__)
+  // OpenSSL's capability vectors: CPUID.1 EDX:ECX and CPUID.7 EBX:ECX
+  std::uint64_t caps[2] = {0, 0};
+  unsigned int eax, ebx, ecx, edx;
+  if (__get_cpuid (1, &eax, &ebx, &ecx, &edx)) {
+    caps[0] = edx | static_cast<std::uint64_t> (ecx) << 32;
+  }
+
+  if (__get_cpuid_count (7, 0, &eax, &ebx, &ecx, &edx)) {
+    caps[1] = ebx | static_cast<std::uint64_t> (ecx) << 32;
+  }
+
+  if (char const *const env = std::getenv ("OPENSSL_ia32cap")) {
+    // ":<value>" only overrides the second vector
+    if (env[0] != ':') {
+      caps[0] = apply_cap_override (caps[0], env);
     }
-    else {
-      std::cerr << "Verification failed\n";
-      return EXIT_FAILURE;
+
+    if (char const *const second = std::strchr (env, ':')) {
+      caps[1] = apply_cap_override (caps[1], second + 1);
     }
   }
+
+  const std::uint64_t cpuid1_ecx = caps[0] >> 32;
+  const std::uint64_t cpuid7_ebx = caps[1];
+  features.ssse3 = cpuid1_ecx & bit_SSSE3;
+  features.avx = cpuid1_ecx & bit_AVX;
+  features.avx2 =
+    (cpuid7_ebx & bit_AVX2) && (cpuid7_ebx & bit_BMI) &&
+    (cpuid7_ebx & bit_BMI2);
+  features.sha_ext = cpuid7_ebx & bit_SHA;
+#elif defined(__aarch64__)
+  const unsigned long hwcap = ::getauxval (AT_HWCAP);
+  // OpenSSL's own capability bits
+  std::uint64_t caps =
+    (hwcap & HWCAP_SHA1 ? 1 << 3 : 0) | (hwcap & HWCAP_SHA2 ? 1 << 4 : 0) |
+    (hwcap & HWCAP_SHA512 ? 1 << 6 : 0);
+  if (char const *const env = std::getenv ("OPENSSL_armcap")) {
+    caps = apply_cap_override (caps, env);
+  }
+
+  features.arm_sha1 = caps & 1 << 3;
+  features.arm_sha256 = caps & 1 << 4;
+  features.arm_sha512 = caps & 1 << 6;
+#endif
+
+  return features;
+}
+
+/*
+ * Name the implementation of <digest> used on a CPU with <features>.
+ *
+ * OpenSSL doesn't tell, but it dispatches at run time following the same
+ * order of preference (best first).
+ */
+std::string
+digest_implementation (const EVP_MD *const digest,
+		       const CpuFeatures& features)
+{
+  const int nid = EVP_MD_type (digest);
+  const bool sha1 = nid == NID_sha1;
+  const bool sha256 = nid == NID_sha224 || nid == NID_sha256;
+  const bool sha512 = nid == NID_sha384 || nid == NID_sha512;
+
+  if (!sha1 && !sha256 && !sha512) {
+    return "generic";
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+  if (features.sha_ext && !sha512) {
+    return "SHA extensions";
+  }
+
+  if (features.avx2) {
+    return "AVX2";
+  }
+
+  if (features.avx) {
+    return "AVX";
+  }
+
+  // there's no SSSE3 SHA-512
+  if (features.ssse3 && !sha512) {
+    return "SSSE3";
+  }
+#elif defined(__aarch64__)
+  if ((sha1 && features.arm_sha1) || (sha256 && features.arm_sha256) ||
+      (sha512 && features.arm_sha512)) {
+    return "ARMv8 crypto extensions";
+  }
+
+  return "NEON";
+#endif
+
+  (void) features;
+  return "generic";
+}
+
+/*
+ * Print the detected CPU extensions and the implementation of <digest>
+ * expected from them.
+ */
+void
+print_hash_info (const EVP_MD *const digest, std::ostream& out)
+{
+  const CpuFeatures features = detect_cpu_features ();
+  const auto yes_no = [] (const bool b) { return b ? "yes" : "no"; };
+
+  out << "Expected by CPUID (OpenSSL doesn't report its choice):\n";
+
+#if defined(__x86_64__) || defined(__i386__)
+  out << "CPU: x86 SHA extensions: " << yes_no (features.sha_ext)
+      << ", AVX2: " << yes_no (features.avx2)
+      << ", AVX: " << yes_no (features.avx)
+      << ", SSSE3: " << yes_no (features.ssse3) << '\n';
+#elif defined(__aarch64__)
+  out << "CPU: ARMv8 SHA1: " << yes_no (features.arm_sha1)
+      << ", SHA2: " << yes_no (features.arm_sha256)
+      << ", SHA512: " << yes_no (features.arm_sha512) << '\n';
+#else
+  (void) yes_no;
+  out << "CPU: no known crypto extensions\n";
+#endif
+
+  out << OBJ_nid2sn (EVP_MD_type (digest)) << ": "
+      << digest_implementation (digest, features) << std::endl;
+}
+
+/*
+ * Verify <signature> of <data path> with <cert> and its public <key>, trying
+ * <cache> first (if any) and remembering the success in it.
+ */
+bool
+verify_file_cached (X509 *const cert, EVP_PKEY *const key,
+		    const EVP_MD *const digest, const std::string& data_path,
+		    const IoMode mode, const std::vector<byte_t>& signature,
+		    VerificationCache *const cache)
+{
+  CacheKey cache_key;
+  struct ::timespec start = {};
+  if (cache) {
+    start = verification_start ();
+    cache_key = make_cache_key (data_path, cert, digest, signature);
+    if (cache->contains (cache_key)) {
+      return true;
+    }
+  }
+
+  if (!verify_file (key, digest, data_path, mode, signature)) {
+    return false;
+  }
+
+  // Only remember the result if the file didn't change while we were
+  // reading it, and can't have without that showing.
+  if (cache && changed_before (cache_key, start)) {
+    const CacheKey current_key =
+      make_cache_key (data_path, cert, digest, signature);
+    if (std::memcmp (&cache_key, &current_key, sizeof (cache_key)) == 0) {
+      cache->insert (cache_key);
+    }
+  }
+
+  return true;
+}
+
+/*
+ * Verify <signature> of <size> bytes of <data> with public <key> and <digest>
+ * algorithm.
+ */
+bool
+verify_buffer (EVP_PKEY *const key, const EVP_MD *const digest,
+	       const void *const data, const std::size_t size,
+	       const std::vector<byte_t>& signature)
+{
+  const auto ctx = make_scoped (EVP_MD_CTX_create (), EVP_MD_CTX_destroy);
+  if (!EVP_VerifyInit_ex (ctx.get (), digest, nullptr)) {
+    throw std::runtime_error("Cannot initialize verification");
+  }
+
+  if (!EVP_VerifyUpdate (ctx.get (), data, size)) {
+    throw std::runtime_error("Failed to process data");
+  }
+
+  const int result =
+    EVP_VerifyFinal (ctx.get (), signature.data (), signature.size (), key);
+  if (result < 0) {
+    throw std::runtime_error ("Verification error");
+  }
+
+  return result != 0;
+}
+
+/*
+ * The signed part of a Merkle tree file.  It's stored (and signed) as is, in
+ * host byte order.
+ */
+struct MerkleRoot
+{
+  char magic[8];
+  std::uint32_t version;
+  std::int32_t digest_nid;
+  std::uint32_t chunk_size;
+  std::uint32_t reserved;
+  std::uint64_t data_size;
+  // only the digest size is used, the rest is zero
+  byte_t hash[EVP_MAX_MD_SIZE];
+};
+
+static_assert (sizeof (MerkleRoot) == 32 + EVP_MAX_MD_SIZE,
+	       "Merkle root record must not have padding");
+
+/*
+ * A Merkle tree over fixed size chunks of a data file.
+ *
+ * The tree file is the root record followed by the digests of all chunks
+ * (the leaves); inner nodes are cheap to recompute so they're not stored.
+ * Leaves and inner nodes are hashed with different prefixes (as in RFC 6962)
+ * and a node without a sibling is promoted to the upper level as is.  Only
+ * the root record is signed, so once the signature and the leaves are
+ * checked against it, any chunk can be verified on its own and in parallel
+ * with the others.  An empty file has a single empty chunk.
+ */
+class MerkleTree
+{
+public:
+  /*
+   * Hash <data path> in <chunk size> chunks with <digest> using <workers>
+   * threads.
+   */
+  static MerkleTree
+  build (const std::string& data_path, const EVP_MD *digest,
+	 std::uint32_t chunk_size, unsigned workers);
+
+  static MerkleTree
+  load (const std::string& tree_path);
+
+  void
+  save (const std::string& tree_path) const;
+
+  const MerkleRoot&
+  root () const
+  {
+    return m_root;
+  }
+
+  std::size_t
+  chunk_count () const
+  {
+    return m_leaves.size () / m_digest_size;
+  }
+
+  /*
+   * Check the leaves produce the root.
+   */
+  bool
+  consistent () const;
+
+  /*
+   * Hash chunks [<first>, <last>) of open data file <fd> with <workers> threads
+   * and return the index of the first one not matching its leaf, or
+   * chunk_count () if all of them match.
+   */
+  std::size_t
+  verify_chunks (int fd, std::size_t first, std::size_t last,
+		 unsigned workers) const;
+
+  // every worker thread has a buffer of the chunk size
+  static constexpr std::uint32_t MAX_CHUNK_SIZE = 1 << 30;
+
+private:
+  static constexpr char MAGIC[8] = "SIGMRKL";
+  static constexpr std::uint32_t VERSION = 1;
+
+  MerkleTree (const MerkleRoot& root);
+
+  /*
+   * Number of chunks of the data according to the root.
+   */
+  std::uint64_t
+  data_chunk_count () const;
+
+  void
+  hash_chunks (int fd, std::size_t first, std::size_t last, unsigned workers,
+	       byte_t *leaves) const;
+
+  void
+  hash_chunk (int fd, std::size_t index, std::vector<byte_t>& buffer,
+	      byte_t *leaf) const;
+
+  void
+  compute_root (byte_t *hash) const;
+
+  void
+  hash_node (const byte_t *left, const byte_t *right, byte_t *hash) const;
+
+  MerkleRoot m_root;
+  const EVP_MD *m_digest;
+  std::size_t m_digest_size;
+  std::vector<byte_t> m_leaves;
+};
+
+constexpr char MerkleTree::MAGIC[8];
+constexpr std::uint32_t MerkleTree::MAX_CHUNK_SIZE;
+
+MerkleTree::MerkleTree (const MerkleRoot& root)
+  : m_root (root), m_digest (EVP_get_digestbynid (root.digest_nid)),
+    m_digest_size (m_digest ? EVP_MD_size (m_digest) : 0)
+{
+  if (!m_digest) {
+    throw std::runtime_error ("Unknown Merkle tree digest");
+  }
+
+  if (m_root.chunk_size == 0 || m_root.chunk_size > MAX_CHUNK_SIZE) {
+    throw std::runtime_error ("Invalid Merkle tree chunk size");
+  }
+}
+
+std::uint64_t
+MerkleTree::data_chunk_count () const
+{
+  return std::max<std::uint64_t> (
+    1, m_root.data_size / m_root.chunk_size +
+    (m_root.data_size % m_root.chunk_size != 0));
+}
+
+MerkleTree
+MerkleTree::build (const std::string& data_path, const EVP_MD *const digest,
+		   const std::uint32_t chunk_size, const unsigned workers)
+{
+  const FileDescriptor fd (data_path, O_RDONLY);
+  struct ::stat st;
+  if (::fstat (fd.get (), &st) != 0) {
+    throw_system_error ("Cannot stat file: " + data_path);
+  }
+
+  MerkleRoot root;
+  std::memset (&root, 0, sizeof (root));
+  std::memcpy (root.magic, MAGIC, sizeof (MAGIC));
+  root.version = VERSION;
+  root.digest_nid = EVP_MD_type (digest);
+  root.chunk_size = chunk_size;
+  root.data_size = st.st_size;
+
+  MerkleTree tree (root);
+  tree.m_leaves.resize (tree.data_chunk_count () * tree.m_digest_size);
+  tree.hash_chunks (
+    fd.get (), 0, tree.chunk_count (), workers, tree.m_leaves.data ());
+  tree.compute_root (tree.m_root.hash);
+
+  return tree;
+}
+
+MerkleTree
+MerkleTree::load (const std::string& tree_path)
+{
+  const std::vector<byte_t> content = read_file (tree_path);
+
+  MerkleRoot root;
+  if (content.size () < sizeof (root)) {
+    throw std::runtime_error ("Invalid Merkle tree file: " + tree_path);
+  }
+
+  std::memcpy (&root, content.data (), sizeof (root));
+  if (std::memcmp (root.magic, MAGIC, sizeof (MAGIC)) != 0 ||
+      root.version != VERSION) {
+    throw std::runtime_error ("Invalid Merkle tree file: " + tree_path);
+  }
+
+  // The sizes in the root aren't trusted (nor allocated) before they are
+  // checked against the file.
+  MerkleTree tree (root);
+  const std::size_t leaves_size = content.size () - sizeof (root);
+  if (leaves_size % tree.m_digest_size != 0 ||
+      leaves_size / tree.m_digest_size != tree.data_chunk_count ()) {
+    throw std::runtime_error ("Invalid Merkle tree file size: " + tree_path);
+  }
+
+  tree.m_leaves.assign (content.begin () + sizeof (root), content.end ());
+
+  return tree;
+}
+
+void
+MerkleTree::save (const std::string& tree_path) const
+{
+  std::ofstream out (tree_path, std::ios::binary | std::ios::trunc);
+  out.write (reinterpret_cast<const char*> (&m_root), sizeof (m_root));
+  out.write (reinterpret_cast<const char*> (m_leaves.data ()),
+	     m_leaves.size ());
+  if (!out.flush ()) {
+    throw std::runtime_error ("Cannot write file: " + tree_path);
+  }
+}
+
+bool
+MerkleTree::consistent () const
+{
+  byte_t hash[EVP_MAX_MD_SIZE] = {};
+  compute_root (hash);
+
+  return std::memcmp (hash, m_root.hash, sizeof (hash)) == 0;
+}
+
+std::size_t
+MerkleTree::verify_chunks (const int fd, const std::size_t first,
+			   const std::size_t last, const unsigned workers) const
+{
+  assert (first < last && last <= chunk_count ());
+
+  std::vector<byte_t> leaves ((last - first) * m_digest_size);
+  hash_chunks (fd, first, last, workers, leaves.data ());
+
+  for (std::size_t i = first; i < last; ++i) {
+    if (std::memcmp (&leaves[(i - first) * m_digest_size],
+		     &m_leaves[i * m_digest_size], m_digest_size) != 0) {
+      return i;
+    }
+  }
+
+  return chunk_count ();
+}
+
+/*
+ * Hash chunks [<first>, <last>) into consecutive <leaves>.  Each of <workers>
+ * threads takes the next chunk not hashed yet.
+ */
+void
+MerkleTree::hash_chunks (const int fd, const std::size_t first,
+			 const std::size_t last, const unsigned workers,
+			 byte_t *const leaves) const
+{
+  std::atomic<std::size_t> next (first);
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  const auto work = [&] () {
+    std::vector<byte_t> buffer (m_root.chunk_size);
+    try {
+      for (std::size_t i; (i = next++) < last; ) {
+	hash_chunk (fd, i, buffer, leaves + (i - first) * m_digest_size);
+      }
+    }
+    catch (...) {
+      std::lock_guard<std::mutex> lock (error_mutex);
+      error = std::current_exception ();
+      // make the others give up too
+      next = last;
+    }
+  };
+
+  std::vector<std::thread> threads;
+  const std::size_t count =
+    std::min<std::size_t> (workers, std::max<std::size_t> (1, last - first));
+  for (std::size_t i = 1; i < count; ++i) {
+    threads.emplace_back (work);
+  }
+
+  work ();
+  for (std::thread& t : threads) {
+    t.join ();
+  }
+
+  if (error) {
+    std::rethrow_exception (error);
+  }
+}
+
+void
+MerkleTree::hash_chunk (const int fd, const std::size_t index,
+			std::vector<byte_t>& buffer, byte_t *const leaf) const
+{
+  const off_t offset = static_cast<off_t> (index) * m_root.chunk_size;
+  const std::size_t size =
+    std::min<std::uint64_t> (m_root.chunk_size, m_root.data_size - offset);
+
+  for (std::size_t done = 0; done < size; ) {
+    const ssize_t bytes =
+      ::pread (fd, buffer.data () + done, size - done, offset + done);
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (bytes < 0) {
+      throw_system_error ("Cannot read data");
+    }
+
+    if (bytes == 0) {
+      throw std::runtime_error ("Data file is shorter than expected");
+    }
+
+    done += bytes;
+  }
+
+  const byte_t prefix = 0;
+  const auto ctx = make_scoped (EVP_MD_CTX_create (), EVP_MD_CTX_destroy);
+  if (!EVP_DigestInit_ex (ctx.get (), m_digest, nullptr) ||
+      !EVP_DigestUpdate (ctx.get (), &prefix, 1) ||
+      !EVP_DigestUpdate (ctx.get (), buffer.data (), size) ||
+      !EVP_DigestFinal_ex (ctx.get (), leaf, nullptr)) {
+    throw std::runtime_error ("Cannot hash chunk");
+  }
+}
+
+/*
+ * Hash the leaves level by level up to the root.
+ */
+void
+MerkleTree::compute_root (byte_t *const hash) const
+{
+  std::vector<byte_t> level (m_leaves);
+  for (std::size_t nodes = chunk_count (); nodes > 1; nodes = (nodes + 1) / 2) {
+    for (std::size_t i = 0; i < nodes / 2; ++i) {
+      hash_node (&level[2 * i * m_digest_size],
+		 &level[(2 * i + 1) * m_digest_size],
+		 &level[i * m_digest_size]);
+    }
+
+    if (nodes % 2) {
+      std::copy_n (&level[(nodes - 1) * m_digest_size], m_digest_size,
+		   &level[nodes / 2 * m_digest_size]);
+    }
+  }
+
+  std::copy_n (level.begin (), m_digest_size, hash);
+}
+
+void
+MerkleTree::hash_node (const byte_t *const left, const byte_t *const right,
+		       byte_t *const hash) const
+{
+  const byte_t prefix = 1;
+  const auto ctx = make_scoped (EVP_MD_CTX_create (), EVP_MD_CTX_destroy);
+  if (!EVP_DigestInit_ex (ctx.get (), m_digest, nullptr) ||
+      !EVP_DigestUpdate (ctx.get (), &prefix, 1) ||
+      !EVP_DigestUpdate (ctx.get (), left, m_digest_size) ||
+      !EVP_DigestUpdate (ctx.get (), right, m_digest_size) ||
+      !EVP_DigestFinal_ex (ctx.get (), hash, nullptr)) {
+    throw std::runtime_error ("Cannot hash Merkle tree node");
+  }
+}
+
+/*
+ * Get the public key from <cert> (the signature was created with the private
+ * key paired with it).
+ */
+scoped_ptr<EVP_PKEY>
+get_public_key (X509 *const cert)
+{
+  EVP_PKEY *const key = X509_get_pubkey (cert);
+  if (!key) {
+    throw std::runtime_error ("Cannot get public key");
+  }
+
+  return make_scoped (key, EVP_PKEY_free);
+}
+
+/*
+ * A certificate trusted by the verification daemon and its public key, both
+ * loaded once at start-up.
+ */
+struct TrustedCert
+{
+  std::string path;
+  scoped_ptr<X509> cert;
+  scoped_ptr<EVP_PKEY> key;
+  // for cache keys
+  byte_t fingerprint[CACHE_DIGEST_SIZE];
+};
+
+/*
+ * Verify <signature> of the content of open file <fd> with any of <trusted>
+ * certificates.  The data is digested only once whatever the number of
+ * certificates.  Returns the matching certificate or nullptr.
+ */
+const TrustedCert*
+verify_fd_with_any (const std::vector<TrustedCert>& trusted,
+		    const EVP_MD *const digest, const int fd,
+		    const std::string& name, const IoMode mode,
+		    const std::vector<byte_t>& signature)
+{
+  const auto ctx = make_scoped (EVP_MD_CTX_create (), EVP_MD_CTX_destroy);
+  if (!EVP_VerifyInit_ex (ctx.get (), digest, nullptr)) {
+    throw std::runtime_error("Cannot initialize verification");
+  }
+
+  verify_update_from_fd (ctx.get (), fd, name, mode);
+
+  // EVP_VerifyFinal() finalises a copy of the digest context, so the same
+  // context can be checked against all the keys.
+  for (const TrustedCert& t : trusted) {
+    const int result = EVP_VerifyFinal (
+      ctx.get (), signature.data (), signature.size (), t.key.get ());
+    if (result > 0) {
+      return &t;
+    }
+
+    // A signature made with a different kind of key is an error rather than
+    // a mismatch, but it's not our business here.
+    ERR_clear_error ();
+  }
+
+  return nullptr;
+}
+
+/*
+ * Maximum size of a request sent to the verification daemon (two paths).
+ */
+constexpr std::size_t MAX_REQUEST_SIZE = 2 * PATH_MAX;
+
+/*
+ * Create a listening Unix domain socket bound to <path>.  A stale socket left
+ * behind by a previous instance is replaced.
+ */
+int
+create_listener (const std::string& path)
+{
+  struct ::sockaddr_un addr;
+  std::memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size () >= sizeof (addr.sun_path)) {
+    throw std::runtime_error ("Socket path too long: " + path);
+  }
+
+  path.copy (addr.sun_path, path.size ());
+
+  struct ::stat st;
+  if (::stat (path.c_str (), &st) == 0 && S_ISSOCK (st.st_mode)) {
+    (void) ::unlink (path.c_str ());
+  }
+
+  const int fd =
+    ::socket (AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    throw_system_error ("Cannot create socket");
+  }
+
+  if (::bind (fd, reinterpret_cast<struct ::sockaddr*> (&addr),
+	      sizeof (addr)) != 0 ||
+      ::listen (fd, SOMAXCONN) != 0) {
+    const int error = errno;
+    ::close (fd);
+    errno = error;
+    throw_system_error ("Cannot listen on socket: " + path);
+  }
+
+  return fd;
+}
+
+/*
+ * Block termination signals and get a file descriptor to receive them
+ * instead.  Has to be called before any threads are started so they all
+ * inherit the signal mask.
+ */
+int
+create_signal_fd ()
+{
+  ::sigset_t mask;
+  ::sigemptyset (&mask);
+  ::sigaddset (&mask, SIGINT);
+  ::sigaddset (&mask, SIGTERM);
+  if (::pthread_sigmask (SIG_BLOCK, &mask, nullptr) != 0) {
+    throw std::runtime_error ("Cannot block signals");
+  }
+
+  const int fd = ::signalfd (-1, &mask, SFD_CLOEXEC);
+  if (fd < 0) {
+    throw_system_error ("Cannot create signal file descriptor");
+  }
+
+  return fd;
+}
+
+/*
+ * Create an epoll instance.
+ */
+int
+create_epoll ()
+{
+  const int fd = ::epoll_create1 (EPOLL_CLOEXEC);
+  if (fd < 0) {
+    throw_system_error ("Cannot create epoll instance");
+  }
+
+  return fd;
+}
+
+/*
+ * A long running verification service listening on a Unix domain socket.
+ *
+ * Trusted certificates are loaded once and every request is verified against
+ * all of them.  A request is a single SOCK_SEQPACKET message holding
+ * the absolute path of a signature file, optionally followed by a new line and
+ * the absolute path of the data file.  If there's no data path, the data file
+ * descriptor has to be attached to the message (SCM_RIGHTS).  The reply is
+ * also a single message: "OK <certificate path>", "FAILED" or
+ * "ERROR <message>".
+ *
+ * The files at the paths in requests are opened with the daemon's own
+ * credentials, and only regular files are (so a FIFO can't block a worker).
+ *
+ * An event loop accepts connections and hands the ones with a pending request
+ * over to a pool of workers.  A connection isn't watched while its request is
+ * being processed, so requests on one connection are answered in order while
+ * separate connections are served concurrently.
+ */
+class VerificationDaemon
+{
+public:
+  VerificationDaemon (const std::string& socket_path,
+		      std::vector<TrustedCert> trusted,
+		      const EVP_MD *digest, IoMode mode,
+		      VerificationCache *cache);
+
+  ~VerificationDaemon ();
+
+  VerificationDaemon (const VerificationDaemon&) = delete;
+  VerificationDaemon& operator= (const VerificationDaemon&) = delete;
+
+  /*
+   * Serve requests with <workers> threads until SIGINT or SIGTERM.
+   */
+  void
+  run (unsigned workers);
+
+private:
+  void
+  dispatch ();
+
+  void
+  accept_clients ();
+
+  void
+  watch (int client, int operation);
+
+  void
+  close_client (int client);
+
+  void
+  work ();
+
+  void
+  serve (int client);
+
+  std::string
+  verify (const std::string& request, int data_fd);
+
+  const std::string m_socket_path;
+  const std::vector<TrustedCert> m_trusted;
+  const EVP_MD *const m_digest;
+  const IoMode m_mode;
+  VerificationCache *const m_cache;
+  const FileDescriptor m_signals;
+  const FileDescriptor m_listener;
+  const FileDescriptor m_epoll;
+
+  std::mutex m_mutex;
+  std::condition_variable m_pending_cond;
+  std::deque<int> m_pending;
+  // all open connections, watched, pending or being served
+  std::unordered_set<int> m_clients;
+  bool m_stopping;
+};
+
+VerificationDaemon::VerificationDaemon (const std::string& socket_path,
+					std::vector<TrustedCert> trusted,
+					const EVP_MD *const digest,
+					const IoMode mode,
+					VerificationCache *const cache)
+  : m_socket_path (socket_path), m_trusted (std::move (trusted)),
+    m_digest (digest),
+    // data is only ever received as a file descriptor
+    m_mode (mode == IoMode::STREAM ? IoMode::READ : mode),
+    m_cache (cache), m_signals (create_signal_fd ()),
+    m_listener (create_listener (socket_path)), m_epoll (create_epoll ()),
+    m_stopping (false)
+{
+  struct ::epoll_event event;
+  std::memset (&event, 0, sizeof (event));
+  event.events = EPOLLIN;
+
+  event.data.fd = m_signals.get ();
+  if (::epoll_ctl (m_epoll.get (), EPOLL_CTL_ADD, m_signals.get (), &event)
+      != 0) {
+    throw_system_error ("Cannot watch signals");
+  }
+
+  event.data.fd = m_listener.get ();
+  if (::epoll_ctl (m_epoll.get (), EPOLL_CTL_ADD, m_listener.get (), &event)
+      != 0) {
+    throw_system_error ("Cannot watch socket");
+  }
+}
+
+VerificationDaemon::~VerificationDaemon ()
+{
+  (void) ::unlink (m_socket_path.c_str ());
+}
+
+void
+VerificationDaemon::run (const unsigned workers)
+{
+  std::vector<std::thread> threads;
+  const auto stop = [this, &threads] () {
+    {
+      std::lock_guard<std::mutex> lock (m_mutex);
+      m_stopping = true;
+    }
+
+    m_pending_cond.notify_all ();
+    for (std::thread& t : threads) {
+      t.join ();
+    }
+
+    // the workers are gone, so are the connections still open
+    for (const int client : m_clients) {
+      ::close (client);
+    }
+
+    m_clients.clear ();
+    m_pending.clear ();
+  };
+
+  try {
+    for (unsigned i = 0; i < workers; ++i) {
+      threads.emplace_back (&VerificationDaemon::work, this);
+    }
+
+    dispatch ();
+  }
+  catch (...) {
+    stop ();
+    throw;
+  }
+
+  stop ();
+}
+
+/*
+ * The event loop.  Returns once a termination signal is received.
+ */
+void
+VerificationDaemon::dispatch ()
+{
+  struct ::epoll_event events[64];
+  for (;;) {
+    const int count = ::epoll_wait (m_epoll.get (), events, 64, -1);
+    if (count < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+
+      throw_system_error ("Cannot wait for events");
+    }
+
+    for (int i = 0; i < count; ++i) {
+      const int fd = events[i].data.fd;
+      if (fd == m_signals.get ()) {
+	struct ::signalfd_siginfo si;
+	if (::read (fd, &si, sizeof (si)) == sizeof (si)) {
+	  std::clog << "Received signal " << si.ssi_signo << ", quitting"
+		    << std::endl;
+	  return;
+	}
+      }
+      else if (fd == m_listener.get ()) {
+	accept_clients ();
+      }
+      else {
+	{
+	  std::lock_guard<std::mutex> lock (m_mutex);
+	  m_pending.push_back (fd);
+	}
+
+	m_pending_cond.notify_one ();
+      }
+    }
+  }
+}
+
+void
+VerificationDaemon::accept_clients ()
+{
+  for (;;) {
+    const int client = ::accept4 (m_listener.get (), nullptr, nullptr,
+				  SOCK_CLOEXEC);
+    if (client < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+	return;
+      }
+
+      if (errno == EINTR || errno == ECONNABORTED) {
+	continue;
+      }
+
+      throw_system_error ("Cannot accept connection");
+    }
+
+    {
+      std::lock_guard<std::mutex> lock (m_mutex);
+      m_clients.insert (client);
+    }
+
+    watch (client, EPOLL_CTL_ADD);
+  }
+}
+
+/*
+ * Wait for the next request on <client>.  The connection is taken off the
+ * event loop as soon as the request arrives (one-shot).
+ */
+void
+VerificationDaemon::watch (const int client, const int operation)
+{
+  struct ::epoll_event event;
+  std::memset (&event, 0, sizeof (event));
+  event.events = EPOLLIN | EPOLLONESHOT;
+  event.data.fd = client;
+  if (::epoll_ctl (m_epoll.get (), operation, client, &event) != 0) {
+    std::cerr << "Cannot watch connection: " << std::strerror (errno) << '\n';
+    close_client (client);
+  }
+}
+
+void
+VerificationDaemon::close_client (const int client)
+{
+  // not to close a new connection given the same descriptor meanwhile
+  std::lock_guard<std::mutex> lock (m_mutex);
+  m_clients.erase (client);
+  ::close (client);
+}
+
+void
+VerificationDaemon::work ()
+{
+  for (;;) {
+    int client;
+    {
+      std::unique_lock<std::mutex> lock (m_mutex);
+      m_pending_cond.wait (lock, [this] () {
+	  return m_stopping || !m_pending.empty ();
+	}
+      );
+
+      if (m_stopping) {
+	return;
+      }
+
+      client = m_pending.front ();
+      m_pending.pop_front ();
+    }
+
+    serve (client);
+  }
+}
+
+/*
+ * Answer a single request pending on <client>.
+ */
+void
+VerificationDaemon::serve (const int client)
+{
+  char request[MAX_REQUEST_SIZE];
+  union {
+    char buffer[CMSG_SPACE (sizeof (int))];
+    struct ::cmsghdr align;
+  } control;
+
+  struct ::iovec iov;
+  iov.iov_base = request;
+  iov.iov_len = sizeof (request);
+
+  struct ::msghdr msg;
+  std::memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof (control.buffer);
+
+  ssize_t bytes;
+  do {
+    bytes = ::recvmsg (client, &msg, MSG_CMSG_CLOEXEC);
+  } while (bytes < 0 && errno == EINTR);
+
+  // closed by the peer (or broken)
+  if (bytes <= 0) {
+    close_client (client);
+    return;
+  }
+
+  int data_fd = -1;
+  for (struct ::cmsghdr *cmsg = CMSG_FIRSTHDR (&msg); cmsg;
+       cmsg = CMSG_NXTHDR (&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      std::memcpy (&data_fd, CMSG_DATA (cmsg), sizeof (data_fd));
+    }
+  }
+
+  std::string reply;
+  if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+    reply = "ERROR Request too long";
+  }
+  else {
+    try {
+      reply = verify (std::string (request, bytes), data_fd);
+    }
+    catch (const std::exception& e) {
+      reply = std::string ("ERROR ") + e.what ();
+    }
+  }
+
+  if (data_fd >= 0) {
+    ::close (data_fd);
+  }
+
+  if (::send (client, reply.data (), reply.size (), MSG_NOSIGNAL) < 0) {
+    close_client (client);
+    return;
+  }
+
+  watch (client, EPOLL_CTL_MOD);
+}
+
+/*
+ * Open <path> from a request, refusing anything but a regular file.  It's
+ * opened non-blocking, so a FIFO doesn't block until a writer comes.
+ */
+std::unique_ptr<FileDescriptor>
+open_requested (const std::string& path)
+{
+  std::unique_ptr<FileDescriptor> fd (
+    new FileDescriptor (path, O_RDONLY | O_NONBLOCK));
+  struct ::stat st;
+  if (::fstat (fd->get (), &st) != 0) {
+    throw_system_error ("Cannot stat file: " + path);
+  }
+
+  if (!S_ISREG (st.st_mode)) {
+    throw std::runtime_error ("Not a regular file: " + path);
+  }
+
+  return fd;
+}
+
+/*
+ * Read all of open file <fd> (called <name> in error messages).
+ */
+std::vector<byte_t>
+read_fd (const int fd, const std::string& name)
+{
+  std::vector<byte_t> content;
+  byte_t buffer[4096];
+  for (;;) {
+    const ssize_t bytes = ::read (fd, buffer, sizeof (buffer));
+    if (bytes < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+
+      throw_system_error ("Cannot read file: " + name);
+    }
+
+    if (bytes == 0) {
+      return content;
+    }
+
+    content.insert (content.end (), buffer, buffer + bytes);
+  }
+}
+
+/*
+ * Verify a single <request> and return the reply.
+ */
+std::string
+VerificationDaemon::verify (const std::string& request, const int data_fd)
+{
+  const std::size_t newline = request.find ('\n');
+  const std::string signature_path = request.substr (0, newline);
+  const std::string data_path =
+    newline == std::string::npos ? "" : request.substr (newline + 1);
+
+  if (data_path.empty () == (data_fd < 0)) {
+    return "ERROR Expecting either a data path or a data file descriptor";
+  }
+
+  const std::vector<byte_t> signature =
+    read_fd (open_requested (signature_path)->get (), signature_path);
+
+  std::unique_ptr<FileDescriptor> opened;
+  if (!data_path.empty ()) {
+    opened = open_requested (data_path);
+  }
+
+  const int fd = opened ? opened->get () : data_fd;
+  const std::string& name = opened ? data_path : "<received file>";
+
+  const struct ::timespec start = verification_start ();
+  struct ::stat st;
+  if (::fstat (fd, &st) != 0) {
+    throw_system_error ("Cannot stat file: " + name);
+  }
+
+  if (m_cache && !m_trusted.empty ()) {
+    // the same key but for the certificate
+    CacheKey key =
+      make_cache_key (st, m_trusted.front ().cert.get (), m_digest, signature);
+    for (const TrustedCert& t : m_trusted) {
+      std::memcpy (key.cert_fingerprint, t.fingerprint, sizeof (t.fingerprint));
+      if (m_cache->contains (key)) {
+	return "OK " + t.path;
+      }
+    }
+  }
+
+  const TrustedCert *const match =
+    verify_fd_with_any (m_trusted, m_digest, fd, name, m_mode, signature);
+  if (!match) {
+    return "FAILED";
+  }
+
+  if (m_cache) {
+    const CacheKey key =
+      make_cache_key (st, match->cert.get (), m_digest, signature);
+
+    // only if the file didn't change while being verified (nor could have
+    // unnoticed)
+    struct ::stat current;
+    if (changed_before (key, start) && ::fstat (fd, &current) == 0) {
+      const CacheKey current_key =
+	make_cache_key (current, match->cert.get (), m_digest, signature);
+      if (std::memcmp (&key, &current_key, sizeof (key)) == 0) {
+	m_cache->insert (key);
+      }
+    }
+  }
+
+  return "OK " + match->path;
+}
+
+/*
+ * Send a verification request for <data path> and <signature path> to
+ * the daemon listening on <socket path>.  The data file is opened here and
+ * passed to the daemon as a file descriptor.  Returns the daemon's reply.
+ */
+std::string
+request_verification (const std::string& socket_path,
+		      const std::string& data_path,
+		      const std::string& signature_path)
+{
+  struct ::sockaddr_un addr;
+  std::memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if (socket_path.size () >= sizeof (addr.sun_path)) {
+    throw std::runtime_error ("Socket path too long: " + socket_path);
+  }
+
+  socket_path.copy (addr.sun_path, socket_path.size ());
+
+  const FileDescriptor sock (
+    ::socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0));
+  if (sock.get () < 0) {
+    throw_system_error ("Cannot create socket");
+  }
+
+  if (::connect (sock.get (), reinterpret_cast<struct ::sockaddr*> (&addr),
+		 sizeof (addr)) != 0) {
+    throw_system_error ("Cannot connect to: " + socket_path);
+  }
+
+  // the daemon doesn't share our working directory
+  const auto signature_realpath =
+    make_scoped (::realpath (signature_path.c_str (), nullptr), std::free);
+  if (!signature_realpath) {
+    throw_system_error ("Cannot resolve path: " + signature_path);
+  }
+
+  const FileDescriptor data (data_path, O_RDONLY);
+
+  struct ::iovec iov;
+  iov.iov_base = signature_realpath.get ();
+  iov.iov_len = std::strlen (signature_realpath.get ());
+
+  union {
+    char buffer[CMSG_SPACE (sizeof (int))];
+    struct ::cmsghdr align;
+  } control;
+  std::memset (&control, 0, sizeof (control));
+
+  struct ::msghdr msg;
+  std::memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof (control.buffer);
+
+  struct ::cmsghdr *const cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+  const int fd = data.get ();
+  std::memcpy (CMSG_DATA (cmsg), &fd, sizeof (fd));
+
+  if (::sendmsg (sock.get (), &msg, MSG_NOSIGNAL) < 0) {
+    throw_system_error ("Cannot send request");
+  }
+
+  char reply[MAX_REQUEST_SIZE];
+  const ssize_t bytes = ::recv (sock.get (), reply, sizeof (reply), 0);
+  if (bytes < 0) {
+    throw_system_error ("Cannot receive reply");
+  }
+
+  if (bytes == 0) {
+    throw std::runtime_error ("No reply from daemon");
+  }
+
+  return std::string (reply, bytes);
+}
+
+void
+usage (char const *const arg0, std::ostream& out)
+{
+  out <<
+"Usage:\n"
+"\n"
+"    " << arg0 << " [<options>] <PEM cert> <data file> <signature file>\n"
+"    " << arg0 << " [<options>] --daemon <socket> <PEM cert>...\n"
+"    " << arg0 << " --connect <socket> <data file> <signature file>\n"
+"    " << arg0 << " [<options>] --batch <list file> <PEM cert>\n"
+"    " << arg0 << " [--digest <name>] --hash-info\n"
+"    " << arg0 << " [<options>] --merkle-build <tree file> <data file>\n"
+"    " << arg0 << " [<options>] --merkle <tree file> <PEM cert> <data file>\n"
+"        <signature file>\n"
+"\n"
+"Verifies <data file> signature stored in <signature file> with certificate\n"
+"in <PEM cert>.\n"
+"\n"
+"With --daemon, all <PEM cert>s are loaded once and requests received on\n"
+"Unix domain <socket> are verified against them until SIGINT or SIGTERM.\n"
+"The files at the paths in requests are read with the daemon's credentials\n"
+"(only regular files).\n"
+"With --connect, the verification is requested from such a daemon.\n"
+"\n"
+"With --batch, every line of <list file> holds whitespace separated\n"
+"<data file> and <signature file> paths.  The files are verified\n"
+"concurrently by --workers threads and a verdict is printed for each.\n"
+"\n"
+"With --hash-info, the CPU crypto extensions and the digest implementation\n"
+"they should make OpenSSL use are printed (as expected by CPUID, OpenSSL\n"
+"doesn't tell).  Set OPENSSL_ia32cap (x86) or OPENSSL_armcap (ARM) to\n"
+"restrict the choice (see OpenSSL documentation).\n"
+"\n"
+"With --merkle-build, <data file> is hashed in chunks into a Merkle tree\n"
+"saved in <tree file>.  It's the first " << sizeof (MerkleRoot)
+      << " bytes of <tree file> (the root\n"
+"record) that get signed.  With --merkle, <signature file> of the root\n"
+"record is verified and then the chunks of <data file> are checked in\n"
+"parallel against the tree, all of them or only those overlapping --range.\n"
+"\n"
+"Options:\n"
+"\n"
+"    -c, --cache <cache file>\n"
+"        Remember successful verifications in <cache file> (created if it\n"
+"        doesn't exist).  If <data file> hasn't changed since (same inode,\n"
+"        size and modification times) and neither the certificate nor\n"
+"        the signature has, the data isn't read and hashed again.  Files\n"
+"        changed no earlier than their verification started aren't\n"
+"        remembered, as they might still be rewritten with the same size\n"
+"        within the same timestamp tick; the cache can't see changes which\n"
+"        keep the size and timestamps anyway.\n"
+"\n"
+"    -d, --digest <name>\n"
+"        Digest algorithm the data was signed with (default: sha1).\n"
+"\n"
+"    -i, --io <mode>\n"
+"        How <data file> is read:  'stream' reads it all into memory\n"
+"        (default), 'read' reads and digests it in chunks, 'mmap' maps it\n"
+"        into memory.  The daemon always uses 'read' or 'mmap'.\n"
+"\n"
+"    -w, --workers <count>\n"
+"        Number of threads verifying requests in the daemon or files in\n"
+"        a batch, or hashing Merkle tree chunks, 1 to 1024 (default:\n"
+"        number of CPUs).\n"
+"\n"
+"    -s, --chunk-size <bytes>\n"
+"        Merkle tree chunk size (default: 1048576, at most "
+      << MerkleTree::MAX_CHUNK_SIZE << ").\n"
+"\n"
+"    -r, --range <offset>:<length>\n"
+"        Only verify the part of <data file> with a Merkle tree.\n"
+      << std::endl;
+}
+
+bool
+help_requested (const std::string& arg)
+{
+  return arg == "-h" || arg == "-help" || arg == "--help";
+}
+
+/*
+ * Command line options.
+ */
+struct Options
+{
+  // empty if no cache is used
+  std::string cache_path;
+  std::string digest_name = "sha1";
+  IoMode io_mode = IoMode::STREAM;
+  // only one of these can be set
+  std::string daemon_socket;
+  std::string connect_socket;
+  std::string batch_list;
+  bool hash_info = false;
+  std::string merkle_build;
+  std::string merkle_tree;
+  std::uint32_t chunk_size = 1 << 20;
+  // the whole file by default
+  std::uint64_t range_offset = 0;
+  std::uint64_t range_length = UINT64_MAX;
+  unsigned workers = std::max (1u, std::thread::hardware_concurrency ());
+};
+
+/*
+ * Convert an I/O mode name used on the command line.
+ */
+bool
+parse_io_mode (const std::string& name, IoMode& mode)
+{
+  if (name == "stream") {
+    mode = IoMode::STREAM;
+  }
+  else if (name == "read") {
+    mode = IoMode::READ;
+  }
+  else if (name == "mmap") {
+    mode = IoMode::MMAP;
+  }
+  else {
+    return false;
+  }
+
+  return true;
+}
+
+// upper bound of --workers
+constexpr unsigned long MAX_WORKERS = 1024;
+
+/*
+ * Parse command line options.  On success, optind points at the first
+ * positional argument.
+ */
+bool
+parse_options (int argc, char* argv[], Options& options)
+{
+  const struct ::option long_options[] = {
+    {"cache", required_argument, nullptr, 'c'},
+    {"digest", required_argument, nullptr, 'd'},
+    {"io", required_argument, nullptr, 'i'},
+    {"daemon", required_argument, nullptr, 'D'},
+    {"connect", required_argument, nullptr, 'C'},
+    {"workers", required_argument, nullptr, 'w'},
+    {"batch", required_argument, nullptr, 'b'},
+    {"hash-info", no_argument, nullptr, 'H'},
+    {"merkle-build", required_argument, nullptr, 'M'},
+    {"merkle", required_argument, nullptr, 'm'},
+    {"chunk-size", required_argument, nullptr, 's'},
+    {"range", required_argument, nullptr, 'r'},
+    {nullptr, 0, nullptr, 0}
+  };
+
+  int opt;
+  while ((opt = ::getopt_long (argc, argv, "+c:d:i:w:b:Hs:r:", long_options,
+			       nullptr)) != -1) {
+    switch (opt) {
+    case 'c':
+      options.cache_path = optarg;
+      break;
+
+    case 'd':
+      options.digest_name = optarg;
+      break;
+
+    case 'i':
+      if (!parse_io_mode (optarg, options.io_mode)) {
+	std::cerr << "Unknown I/O mode: " << optarg << '\n';
+	return false;
+      }
+
+      break;
+
+    case 'D':
+      options.daemon_socket = optarg;
+      break;
+
+    case 'C':
+      options.connect_socket = optarg;
+      break;
+
+    case 'b':
+      options.batch_list = optarg;
+      break;
+
+    case 'H':
+      options.hash_info = true;
+      break;
+
+    case 'M':
+      options.merkle_build = optarg;
+      break;
+
+    case 'm':
+      options.merkle_tree = optarg;
+      break;
+
+    case 's': {
+      char *end;
+      const unsigned long long chunk_size = std::strtoull (optarg, &end, 0);
+      if (*end || chunk_size == 0 || chunk_size > MerkleTree::MAX_CHUNK_SIZE) {
+	std::cerr << "Invalid chunk size: " << optarg << '\n';
+	return false;
+      }
+
+      options.chunk_size = chunk_size;
+      break;
+    }
+
+    case 'r': {
+      // (strtoull () would take negative numbers)
+      char *end;
+      options.range_offset = std::strtoull (optarg, &end, 0);
+      const char *const length = end + 1;
+      if (end == optarg || *end != ':' || std::strchr (optarg, '-')) {
+	std::cerr << "Invalid range: " << optarg << '\n';
+	return false;
+      }
+
+      options.range_length = std::strtoull (length, &end, 0);
+      if (end == length || *end || options.range_length == 0) {
+	std::cerr << "Invalid range: " << optarg << '\n';
+	return false;
+      }
+
+      break;
+    }
+
+    case 'w': {
+      // (strtoul () would skip white space and take negative numbers)
+      char *end;
+      errno = 0;
+      const unsigned long workers = std::strtoul (optarg, &end, 10);
+      if (!std::isdigit (static_cast<unsigned char> (*optarg)) || *end ||
+	  errno || workers == 0 || workers > MAX_WORKERS) {
+	std::cerr << "Invalid number of workers: " << optarg << '\n';
+	return false;
+      }
+
+      options.workers = workers;
+      break;
+    }
+
+    default:
+      return false;
+    }
+  }
+
+  // at most one mode of operation
+  return !options.daemon_socket.empty () + !options.connect_socket.empty () +
+    !options.batch_list.empty () + options.hash_info +
+    !options.merkle_build.empty () + !options.merkle_tree.empty () <= 1;
+}
+
+/*
+ * Verify a single <data path> file.
+ */
+int
+run_verification (const Options& options, const EVP_MD *const digest,
+		  char const *const cert_path, char const *const data_path,
+		  char const *const signature_path)
+{
+  // read the certificate
+  const auto cert = read_x509 (cert_path);
+  // get the public key from the certificate (the signature was created with
+  // the private key)
+  const auto key = get_public_key (cert.get ());
+
+  // the signature signed by the private key paired with the public key we're
+  // about to use (the public key is delivered with the certificate so it's
+  // authenticity can be verified)
+  const std::vector<byte_t> signature = read_file (signature_path);
+
+  std::unique_ptr<VerificationCache> cache;
+  if (!options.cache_path.empty ()) {
+    cache.reset (new VerificationCache (options.cache_path));
+  }
+
+  if (verify_file_cached (cert.get (), key.get (), digest, data_path,
+			  options.io_mode, signature, cache.get ())) {
+    std::cout << "Verification OK" << std::endl;
+    return EXIT_SUCCESS;
+  }
+  else {
+    std::cerr << "Verification failed\n";
+    return EXIT_FAILURE;
+  }
+}
+
+/*
+ * Verify all files listed in <list path> concurrently.
+ */
+int
+run_batch (const Options& options, const EVP_MD *const digest,
+	   char const *const cert_path)
+{
+  const auto cert = read_x509 (cert_path);
+  const auto key = get_public_key (cert.get ());
+
+  std::ifstream list (options.batch_list);
+  if (!list) {
+    throw std::runtime_error ("Cannot open file: " + options.batch_list);
+  }
+
+  struct Item
+  {
+    std::string data_path;
+    std::string signature_path;
+    std::string verdict;
+  };
+
+  std::vector<Item> items;
+  std::string line;
+  while (std::getline (list, line)) {
+    Item item;
+    std::istringstream fields (line);
+    if (fields >> item.data_path >> item.signature_path) {
+      items.push_back (item);
+    }
+  }
+
+  std::unique_ptr<VerificationCache> cache;
+  if (!options.cache_path.empty ()) {
+    cache.reset (new VerificationCache (options.cache_path));
+  }
+
+  // Each worker takes the next unverified file.  Small files are digested
+  // in parallel on all cores this way, which is what makes a batch faster
+  // than verifying the files one by one.
+  std::atomic<std::size_t> next (0);
+  std::atomic<bool> all_ok (true);
+  const auto work = [&] () {
+    for (std::size_t i; (i = next++) < items.size (); ) {
+      Item& item = items[i];
+      try {
+	const std::vector<byte_t> signature = read_file (item.signature_path);
+	if (verify_file_cached (cert.get (), key.get (), digest,
+				item.data_path, options.io_mode, signature,
+				cache.get ())) {
+	  item.verdict = "OK";
+	  continue;
+	}
+
+	item.verdict = "FAILED";
+      }
+      catch (const std::exception& e) {
+	item.verdict = std::string ("ERROR ") + e.what ();
+      }
+
+      all_ok = false;
+    }
+  };
+
+  std::vector<std::thread> threads;
+  const std::size_t count =
+    std::min<std::size_t> (options.workers, items.size ());
+  for (std::size_t i = 0; i < count; ++i) {
+    threads.emplace_back (work);
+  }
+
+  for (std::thread& t : threads) {
+    t.join ();
+  }
+
+  for (const Item& item : items) {
+    std::cout << item.data_path << ": " << item.verdict << '\n';
+  }
+
+  std::cout.flush ();
+  return all_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Build a Merkle tree of <data path>.
+ */
+int
+run_merkle_build (const Options& options, const EVP_MD *const digest,
+		  char const *const data_path)
+{
+  const MerkleTree tree =
+    MerkleTree::build (data_path, digest, options.chunk_size, options.workers);
+  tree.save (options.merkle_build);
+
+  return EXIT_SUCCESS;
+}
+
+/*
+ * Verify <data path> (or just its range) with a signed Merkle tree.
+ */
+int
+run_merkle_verification (const Options& options, const EVP_MD *const digest,
+			 char const *const cert_path,
+			 char const *const data_path,
+			 char const *const signature_path)
+{
+  const auto cert = read_x509 (cert_path);
+  const auto key = get_public_key (cert.get ());
+  const std::vector<byte_t> signature = read_file (signature_path);
+  const MerkleTree tree = MerkleTree::load (options.merkle_tree);
+
+  // Nothing in the tree can be trusted before its root is verified.
+  if (!verify_buffer (key.get (), digest, &tree.root (), sizeof (tree.root ()),
+		      signature)) {
+    std::cerr << "Verification failed\n";
+    return EXIT_FAILURE;
+  }
+
+  if (!tree.consistent ()) {
+    std::cerr << "Verification failed: Merkle tree doesn't match its root\n";
+    return EXIT_FAILURE;
+  }
+
+  const FileDescriptor fd (data_path, O_RDONLY);
+  struct ::stat st;
+  if (::fstat (fd.get (), &st) != 0) {
+    throw_system_error ("Cannot stat file: " + std::string (data_path));
+  }
+
+  if (static_cast<std::uint64_t> (st.st_size) != tree.root ().data_size) {
+    std::cerr << "Verification failed: data size doesn't match\n";
+    return EXIT_FAILURE;
+  }
+
+  // (only empty data has a chunk starting at its end)
+  if (options.range_offset >= tree.root ().data_size &&
+      (options.range_offset != 0 || tree.root ().data_size != 0)) {
+    throw std::runtime_error ("Range beyond the end of data");
+  }
+
+  const std::uint64_t chunk_size = tree.root ().chunk_size;
+  const std::uint64_t range_end =
+    options.range_length > tree.root ().data_size - options.range_offset ?
+    tree.root ().data_size : options.range_offset + options.range_length;
+
+  const std::size_t first = options.range_offset / chunk_size;
+  const std::size_t last = std::max<std::size_t> (
+    first + 1, std::min<std::uint64_t> (
+      tree.chunk_count (), (range_end + chunk_size - 1) / chunk_size));
+
+  const std::size_t bad =
+    tree.verify_chunks (fd.get (), first, last, options.workers);
+  if (bad != tree.chunk_count ()) {
+    std::cerr << "Verification failed: chunk " << bad << " at offset "
+	      << bad * chunk_size << " doesn't match\n";
+    return EXIT_FAILURE;
+  }
+
+  std::cout << "Verification OK" << std::endl;
+  return EXIT_SUCCESS;
+}
+
+/*
+ * Run the verification daemon with certificates from <cert paths>.
+ */
+int
+run_daemon (const Options& options, const EVP_MD *const digest,
+	    char const *const *const begin, char const *const *const end)
+{
+  std::vector<TrustedCert> trusted;
+  std::for_each (begin, end, [&trusted] (char const *const path) {
+      auto cert = read_x509 (path);
+      auto key = get_public_key (cert.get ());
+      TrustedCert t {path, std::move (cert), std::move (key), {}};
+      get_cert_fingerprint (t.cert.get (), t.fingerprint);
+      trusted.push_back (std::move (t));
+    }
+  );
+
+  std::unique_ptr<VerificationCache> cache;
+  if (!options.cache_path.empty ()) {
+    cache.reset (new VerificationCache (options.cache_path));
+  }
+
+  VerificationDaemon daemon (options.daemon_socket, std::move (trusted),
+			     digest, options.io_mode, cache.get ());
+  std::clog << "Listening on " << options.daemon_socket << " ("
+	    << OBJ_nid2sn (EVP_MD_type (digest)) << ": "
+	    << digest_implementation (digest, detect_cpu_features ())
+	    << " expected by CPUID)" << std::endl;
+  daemon.run (options.workers);
+
+  return EXIT_SUCCESS;
+}
+
+/*
+ * Ask the verification daemon to verify <data path>.
+ */
+int
+run_client (const Options& options, char const *const data_path,
+	    char const *const signature_path)
+{
+  const std::string reply =
+    request_verification (options.connect_socket, data_path, signature_path);
+
+  if (reply.compare (0, 3, "OK ") == 0) {
+    std::cout << "Verification OK (" << reply.substr (3) << ')' << std::endl;
+    return EXIT_SUCCESS;
+  }
+  else if (reply == "FAILED") {
+    std::cerr << "Verification failed\n";
+    return EXIT_FAILURE;
+  }
+  else {
+    throw std::runtime_error (reply);
+  }
+}
+
+int
+main (int argc, char* argv[])
+{
+  // help
+  if (argc == 2 && help_requested (argv[1])) {
+    usage (argv[0], std::cout);
+    return EXIT_SUCCESS;
+  }
+
+  // misuse
+  Options options;
+  const int args = parse_options (argc, argv, options) ? argc - optind : -1;
+  if (!options.daemon_socket.empty () ? args < 1 :
+      !options.connect_socket.empty () ? args != 2 :
+      !options.batch_list.empty () ? args != 1 :
+      !options.merkle_build.empty () ? args != 1 :
+      options.hash_info ? args != 0 : args != 3) {
+    usage (argv[0], std::cerr);
+    return EXIT_FAILURE;
+  }
+
+  // This has to be called before the verification where a number of cryptographic
+  // algorithms is used (they might not be available by default).
+  OpenSSL_add_all_algorithms ();
+
+  try {
+    if (!options.connect_socket.empty ()) {
+      return run_client (options, argv[optind], argv[optind + 1]);
+    }
+
+    const EVP_MD *const digest =
+      EVP_get_digestbyname (options.digest_name.c_str ());
+    if (!digest) {
+      throw std::runtime_error ("Unknown digest: " + options.digest_name);
+    }
+
+    if (options.hash_info) {
+      print_hash_info (digest, std::cout);
+      return EXIT_SUCCESS;
+    }
+
+    if (!options.daemon_socket.empty ()) {
+      return run_daemon (options, digest, argv + optind, argv + argc);
+    }
+
+    if (!options.batch_list.empty ()) {
+      return run_batch (options, digest, argv[optind]);
+    }
+
+    if (!options.merkle_build.empty ()) {
+      return run_merkle_build (options, digest, argv[optind]);
+    }
+
+    if (!options.merkle_tree.empty ()) {
+      return run_merkle_verification (
+	options, digest, argv[optind], argv[optind + 1], argv[optind + 2]);
+    }
+
+    return run_verification (
+      options, digest, argv[optind], argv[optind + 1], argv[optind + 2]);
+  }
   catch (const std::exception& e) {
     std::cerr << "Error: " << e.what () << '\n';
     return EXIT_FAILURE;
@@ -0,0 +1,208 @@
+#!/bin/bash -e
+
+#/ Usage: bench-c14n.sh [-r <runs>] [-s <sizes>] [-t <documents>]
+#/                      [-c <methods>] [-i <input modes>] <c14n-executable>
+#/
+#/ Benchmarks reading, parsing and canonicalisation of XML documents by
+#/ a program implemented in xmldsig-c14n.cpp and built as <c14n-executable>.
+#/ XMLDSig documents of various sizes and kinds are generated:
+#/
+#/    manifest  a Manifest with as many References as needed
+#/    nested    a Manifest with deeply nested elements in 32 namespaces
+#/              declared by Signature, each level declaring one more
+#/
+#/ then the Manifest of each document is canonicalised and digested <runs>
+#/ times for every canonicalisation method (1.0, 1.1 or exclusive, see
+#/ --c14n) and input mode:
+#/
+#/    file    the document is read through libxml2's I/O (--walk)
+#/    mmap    the document is mapped into memory (--walk --mmap)
+#/    stream  the document is canonicalised while reading it (--stream, C14N
+#/            1.0 only)
+#/
+#/ The Manifest is canonicalised by walking it (or streaming it) so the time
+#/ is mostly spent reading, parsing and canonicalising the document rather than
+#/ selecting its nodes.
+#/
+#/ Results are printed to the standard output as CSV, one line per run:
+#/
+#/    document,c14n,io,size_bytes,run,seconds,mib_per_s,peak_rss_kb
+#/
+#/ mib_per_s is in MiB (1048576 bytes) per second, including the process
+#/ start-up.
+#/ GNU time (/usr/bin/time) is required to measure the peak resident set size.
+#/ Each combination is run once before measuring so the document is in the
+#/ page cache, which also checks all the input modes give the same digest.
+#/
+#/ Options (space separated lists):
+#/    -r <runs>         number of measured runs (default: 3)
+#/    -s <sizes>        document sizes as accepted by numfmt --from=iec
+#/                      (default: 1M 16M 256M 1G)
+#/    -t <documents>    kinds of documents: manifest nested (default: both)
+#/    -c <methods>      canonicalisation methods: 1.0 1.1 exclusive
+#/                      (default: all of them)
+#/    -i <input modes>  input modes: file mmap stream (default: all of them)
+#/
+#/ Examples:
+#/    bench-c14n.sh /tmp/c14n-exe > results.csv
+#/    bench-c14n.sh -s "1M 4G" -i "file mmap" /tmp/c14n-exe
+#/    bench-c14n.sh -t nested -c "1.0 exclusive" -i file /tmp/c14n-exe
+
+usage() { grep '^#/' "$0" | cut -c 4-; }
+
+runs=3
+sizes="1M 16M 256M 1G"
+documents="manifest nested"
+methods="1.0 1.1 exclusive"
+io_modes="file mmap stream"
+
+while getopts "r:s:t:c:i:h" opt; do
+	case "$opt" in
+		r) runs="$OPTARG" ;;
+		s) sizes="$OPTARG" ;;
+		t) documents="$OPTARG" ;;
+		c) methods="$OPTARG" ;;
+		i) io_modes="$OPTARG" ;;
+		h) usage; exit 0 ;;
+		*) usage >&2; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+executable="$1"
+[ -z "$executable" ] && {
+	echo "No executable specified" >&2
+	echo
+	usage
+	exit 1
+}
+
+time_exe=/usr/bin/time
+[ -x "$time_exe" ] || {
+	echo "GNU time ($time_exe) is required" >&2
+	exit 1
+}
+
+# scratch directory
+tmpdir=$(mktemp -d)
+trap 'rm -rf "${tmpdir}"' EXIT
+
+manifest_xpath="/default:Signature/default:Object/default:Manifest"
+
+##
+# generate an XMLDSig document of the given kind of at least <size> bytes into
+# <out>
+#
+gen_xml() {
+	local document="$1"
+	local size="$2"
+	local out="$3"
+
+	awk -v document="$document" -v size="$size" '
+	function reference(i) {
+		return sprintf("<Reference URI=\"#file-%d\">" \
+		    "<DigestMethod Algorithm=\"%s\"/>" \
+		    "<DigestValue>%044d</DigestValue></Reference>", i, digest, i)
+	}
+
+	function nested(i,    line, d) {
+		line = ""
+		for (d = 0; d < 8; d++) {
+			line = line sprintf("<n%d:e xmlns:l%d=\"urn:example:level%d\" " \
+			    "n%d:a=\"%d\">", (i + d) % 32, d, d, (i + d + 1) % 32, i)
+		}
+		line = line reference(i)
+		for (d = 7; d >= 0; d--) {
+			line = line sprintf("</n%d:e>", (i + d) % 32)
+		}
+		return line
+	}
+
+	BEGIN {
+		ns = "http://www.w3.org/2000/09/xmldsig#"
+		digest = "http://www.w3.org/2001/04/xmlenc#sha256"
+		printf "<Signature xmlns=\"%s\"", ns
+		if (document == "nested") {
+			for (n = 0; n < 32; n++) {
+				printf " xmlns:n%d=\"urn:example:ns%d\"", n, n
+			}
+		}
+		printf ">\n  <Object>\n    <Manifest>\n"
+
+		bytes = 0
+		for (i = 0; bytes < size; i++) {
+			line = "      " \
+			    (document == "nested" ? nested(i) : reference(i)) "\n"
+			printf "%s", line
+			bytes += length(line)
+		}
+		printf "    </Manifest>\n  </Object>\n</Signature>\n"
+	}' > "$out"
+}
+
+##
+# options of <c14n-executable> for input <mode> and canonicalisation <method>
+# (nothing if they can't be combined)
+#
+c14n_options() {
+	local io="$1"
+	local method="$2"
+
+	case "$io" in
+		file) echo "--walk --c14n $method" ;;
+		mmap) echo "--walk --mmap --c14n $method" ;;
+		stream) [ "$method" = 1.0 ] && echo "--stream" ;;
+		*) echo "Unknown input mode: $io" >&2; exit 1 ;;
+	esac
+}
+
+echo "document,c14n,io,size_bytes,run,seconds,mib_per_s,peak_rss_kb"
+
+for document in $documents; do
+	case "$document" in
+		manifest|nested) ;;
+		*) echo "Unknown document: $document" >&2; exit 1 ;;
+	esac
+
+	for size in $sizes; do
+		xml="${tmpdir}/${document}-${size}.xml"
+		echo "Generating ${size} ${document} document" >&2
+		gen_xml "$document" "$(numfmt --from=iec "$size")" "$xml"
+		size_bytes=$(stat -c %s "$xml")
+
+		for method in $methods; do
+			expected=""
+			for io in $io_modes; do
+				options=$(c14n_options "$io" "$method" || true)
+				[ -z "$options" ] && continue
+				cmd=("$executable" $options --digest sha256 \
+				    "$manifest_xpath" "$xml")
+
+				# warm-up (and sanity check)
+				digest=$("${cmd[@]}")
+				[ -z "$expected" ] && expected="$digest"
+				[ "$digest" = "$expected" ] || {
+					echo "Digest differs (${method}, ${io} input): ${xml}" >&2
+					exit 1
+				}
+
+				for run in $(seq "$runs"); do
+					"$time_exe" -f "%e %M" -o "${tmpdir}/time" "${cmd[@]}" \
+					    >/dev/null
+					read -r seconds rss < "${tmpdir}/time"
+
+					awk -v document="$document" -v method="$method" \
+					    -v io="$io" -v size="$size_bytes" -v run="$run" \
+					    -v s="$seconds" -v rss="$rss" 'BEGIN {
+						printf "%s,%s,%s,%d,%d,%.2f,%.2f,%d\n",
+						    document, method, io, size, run, s,
+						    (s > 0 ? size / 1048576 / s : 0), rss
+					}'
+				done
+			done
+		done
+
+		# don't keep GBs around longer than needed
+		rm -f "$xml"
+	done
+done
@@ -0,0 +1,365 @@
+#!/bin/bash -e
+
+#/ Usage: fuzz-c14n.sh [-n <documents>] [-e <elements>] [-r <seed>]
+#/                     [-c <methods>] [-p <paths>] [-k <directory>]
+#/                     <c14n-executable>
+#/
+#/ Differential test of the canonicalisation paths of a program implemented in
+#/ xmldsig-c14n.cpp and built as <c14n-executable>.  Random XMLDSig documents
+#/ heavy on namespaces (declared, redeclared and undeclared at any level),
+#/ attributes (in namespaces, xml:*), white space, character references,
+#/ comments, processing instructions, CDATA sections and (in some of them)
+#/ a DOCTYPE with entities and default attributes are generated, then their
+#/ SignedInfo is canonicalised by every path:
+#/
+#/    xpath   the XPath node set (the reference)
+#/    walk    walking the subtree (--walk)
+#/    mmap    like walk with the document mapped into memory (--mmap)
+#/    stream  while reading the document (--stream, C14N 1.0 only)
+#/
+#/ for every canonicalisation method (1.0, 1.1 or exclusive, see --c14n).
+#/ The result of every path has to be byte-identical to the xpath one, or
+#/ all of them have to fail (entity references aren't substituted, so they
+#/ can't be canonicalised).
+#/
+#/ The throughput of every path is printed to the standard output as CSV:
+#/
+#/    c14n,path,documents,bytes,seconds,mib_per_s,mismatches
+#/
+#/ where bytes is the total size of the documents, all of them canonicalised
+#/ with --batch by a single thread, and mib_per_s is in MiB (1048576 bytes)
+#/ per second.  The exit status is non-zero if there are
+#/ any mismatches, which are also listed on the standard error output.
+#/
+#/ Options (space separated lists):
+#/    -n <documents>  number of documents (default: 200)
+#/    -e <elements>   maximum number of elements in a document (default: 200)
+#/    -r <seed>       seed of the first document, the others follow
+#/                    (default: random)
+#/    -c <methods>    canonicalisation methods: 1.0 1.1 exclusive
+#/                    (default: all of them)
+#/    -p <paths>      paths compared with xpath: walk mmap stream
+#/                    (default: all of them)
+#/    -k <directory>  keep the documents with mismatches (and the results of
+#/                    all the paths) in <directory>
+#/
+#/ Examples:
+#/    fuzz-c14n.sh /tmp/c14n-exe
+#/    fuzz-c14n.sh -n 10000 -e 50 -r 42 -k /tmp/failures /tmp/c14n-exe
+
+usage() { grep '^#/' "$0" | cut -c 4-; }
+
+documents=200
+elements=200
+seed=$RANDOM
+methods="1.0 1.1 exclusive"
+paths="walk mmap stream"
+keep=""
+
+while getopts "n:e:r:c:p:k:h" opt; do
+	case "$opt" in
+		n) documents="$OPTARG" ;;
+		e) elements="$OPTARG" ;;
+		r) seed="$OPTARG" ;;
+		c) methods="$OPTARG" ;;
+		p) paths="$OPTARG" ;;
+		k) keep="$OPTARG" ;;
+		h) usage; exit 0 ;;
+		*) usage >&2; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+executable="$1"
+[ -z "$executable" ] && {
+	echo "No executable specified" >&2
+	echo
+	usage
+	exit 1
+}
+
+# scratch directory
+tmpdir=$(mktemp -d)
+trap 'rm -rf "${tmpdir}"' EXIT
+
+si_xpath="/default:Signature/default:SignedInfo"
+
+##
+# generate a random document with <seed> and at most <elements> elements
+#
+gen_xml() {
+	local seed="$1"
+	local elements="$2"
+
+	awk -v seed="$seed" -v elements="$elements" '
+	function rnd(n) {
+		return int(rand() * n)
+	}
+
+	# split <s> on | into <a> indexed from 0
+	function split0(s, a,    n, i) {
+		n = split(s, a, "|")
+		for (i = 1; i <= n; i++) {
+			a[i - 1] = a[i]
+		}
+		delete a[n]
+		return n
+	}
+
+	# text (or an attribute value, which can'\''t have a literal ")
+	function text(attribute,    s, i, n) {
+		s = ""
+		n = rnd(6)
+		for (i = 0; i < n; i++) {
+			s = s pieces[rnd(npieces - attribute)]
+		}
+		return s
+	}
+
+	function whitespace(    s, i, n) {
+		s = ""
+		n = 1 + rnd(4)
+		for (i = 0; i < n; i++) {
+			s = s spaces[rnd(4)]
+		}
+		return s
+	}
+
+	# the start tag attributes and namespace declarations of an element at
+	# <depth> (its scope is set up from its parent'\''s one)
+	function attributes(depth, dsig,    s, i, k, n, p, name, key, seen) {
+		s = ""
+		for (p = 0; p < NP; p++) {
+			scope[depth, p] = scope[depth - 1, p]
+		}
+
+		n = rnd(4)
+		for (k = 0; k < n; k++) {
+			p = rnd(NP)
+			# the default namespace of dsig elements stays
+			if ((p == 0 && dsig) || (depth, p) in declared) {
+				continue
+			}
+			declared[depth, p] = 1
+			uri = uris[rnd(NU)]
+			# only the default namespace can be undeclared
+			if (p == 0 && rnd(4) == 0) {
+				uri = ""
+			}
+			scope[depth, p] = uri
+			s = s sprintf(" %s=\"%s\"", p ? "xmlns:p" p : "xmlns", uri)
+		}
+
+		n = rnd(5)
+		for (k = 0; k < n; k++) {
+			name = "a" rnd(4)
+			p = rnd(NP)
+			if (p && scope[depth, p] != "") {
+				key = scope[depth, p] "|" name
+				name = "p" p ":" name
+			}
+			else {
+				key = "|" name
+			}
+			if (rnd(8) == 0) {
+				name = rnd(2) ? "xml:lang" : "xml:space"
+				key = name
+			}
+			if (key in seen) {
+				continue
+			}
+			seen[key] = 1
+			s = s sprintf(" %s=\"%s\"", name,
+			    name == "xml:space" ? (rnd(2) ? "preserve" : "default") \
+			    : text(1) (dtd && rnd(4) == 0 ? "&e" rnd(2) ";" : ""))
+		}
+
+		return s
+	}
+
+	# the name of an element at <depth> (a prefix in scope or none)
+	function element_name(depth,    p) {
+		p = 1 + rnd(NP - 1)
+		if (rnd(2) && scope[depth, p] != "") {
+			return "p" p ":e" rnd(4)
+		}
+		return "e" rnd(4)
+	}
+
+	function element(depth, name, dsig,    s, tag, n, k) {
+		--left
+		tag = name
+		s = "<" tag attributes(depth, dsig)
+		delete_declared(depth)
+		if (tag == "") {
+			tag = element_name(depth)
+			s = "<" tag substr(s, 2)
+		}
+		s = s ">"
+
+		n = rnd(5)
+		for (k = 0; k < n; k++) {
+			s = s content(depth + 1)
+		}
+
+		return s "</" tag ">"
+	}
+
+	function delete_declared(depth,    p) {
+		for (p = 0; p < NP; p++) {
+			delete declared[depth, p]
+		}
+	}
+
+	function content(depth,    r) {
+		if (entity_refs && in_signed_info && rnd(50) == 0) {
+			return "&e" rnd(2) ";"
+		}
+		r = rnd(10)
+		if (r < 4 && left > 0 && depth < 12) {
+			return element(depth, "", 0)
+		}
+		if (r < 6) {
+			return text(0)
+		}
+		if (r < 8) {
+			return whitespace()
+		}
+		if (r == 8) {
+			return rnd(2) ? "<!-- comment " text(1) " -->" : "<?pi data?>"
+		}
+		return "<![CDATA[" whitespace() " cdata <&> " whitespace() "]]>"
+	}
+
+	BEGIN {
+		srand(seed)
+		left = elements
+
+		npieces = split0("abc|&amp;|&gt;|&quot;|&#9;|&#10;|&#13;|'\''| |" \
+		    "\303\251|&lt;|\"", pieces)
+		split0(" |\t|\n|\r", spaces)
+
+		# prefix 0 is the default namespace, the others are p1, p2...
+		NP = 5
+		NU = split0("urn:u0|urn:u1|urn:u2|http://example.com/u3", uris)
+
+		dsig_ns = "http://www.w3.org/2000/09/xmldsig#"
+		scope[0, 0] = dsig_ns
+		printf "%s", "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		if (rnd(2)) {
+			printf "%s", "<!-- before -->\n"
+		}
+
+		# entities (referenced in attribute values and, in some
+		# documents, content of SignedInfo: libxml2 fails to
+		# canonicalise a DOM with a reference anywhere, while streaming
+		# stops at the end of SignedInfo) and attribute defaults (never
+		# used)
+		dtd = rnd(4) == 0
+		entity_refs = dtd && rnd(2)
+		if (dtd) {
+			printf "%s", "<!DOCTYPE Signature [\n" \
+			    "<!ENTITY e0 \"entity\">\n" \
+			    "<!ENTITY e1 \"&#233; &#38;#38; more\">\n" \
+			    "<!ATTLIST SignedInfo a0 CDATA \"default\">\n" \
+			    "<!ATTLIST e1 a1 CDATA \"default\">\n" \
+			    "]>\n"
+		}
+
+		# Signature (with some noise before SignedInfo)
+		printf "<Signature xmlns=\"%s\"%s>%s", dsig_ns, attributes(1, 1),
+		    whitespace()
+		delete_declared(1)
+		if (rnd(2)) {
+			printf "%s", element(2, "", 0) whitespace()
+		}
+		in_signed_info = 1
+		printf "%s", element(2, "SignedInfo", 1)
+		in_signed_info = 0
+		printf "%s", whitespace()
+		printf "%s", content(2) "</Signature>\n"
+	}'
+}
+
+##
+# options of <c14n-executable> for <path> and canonicalisation <method>
+# (nothing if they can't be combined)
+#
+c14n_options() {
+	local path="$1"
+	local method="$2"
+
+	case "$path" in
+		xpath) echo "--c14n $method" ;;
+		walk) echo "--walk --c14n $method" ;;
+		mmap) echo "--walk --mmap --c14n $method" ;;
+		stream) [ "$method" = 1.0 ] && echo "--stream" ;;
+		*) echo "Unknown path: $path" >&2; exit 1 ;;
+	esac
+}
+
+##
+# seconds are too coarse for small batches
+#
+now_ns() { date +%s%N; }
+
+echo "Generating ${documents} documents (seed ${seed})" >&2
+mkdir "${tmpdir}/docs"
+list="${tmpdir}/list"
+for i in $(seq 0 $((documents - 1))); do
+	doc="${tmpdir}/docs/$((seed + i)).xml"
+	gen_xml $((seed + i)) "$elements" > "$doc"
+	echo "$doc" >> "$list"
+done
+bytes=$(cat "${tmpdir}"/docs/*.xml | wc -c)
+
+echo "c14n,path,documents,bytes,seconds,mib_per_s,mismatches"
+
+failures=0
+for method in $methods; do
+	for path in xpath $paths; do
+		options=$(c14n_options "$path" "$method" || true)
+		[ -z "$options" ] && continue
+
+		# documents which fail are reported as "ERROR: <document>: ..."
+		errors="${tmpdir}/errors"
+		start=$(now_ns)
+		"$executable" $options --workers 1 --batch "$list" "$si_xpath" \
+		    2> "$errors" || grep -q "^ERROR: ${tmpdir}/docs/" "$errors" || {
+			cat "$errors" >&2
+			echo "Canonicalisation failed (${method}, ${path})" >&2
+			exit 1
+		}
+		end=$(now_ns)
+
+		mismatches=0
+		while read -r doc; do
+			if grep -qF "ERROR: ${doc}: " "$errors"; then
+				echo "failed" > "${doc}.${method}.${path}"
+				rm -f "${doc}.c14n"
+			else
+				mv "${doc}.c14n" "${doc}.${method}.${path}"
+			fi
+			[ "$path" = xpath ] && continue
+			cmp -s "${doc}.${method}.xpath" "${doc}.${method}.${path}" && continue
+
+			mismatches=$((mismatches + 1))
+			echo "Mismatch (${method}, ${path}): $(basename "$doc")" >&2
+			if [ -n "$keep" ]; then
+				mkdir -p "$keep"
+				cp "$doc" "${doc}.${method}".* "$keep"
+			fi
+		done < "$list"
+		failures=$((failures + mismatches))
+
+		awk -v method="$method" -v path="$path" -v documents="$documents" \
+		    -v bytes="$bytes" -v ns=$((end - start)) \
+		    -v mismatches="$mismatches" 'BEGIN {
+			s = ns / 1e9
+			printf "%s,%s,%d,%d,%.3f,%.2f,%d\n", method, path, documents,
+			    bytes, s, bytes / 1048576 / s, mismatches
+		}'
+	done
+done
+
+[ "$failures" -eq 0 ]
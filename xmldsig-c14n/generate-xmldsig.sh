@@ -88,13 +88,8 @@ openssl req -x509 -newkey rsa:2048 \
 manifest_xpath="/default:Signature/default:Object/default:Manifest"
 si_xpath="/default:Signature/default:SignedInfo"
 
-canonicalised_manifest=$(
-  $xmldsig_c14n_exe $manifest_xpath <<< $template
-)
 manifest_digest=$(
-  echo -n $canonicalised_manifest | \
-  openssl dgst -sha256 -binary | \
-  openssl base64
+  $xmldsig_c14n_exe --digest sha256 $manifest_xpath <<< $template
 )
 
 # SignatureInfo
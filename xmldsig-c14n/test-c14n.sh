@@ -50,13 +50,6 @@ function get_cert() {
     "$(get_xml_node_text X509Certificate $which $from)"
 }
 
-function get_pub_key() {
-  local let which=$1
-  local from=$2
-
-  get_cert $which $from | openssl x509 -pubkey -noout
-}
-
 function get_signature() {
   local let which=$1
   local from=$2
@@ -69,7 +62,64 @@ function get_signature() {
 # other part of the XML.
 si_xpath="/default:Signature/default:SignedInfo"
 
-$xmldsig_c14n_exe $si_xpath $sample_xml |
-openssl dgst -sha1 -binary \
-  -verify <(get_pub_key 1 $sample_xml) \
-  -signature <(get_signature 1 $sample_xml)
+# Streaming canonicalisation has to give exactly the same result.
+cmp -s <($xmldsig_c14n_exe $si_xpath $sample_xml) \
+  <($xmldsig_c14n_exe --stream $si_xpath $sample_xml) || {
+  echo "Streamed C14N differs" >&2
+  exit 1
+}
+
+# Unless SignedInfo is canonicalised some other way, which can't be streamed.
+if sed 's|REC-xml-c14n-20010315"|REC-xml-c14n-20010315#WithComments"|' \
+  $sample_xml | $xmldsig_c14n_exe --stream $si_xpath >/dev/null; then
+  echo "Streamed C14N with another CanonicalizationMethod" >&2
+  exit 1
+fi
+
+# And so does walking the subtree.
+cmp -s <($xmldsig_c14n_exe $si_xpath $sample_xml) \
+  <($xmldsig_c14n_exe --walk $si_xpath $sample_xml) || {
+  echo "Walked C14N differs" >&2
+  exit 1
+}
+
+# And so does canonicalising a batch of files.
+batch_dir=$(mktemp -d)
+trap 'rm -rf "$batch_dir"' EXIT
+cp $sample_xml $batch_dir/sample.xml
+echo $batch_dir/sample.xml > $batch_dir/list
+$xmldsig_c14n_exe --batch $batch_dir/list $si_xpath
+cmp -s <($xmldsig_c14n_exe $si_xpath $sample_xml) \
+  $batch_dir/sample.xml.c14n || {
+  echo "Batch C14N differs" >&2
+  exit 1
+}
+
+# The number of workers must be a plain number from 1 to 1024.
+for workers in 0 -1 1025 2x ""; do
+  if $xmldsig_c14n_exe --workers "$workers" --batch $batch_dir/list \
+    $si_xpath 2>/dev/null; then
+    echo "Invalid number of workers accepted: \"$workers\"" >&2
+    exit 1
+  fi
+done
+
+# All the ways of canonicalising give the same result on random documents.
+$(dirname "$0")/fuzz-c14n.sh -n 50 -r 1 $xmldsig_c14n_exe >/dev/null || exit 1
+
+# The whole signature (including the digest of the Manifest) is verified in one
+# go as well.
+$xmldsig_c14n_exe --xmldsig /default:Signature $sample_xml || exit 1
+
+# And any change of the signed Manifest is noticed.
+if sed 's|<Manifest Id="PackageContents">|&<Tampered/>|' $sample_xml | \
+  $xmldsig_c14n_exe --xmldsig /default:Signature; then
+  echo "Tampered Manifest verified" >&2
+  exit 1
+fi
+
+# The canonicalised bit is digested and verified on the fly.
+$xmldsig_c14n_exe --digest sha1 \
+  --verify <(get_cert 1 $sample_xml) \
+  --signature <(get_signature 1 $sample_xml) \
+  $si_xpath $sample_xml
@@ -4,38 +4,1745 @@
 #include <libxml/c14n.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
+#include <libxml/xmlIO.h>
+#include <libxml/xmlreader.h>
 #include <libxml/xpath.h>
 #include <libxml/xpathInternals.h>
 
+#include <openssl/bio.h>
+#include <openssl/bn.h>
+#include <openssl/ecdsa.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
 #include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <map>
 #include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * A common utility for creating RAII objects.
+ */
+template<class T, class D = std::default_delete<T>>
+constexpr std::unique_ptr<T, D>
+make_scoped (T *const ptr, D deleter = D ())
+{
+  return std::unique_ptr<T, D> (ptr, deleter);
+}
+
+/**
+ * Any libxml2 global initialisation/clean-up happens here in a RAII fashion.
+ */
+struct XmlContext {
+  XmlContext ()
+  {
+    xmlInitParser ();
+    LIBXML_TEST_VERSION
+  }
+
+  ~XmlContext ()
+  {
+    xmlCleanupParser ();
+  }
+};
+
+// It's handy to have a well known alias to an XML namespace which we can use
+// later on in XPath expressions.
+const xmlChar DEFAULT_NS_PREFIX[] = "default";
+const xmlChar XMLDSIG_NAMESPACE[] = "http://www.w3.org/2000/09/xmldsig#";
+
+/**
+ * libxml2 strings are unsigned, a null one is just empty.
+ */
+std::string
+to_string (const xmlChar *const str)
+{
+  return str ? reinterpret_cast<const char*> (str) : "";
+}
+
+/**
+ * A step of a simple absolute path: /prefix:name/name/...
+ */
+struct PathStep {
+  std::string ns;
+  std::string name;
+};
+
+/**
+ * Split simple absolute path <expr> into <steps>.  Only the `default' prefix
+ * is known; names without a prefix are in no namespace (as in XPath).  Return
+ * false if <expr> is anything more complicated.
+ */
+bool
+parse_simple_path (const std::string& expr, std::vector<PathStep>& steps)
+{
+  if (expr.size () < 2 || expr[0] != '/') {
+    return false;
+  }
+
+  std::size_t begin = 1;
+  while (begin <= expr.size ()) {
+    std::size_t end = expr.find ('/', begin);
+    if (end == std::string::npos) {
+      end = expr.size ();
+    }
+
+    const std::string step = expr.substr (begin, end - begin);
+    if (step.empty () ||
+	step.find_first_of ("[]()*@.|= ") != std::string::npos) {
+      return false;
+    }
+
+    PathStep path_step;
+    const std::size_t colon = step.find (':');
+    if (colon == std::string::npos) {
+      path_step.name = step;
+    }
+    else if (step.compare (0, colon, to_string (DEFAULT_NS_PREFIX)) == 0) {
+      path_step.ns = to_string (XMLDSIG_NAMESPACE);
+      path_step.name = step.substr (colon + 1);
+    }
+    else {
+      return false;
+    }
+
+    steps.push_back (path_step);
+    begin = end + 1;
+  }
+
+  return true;
+}
+
+/**
+ * Write <length> bytes of <data> to <out>, escaped as C14N requires for text
+ * nodes (<is_attr> false) or attribute values (<is_attr> true).
+ */
+void
+write_escaped (xmlOutputBufferPtr out, const char *data, std::size_t length,
+	       const bool is_attr)
+{
+  while (length > 0) {
+    // copy runs of plain characters at once
+    std::size_t run = 0;
+    char const* entity = nullptr;
+    for (; run < length; ++run) {
+      switch (data[run]) {
+      case '&': entity = "&amp;"; break;
+      case '<': entity = "&lt;"; break;
+      case '>': entity = is_attr ? nullptr : "&gt;"; break;
+      case '"': entity = is_attr ? "&quot;" : nullptr; break;
+      case '\t': entity = is_attr ? "&#x9;" : nullptr; break;
+      case '\n': entity = is_attr ? "&#xA;" : nullptr; break;
+      case '\r': entity = "&#xD;"; break;
+      }
+
+      if (entity) {
+	break;
+      }
+    }
+
+    xmlOutputBufferWrite (out, run, data);
+    if (!entity) {
+      return;
+    }
+
+    xmlOutputBufferWriteString (out, entity);
+    data += run + 1;
+    length -= run + 1;
+  }
+}
+
+void
+write_escaped (xmlOutputBufferPtr out, const std::string& str,
+	       const bool is_attr)
+{
+  write_escaped (out, str.data (), str.size (), is_attr);
+}
+
+// Canonicalisation algorithms (URIs) of XMLDSig.
+const struct {
+  const char *algorithm;
+  xmlC14NMode mode;
+  bool with_comments;
+} C14N_ALGORITHMS[] = {
+  {"http://www.w3.org/TR/2001/REC-xml-c14n-20010315", XML_C14N_1_0, false},
+  {"http://www.w3.org/TR/2001/REC-xml-c14n-20010315#WithComments",
+   XML_C14N_1_0, true},
+  {"http://www.w3.org/2006/12/xml-c14n11", XML_C14N_1_1, false},
+  {"http://www.w3.org/2006/12/xml-c14n11#WithComments", XML_C14N_1_1, true},
+  {"http://www.w3.org/2001/10/xml-exc-c14n#", XML_C14N_EXCLUSIVE_1_0, false},
+  {"http://www.w3.org/2001/10/xml-exc-c14n#WithComments",
+   XML_C14N_EXCLUSIVE_1_0, true},
+};
+
+/**
+ * Canonicalises (C14N 1.0 without comments) the first element matching
+ * a simple path while the document is being read with xmlTextReader, so
+ * the memory needed doesn't depend on the size of the document.  The output
+ * is the same as the one from the node set used with the DOM (see main()):
+ * the whole subtree apart from white space only text nodes, comments and
+ * processing instructions.
+ *
+ * Only the namespace declarations and xml:* attributes of the ancestors are
+ * remembered, as the apex of the subtree inherits them.
+ *
+ * Like the DOM, it fails on entity references (entities aren't substituted).
+ *
+ * The DOM canonicalises a SignedInfo with its CanonicalizationMethod, so
+ * a SignedInfo with any other method fails (the output so far is useless).
+ */
+class StreamCanonicaliser {
+public:
+  StreamCanonicaliser (const std::vector<PathStep>& path,
+		       xmlOutputBufferPtr out)
+    : m_path (path), m_out (out), m_apex_depth (-1)
+  {
+  }
+
+  /**
+   * Read the document from <reader> until the element is canonicalised.
+   * Return false if it's not found.
+   */
+  bool
+  run (xmlTextReaderPtr reader);
+
+private:
+  struct Attr {
+    std::string ns;
+    std::string name;
+    std::string qname;
+    std::string value;
+
+    bool
+    operator< (const Attr& other) const
+    {
+      return ns != other.ns ? ns < other.ns : name < other.name;
+    }
+  };
+
+  // prefix and namespace URI
+  typedef std::pair<std::string, std::string> NsDecl;
+
+  // state of an open element
+  struct Element {
+    std::vector<NsDecl> ns_decls;
+    std::vector<Attr> xml_attrs;
+    bool matched;
+  };
+
+  bool
+  start_element (xmlTextReaderPtr reader);
+
+  void
+  check_c14n_method (xmlTextReaderPtr reader,
+		     const std::vector<Attr>& attrs) const;
+
+  void
+  write_start_tag (const std::string& qname, const Element& element,
+		   std::vector<Attr>& attrs);
+
+  void
+  write_end_tag (const xmlChar *qname);
+
+  const std::string *
+  lookup_ns (std::size_t depth, const std::string& prefix) const;
+
+  const std::vector<PathStep>& m_path;
+  xmlOutputBufferPtr m_out;
+  // all open elements by depth
+  std::vector<Element> m_elements;
+  int m_apex_depth;
+};
+
+bool
+StreamCanonicaliser::run (xmlTextReaderPtr reader)
+{
+  int ret;
+  while ((ret = xmlTextReaderRead (reader)) == 1) {
+    const int type = xmlTextReaderNodeType (reader);
+    const int depth = xmlTextReaderDepth (reader);
+    switch (type) {
+    case XML_READER_TYPE_ELEMENT:
+      if (start_element (reader)) {
+	return true;
+      }
+
+      break;
+
+    case XML_READER_TYPE_END_ELEMENT:
+      if (m_apex_depth >= 0) {
+	write_end_tag (xmlTextReaderConstName (reader));
+	if (depth == m_apex_depth) {
+	  return true;
+	}
+      }
+
+      break;
+
+    case XML_READER_TYPE_TEXT:
+    case XML_READER_TYPE_CDATA:
+    case XML_READER_TYPE_WHITESPACE:
+    case XML_READER_TYPE_SIGNIFICANT_WHITESPACE:
+      if (m_apex_depth >= 0) {
+	const char *const value =
+	  reinterpret_cast<const char*> (xmlTextReaderConstValue (reader));
+	const std::size_t length = value ? std::strlen (value) : 0;
+
+	// white space only text nodes aren't selected
+	if (value && std::strspn (value, " \t\r\n") != length) {
+	  write_escaped (m_out, value, length, false);
+	}
+      }
+
+      break;
+
+    case XML_READER_TYPE_ENTITY_REFERENCE:
+      // (entities aren't substituted, the DOM can't canonicalise them either)
+      if (m_apex_depth >= 0) {
+	throw std::runtime_error (
+	  "Entity references can't be canonicalised: &"
+	  + to_string (xmlTextReaderConstName (reader)) + ";");
+      }
+
+      break;
+    }
+  }
+
+  if (ret < 0) {
+    throw std::runtime_error ("Unable to parse the document");
+  }
+
+  return false;
+}
+
+/**
+ * Process the start of an element.  Return true if it's the apex of
+ * the subtree and the subtree (an empty element) has been done with.
+ */
+bool
+StreamCanonicaliser::start_element (xmlTextReaderPtr reader)
+{
+  const std::size_t depth = xmlTextReaderDepth (reader);
+  const bool empty = xmlTextReaderIsEmptyElement (reader) == 1;
+  const std::string qname = to_string (xmlTextReaderConstName (reader));
+  const bool inside = m_apex_depth >= 0;
+
+  m_elements.resize (depth + 1);
+  Element& element = m_elements[depth];
+  element.ns_decls.clear ();
+  element.xml_attrs.clear ();
+  element.matched = false;
+
+  if (!inside && depth < m_path.size () &&
+      (depth == 0 || m_elements[depth - 1].matched)) {
+    const PathStep& step = m_path[depth];
+    element.matched =
+      step.name == to_string (xmlTextReaderConstLocalName (reader)) &&
+      step.ns == to_string (xmlTextReaderConstNamespaceUri (reader));
+  }
+
+  const bool apex = element.matched && depth + 1 == m_path.size ();
+
+  // Ancestors only need their namespaces and xml:* attributes.
+  std::vector<Attr> attrs;
+  while (xmlTextReaderMoveToNextAttribute (reader) == 1) {
+    const std::string value = to_string (xmlTextReaderConstValue (reader));
+    if (xmlTextReaderIsNamespaceDecl (reader) == 1) {
+      const xmlChar *const prefix = xmlTextReaderConstPrefix (reader);
+      element.ns_decls.push_back (
+	NsDecl (prefix ? to_string (xmlTextReaderConstLocalName (reader)) : "",
+		value));
+      continue;
+    }
+
+    // (the DOM doesn't default them either, nor should the reader)
+    if (xmlTextReaderIsDefault (reader) == 1) {
+      throw std::runtime_error ("Attributes defaulted from the DTD can't be "
+				"canonicalised");
+    }
+
+    Attr attr;
+    attr.ns = to_string (xmlTextReaderConstNamespaceUri (reader));
+    attr.name = to_string (xmlTextReaderConstLocalName (reader));
+    attr.qname = to_string (xmlTextReaderConstName (reader));
+    attr.value = value;
+    if (!inside && !apex) {
+      if (attr.ns == reinterpret_cast<const char*> (XML_XML_NAMESPACE)) {
+	element.xml_attrs.push_back (attr);
+      }
+    }
+    else {
+      attrs.push_back (attr);
+    }
+  }
+
+  xmlTextReaderMoveToElement (reader);
+
+  if (!inside && !apex) {
+    return false;
+  }
+
+  if (inside && static_cast<int> (depth) == m_apex_depth + 1) {
+    check_c14n_method (reader, attrs);
+  }
+
+  if (apex) {
+    m_apex_depth = depth;
+  }
+
+  write_start_tag (qname, element, attrs);
+  if (!empty) {
+    return false;
+  }
+
+  write_end_tag (xmlTextReaderConstName (reader));
+  return apex;
+}
+
+/**
+ * Make sure the child element at <reader> (with <attrs>) of the apex isn't
+ * the CanonicalizationMethod of a SignedInfo other than C14N 1.0 without
+ * comments.
+ */
+void
+StreamCanonicaliser::check_c14n_method (xmlTextReaderPtr reader,
+					const std::vector<Attr>& attrs) const
+{
+  const PathStep& apex = m_path.back ();
+  if (apex.name != "SignedInfo" || apex.ns != to_string (XMLDSIG_NAMESPACE) ||
+      to_string (xmlTextReaderConstLocalName (reader))
+      != "CanonicalizationMethod" ||
+      to_string (xmlTextReaderConstNamespaceUri (reader))
+      != to_string (XMLDSIG_NAMESPACE)) {
+    return;
+  }
+
+  std::string algorithm;
+  for (const Attr& attr : attrs) {
+    if (attr.ns.empty () && attr.name == "Algorithm") {
+      algorithm = attr.value;
+    }
+  }
+
+  if (algorithm != C14N_ALGORITHMS[0].algorithm) {
+    throw std::runtime_error (
+      "Only C14N 1.0 without comments can be streamed, SignedInfo uses: "
+      + algorithm);
+  }
+}
+
+/**
+ * Find namespace URI of <prefix> in scope of the element at <depth>.
+ */
+const std::string *
+StreamCanonicaliser::lookup_ns (const std::size_t depth,
+				const std::string& prefix) const
+{
+  for (std::size_t i = depth + 1; i-- > 0; ) {
+    for (const NsDecl& decl : m_elements[i].ns_decls) {
+      if (decl.first == prefix) {
+	return &decl.second;
+      }
+    }
+  }
+
+  return nullptr;
+}
+
+void
+StreamCanonicaliser::write_start_tag (const std::string& qname,
+				      const Element& element,
+				      std::vector<Attr>& attrs)
+{
+  const std::size_t depth = &element - m_elements.data ();
+  const bool apex = static_cast<int> (depth) == m_apex_depth;
+  std::vector<NsDecl> ns_decls;
+
+  if (apex) {
+    // all the namespaces in scope (the nearest declaration of a prefix wins)
+    for (std::size_t i = depth + 1; i-- > 0; ) {
+      for (const NsDecl& decl : m_elements[i].ns_decls) {
+	if (lookup_ns (depth, decl.first) == &decl.second &&
+	    !decl.second.empty ()) {
+	  ns_decls.push_back (decl);
+	}
+      }
+    }
+
+    // and xml:* attributes of ancestors (the nearest one wins)
+    for (std::size_t i = depth; i-- > 0; ) {
+      for (const Attr& attr : m_elements[i].xml_attrs) {
+	if (std::find_if (attrs.begin (), attrs.end (),
+			  [&attr] (const Attr& a) {
+			    return a.ns == attr.ns && a.name == attr.name;
+			  }) == attrs.end ()) {
+	  attrs.push_back (attr);
+	}
+      }
+    }
+  }
+  else {
+    // only the namespaces changed since the parent
+    for (const NsDecl& decl : element.ns_decls) {
+      const std::string *const uri = lookup_ns (depth - 1, decl.first);
+      if (uri ? *uri != decl.second : !decl.second.empty ()) {
+	ns_decls.push_back (decl);
+      }
+    }
+  }
+
+  std::sort (ns_decls.begin (), ns_decls.end ());
+  std::sort (attrs.begin (), attrs.end ());
+
+  xmlOutputBufferWriteString (m_out, "<");
+  xmlOutputBufferWriteString (m_out, qname.c_str ());
+  for (const NsDecl& decl : ns_decls) {
+    xmlOutputBufferWriteString (m_out,
+				decl.first.empty () ? " xmlns" : " xmlns:");
+    xmlOutputBufferWriteString (m_out, decl.first.c_str ());
+    xmlOutputBufferWriteString (m_out, "=\"");
+    write_escaped (m_out, decl.second, true);
+    xmlOutputBufferWriteString (m_out, "\"");
+  }
+
+  for (const Attr& attr : attrs) {
+    xmlOutputBufferWriteString (m_out, " ");
+    xmlOutputBufferWriteString (m_out, attr.qname.c_str ());
+    xmlOutputBufferWriteString (m_out, "=\"");
+    write_escaped (m_out, attr.value, true);
+    xmlOutputBufferWriteString (m_out, "\"");
+  }
+
+  xmlOutputBufferWriteString (m_out, ">");
+}
+
+void
+StreamCanonicaliser::write_end_tag (const xmlChar *const qname)
+{
+  xmlOutputBufferWriteString (m_out, "</");
+  xmlOutputBufferWriteString (m_out, reinterpret_cast<const char*> (qname));
+  xmlOutputBufferWriteString (m_out, ">");
+}
+
+/**
+ * Normalises line ends (CR LF or CR alone) to LF in the input of libxml2's
+ * push parser, which xmlTextReader and DomCanonicaliser::parse_mapped() use,
+ * as it leaves them in CDATA sections as they are (xmlCtxtReadFile() does
+ * normalise them).  The input is fed through run() in consecutive pieces.
+ * Documents in UTF-16 (or UCS-4) are left alone.
+ */
+class LineEndNormaliser {
+public:
+  LineEndNormaliser ()
+    : m_state (START)
+  {
+  }
+
+  /**
+   * Whether the next <length> bytes of input <data> need run().
+   */
+  bool
+  needed (const char *data, std::size_t length)
+  {
+    if (m_state == START) {
+      // a BOM or "<" with a NUL byte next to it
+      m_state = length >= 2 && (data[0] == '\0' || data[1] == '\0' ||
+				(data[0] == '\xfe' && data[1] == '\xff') ||
+				(data[0] == '\xff' && data[1] == '\xfe'))
+	? OFF : TEXT;
+    }
+
+    return m_state == CR ||
+      (m_state == TEXT && std::memchr (data, '\r', length));
+  }
+
+  /**
+   * Normalise the next <length> bytes of input <data> in place and return
+   * their new length.
+   */
+  std::size_t
+  run (char *data, std::size_t length);
+
+private:
+  // CR means the previous piece ended with CR
+  enum State { START, TEXT, CR, OFF };
+
+  State m_state;
+};
+
+std::size_t
+LineEndNormaliser::run (char *const data, const std::size_t length)
+{
+  if (!needed (data, length)) {
+    return length;
+  }
+
+  std::size_t out = 0;
+  for (std::size_t in = 0; in < length; ++in) {
+    const char c = data[in];
+    // (LF after CR is already there)
+    if (c != '\n' || m_state != CR) {
+      data[out++] = c == '\r' ? '\n' : c;
+    }
+
+    m_state = c == '\r' ? CR : TEXT;
+  }
+
+  return out;
+}
+
+/**
+ * Read from file descriptor <context> for xmlReaderForIO(), normalising line
+ * ends.
+ */
+class NormalisedInput {
+public:
+  explicit NormalisedInput (int fd)
+    : m_fd (fd)
+  {
+  }
+
+  static int
+  read (void *context, char *buffer, int length);
+
+  static int
+  close (void *context);
+
+private:
+  const int m_fd;
+  LineEndNormaliser m_normaliser;
+};
+
+int
+NormalisedInput::read (void *const context, char *const buffer,
+		       const int length)
+{
+  NormalisedInput *const input = static_cast<NormalisedInput*> (context);
+  for (;;) {
+    const ssize_t count = ::read (input->m_fd, buffer, length);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (count <= 0) {
+      return count < 0 ? -1 : 0;
+    }
+
+    // (a lone LF after CR normalises to nothing, which isn't the end)
+    const std::size_t normalised = input->m_normaliser.run (buffer, count);
+    if (normalised > 0) {
+      return normalised;
+    }
+  }
+}
+
+int
+NormalisedInput::close (void *const context)
+{
+  NormalisedInput *const input = static_cast<NormalisedInput*> (context);
+  const int ret = ::close (input->m_fd);
+  delete input;
+  return ret;
+}
+
+/**
+ * Canonicalise the element at simple path <expr> in <file_in> into <out>
+ * with StreamCanonicaliser.
+ */
+void
+stream_c14n (const std::string& expr, char const *const file_in,
+	     xmlOutputBufferPtr out)
+{
+  std::vector<PathStep> path;
+  if (!parse_simple_path (expr, path)) {
+    throw std::runtime_error (
+      "Only simple absolute paths (/default:Name/...) can be streamed: "
+      + expr);
+  }
+
+  const int fd = ::open (file_in, O_RDONLY);
+  // (the reader closes the input, even if it can't be created)
+  const auto reader =
+    make_scoped (fd < 0 ? nullptr
+		 : xmlReaderForIO (NormalisedInput::read,
+				   NormalisedInput::close,
+				   new NormalisedInput (fd), file_in, nullptr, 0),
+		 xmlFreeTextReader);
+  if (!reader) {
+    throw std::runtime_error ("Unable to open file '"
+			      + std::string (file_in) + "'");
+  }
+
+  StreamCanonicaliser canonicaliser (path, out);
+  if (!canonicaliser.run (reader.get ())) {
+    throw std::runtime_error ("Unable to get object: " + expr);
+  }
+}
+
+/**
+ * Whether <node> is element <name> in the XMLDSig namespace.
+ */
+bool
+is_xmldsig_element (xmlNodePtr node, char const *const name)
+{
+  return node->type == XML_ELEMENT_NODE && node->ns &&
+    xmlStrEqual (node->ns->href, XMLDSIG_NAMESPACE) &&
+    xmlStrEqual (node->name, reinterpret_cast<const xmlChar*> (name));
+}
+
+/**
+ * Find the first child element <name> (in the XMLDSig namespace)
+ * of <parent>, null if there's none.
+ */
+xmlNodePtr
+find_child (xmlNodePtr parent, char const *const name)
+{
+  for (xmlNodePtr child = xmlFirstElementChild (parent); child;
+       child = xmlNextElementSibling (child)) {
+    if (is_xmldsig_element (child, name)) {
+      return child;
+    }
+  }
+
+  return nullptr;
+}
+
+/**
+ * Like find_child(), but the child is required.
+ */
+xmlNodePtr
+get_child (xmlNodePtr parent, char const *const name)
+{
+  const xmlNodePtr child = find_child (parent, name);
+  if (child) {
+    return child;
+  }
+
+  throw std::runtime_error ("Missing " + std::string (name) + " in "
+			    + to_string (parent->name));
+}
+
+/**
+ * The text content of <node>.
+ */
+std::string
+get_content (xmlNodePtr node)
+{
+  const auto content = make_scoped (xmlNodeGetContent (node), xmlFree);
+  return to_string (content.get ());
+}
+
+/**
+ * The value of attribute <name> of <node> (empty if missing).
+ */
+std::string
+get_attribute (xmlNodePtr node, char const *const name)
+{
+  const auto value = make_scoped (
+    xmlGetNoNsProp (node, reinterpret_cast<const xmlChar*> (name)), xmlFree);
+  return to_string (value.get ());
+}
+
+const xmlChar EXC_C14N_NAMESPACE[] = "http://www.w3.org/2001/10/xml-exc-c14n#";
+
+const std::string ENVELOPED_SIGNATURE_ALGORITHM =
+  to_string (XMLDSIG_NAMESPACE) + "enveloped-signature";
+
+/**
+ * How to canonicalise: C14N 1.0, 1.1 or exclusive (with the prefixes of
+ * namespaces to treat the inclusive way), with or without comments.
+ */
+struct C14NMethod {
+  xmlC14NMode mode = XML_C14N_1_0;
+  bool with_comments = false;
+  std::vector<std::string> inclusive_prefixes;
+};
+
+/**
+ * Split <list> of prefixes separated by white space (like PrefixList) into
+ * <prefixes>.
+ */
+void
+split_prefixes (const std::string& list, std::vector<std::string>& prefixes)
+{
+  std::istringstream in (list);
+  std::string prefix;
+  while (in >> prefix) {
+    prefixes.push_back (prefix);
+  }
+}
+
+/**
+ * Canonicalisation method of <algorithm>, a URI, (or the short name 1.0,
+ * 1.1 or exclusive) with <prefixes> if exclusive.
+ */
+C14NMethod
+get_c14n_method (const std::string& algorithm,
+		 const std::string& prefixes = "")
+{
+  const std::string uri =
+    algorithm == "1.0" ? C14N_ALGORITHMS[0].algorithm
+    : algorithm == "1.1" ? C14N_ALGORITHMS[2].algorithm
+    : algorithm == "exclusive" ? C14N_ALGORITHMS[4].algorithm
+    : algorithm;
+
+  for (const auto& known : C14N_ALGORITHMS) {
+    if (uri == known.algorithm) {
+      C14NMethod method;
+      method.mode = known.mode;
+      method.with_comments = known.with_comments;
+      if (method.mode == XML_C14N_EXCLUSIVE_1_0) {
+	split_prefixes (prefixes, method.inclusive_prefixes);
+      }
+      return method;
+    }
+  }
+
+  throw std::runtime_error ("Unsupported canonicalisation algorithm: "
+			    + algorithm);
+}
+
+/**
+ * Canonicalisation method of CanonicalizationMethod or Transform <element>,
+ * including its InclusiveNamespaces.
+ */
+C14NMethod
+get_c14n_method (xmlNodePtr element)
+{
+  std::string prefixes;
+  for (xmlNodePtr child = xmlFirstElementChild (element); child;
+       child = xmlNextElementSibling (child)) {
+    if (child->ns && xmlStrEqual (child->ns->href, EXC_C14N_NAMESPACE) &&
+	xmlStrEqual (child->name,
+		     reinterpret_cast<const xmlChar*> ("InclusiveNamespaces"))) {
+      prefixes = get_attribute (child, "PrefixList");
+    }
+  }
+
+  return get_c14n_method (get_attribute (element, "Algorithm"), prefixes);
+}
+
+/**
+ * The null terminated list of <method>'s inclusive prefixes for libxml2
+ * (valid as long as <method> is).
+ */
+std::vector<xmlChar*>
+get_inclusive_prefixes (const C14NMethod& method)
+{
+  std::vector<xmlChar*> prefixes;
+  for (const std::string& prefix : method.inclusive_prefixes) {
+    prefixes.push_back (reinterpret_cast<xmlChar*> (
+      const_cast<char*> (prefix.c_str ())));
+  }
+  prefixes.push_back (nullptr);
+
+  return prefixes;
+}
+
+/**
+ * What's canonicalised of a document: the subtree at <apex> (an element or
+ * the whole document) without the one at <excluded> (if any, e.g. an
+ * enveloped signature).
+ */
+struct Subtree {
+  xmlNodePtr apex;
+  xmlNodePtr excluded;
+};
+
+/**
+ * Whether <node> is in Subtree <subtree> and selected the same way as
+ * with C14N_CONTENT: elements, attributes, namespaces, comments
+ * and text other than white space only.  <parent> is the element attributes
+ * and namespaces belong to (or the parent of other nodes).  It's
+ * an xmlC14NIsVisibleCallback.
+ */
+int
+is_in_subtree (void *const subtree, xmlNodePtr node, xmlNodePtr parent)
+{
+  switch (node->type) {
+  case XML_ELEMENT_NODE:
+    parent = node;
+    break;
+
+  case XML_TEXT_NODE:
+  case XML_CDATA_SECTION_NODE:
+    if (xmlIsBlankNode (node)) {
+      return 0;
+    }
+    break;
+
+  case XML_ATTRIBUTE_NODE:
+  case XML_NAMESPACE_DECL:
+  case XML_COMMENT_NODE:
+    break;
+
+  default:
+    return 0;
+  }
+
+  const Subtree& nodes = *static_cast<const Subtree*> (subtree);
+  for (; parent; parent = parent->parent) {
+    if (parent == nodes.excluded) {
+      return 0;
+    }
+    if (parent == nodes.apex) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Canonicalise Subtree <subtree> of <doc> into <out> with <method> walking
+ * it directly.
+ */
+void
+c14n_subtree (xmlDocPtr doc, Subtree subtree, const C14NMethod& method,
+	      xmlOutputBufferPtr out)
+{
+  std::vector<xmlChar*> prefixes = get_inclusive_prefixes (method);
+  if (xmlC14NExecute (doc, is_in_subtree, &subtree, method.mode,
+		      prefixes.data (), method.with_comments, out) < 0) {
+    throw std::runtime_error (
+      "Cannot save selected doc/nodes into canonicalised form");
+  }
+}
+
+/**
+ * Canonicalises the element selected with XPath <expr> in files, building
+ * the whole document and the node set to canonicalise.  If <walk>,
+ * the subtree is canonicalised directly instead, with no node set to build
+ * and look nodes up in.
+ *
+ * They're canonicalised with <method>, if given, or the CanonicalizationMethod
+ * of the element if it's a SignedInfo (C14N 1.0 otherwise).
+ *
+ * If <map_input>, files are mapped into memory and parsed right from there
+ * rather than read through libxml2's I/O (which copies them into its
+ * buffers), with compact text nodes and no limits on their sizes.
+ *
+ * The parser (including its dictionary of names), the XPath context and
+ * the compiled XPath expressions are reused from one file to another, so
+ * it's meant to be used by a single thread, but for as many files as
+ * possible.
+ */
+class DomCanonicaliser {
+public:
+  DomCanonicaliser (const std::string& expr, bool walk,
+		    bool map_input = false,
+		    const C14NMethod *method = nullptr);
+
+  typedef std::unique_ptr<xmlDoc, decltype (&xmlFreeDoc)> DocPtr;
+
+  /**
+   * Canonicalise the selected element in <file_in> into <out>.
+   */
+  void
+  run (char const *file_in, xmlOutputBufferPtr out);
+
+  /**
+   * Parse <file_in>.
+   */
+  DocPtr
+  parse (char const *file_in);
+
+  /**
+   * Select the element in <doc> (parsed last).
+   */
+  xmlNodePtr
+  select (xmlDocPtr doc);
+
+private:
+  typedef std::unique_ptr<xmlXPathCompExpr, decltype (&xmlXPathFreeCompExpr)>
+  CompExprPtr;
+
+  static CompExprPtr
+  compile (const xmlChar *expr);
+
+  /**
+   * Parse <size> bytes of <file_in> mapped at <data>.
+   */
+  xmlDocPtr
+  parse_mapped (char const *file_in, const char *data, std::size_t size);
+
+  const std::string m_expr;
+  const bool m_walk;
+  const bool m_map_input;
+  const bool m_auto_method;
+  const C14NMethod m_method;
+  std::unique_ptr<xmlParserCtxt, decltype (&xmlFreeParserCtxt)> m_parser;
+  std::unique_ptr<xmlXPathContext, decltype (&xmlXPathFreeContext)> m_xpath;
+  CompExprPtr m_select;
+  CompExprPtr m_content;
+};
+
+// Now this is old granny's secret recipe for a delicious cheesecake.
+const xmlChar C14N_CONTENT[] =
+  "descendant-or-self::* | descendant-or-self::text()[normalize-space(.)]"
+  "| .//attribute::* | .//namespace::* | .//comment()";
+
+DomCanonicaliser::DomCanonicaliser (const std::string& expr, const bool walk,
+				    const bool map_input,
+				    const C14NMethod *const method)
+  : m_expr (expr), m_walk (walk), m_map_input (map_input),
+    m_auto_method (!method), m_method (method ? *method : C14NMethod ()),
+    m_parser (xmlNewParserCtxt (), xmlFreeParserCtxt),
+    // the document is set for every file
+    m_xpath (xmlXPathNewContext (nullptr), xmlXPathFreeContext),
+    m_select (compile (reinterpret_cast<const xmlChar*> (expr.c_str ()))),
+    m_content (compile (C14N_CONTENT))
+{
+  if (!m_parser) {
+    throw std::runtime_error ("Unable to create new parser context");
+  }
+
+  // Now we need a context for our bonkers XPath expressions
+  if (!m_xpath) {
+    throw std::runtime_error ("Unable to create new XPath context");
+  }
+
+  if (xmlXPathRegisterNs (m_xpath.get (), DEFAULT_NS_PREFIX,
+			  XMLDSIG_NAMESPACE) != 0) {
+    throw std::runtime_error ("Unable to register namespace "
+			      + to_string (DEFAULT_NS_PREFIX) + "="
+			      + to_string (XMLDSIG_NAMESPACE));
+  }
+}
+
+DomCanonicaliser::CompExprPtr
+DomCanonicaliser::compile (const xmlChar *const expr)
+{
+  CompExprPtr comp (xmlXPathCompile (expr), xmlXPathFreeCompExpr);
+  if (!comp) {
+    throw std::runtime_error ("Invalid XPath expression: " + to_string (expr));
+  }
+
+  return comp;
+}
+
+DomCanonicaliser::DocPtr
+DomCanonicaliser::parse (char const *const file_in)
+{
+  struct ::stat st;
+  void *data = MAP_FAILED;
+  if (m_map_input) {
+    const int fd = ::open (file_in, O_RDONLY);
+    // (there's nothing to map in an empty file or a pipe)
+    if (fd >= 0 && ::fstat (fd, &st) == 0 && S_ISREG (st.st_mode) &&
+	st.st_size > 0) {
+      data = ::mmap (nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    if (fd >= 0) {
+      ::close (fd);
+    }
+  }
+
+  DocPtr doc (nullptr, xmlFreeDoc);
+  if (data != MAP_FAILED) {
+    const auto mapping = make_scoped (data, [&st] (void *const p) {
+	::munmap (p, st.st_size);
+      }
+    );
+    (void) ::madvise (data, st.st_size, MADV_SEQUENTIAL);
+
+    doc.reset (parse_mapped (file_in, static_cast<const char*> (data),
+			     st.st_size));
+  }
+  else {
+    doc.reset (xmlCtxtReadFile (m_parser.get (), file_in, nullptr,
+				m_map_input
+				? XML_PARSE_COMPACT | XML_PARSE_HUGE : 0));
+  }
+
+  if (!doc) {
+    throw std::runtime_error ("Unable to parse file '"
+			      + std::string (file_in) + "'");
+  }
+
+  return doc;
+}
+
+xmlDocPtr
+DomCanonicaliser::parse_mapped (char const *const file_in,
+				const char *const data, const std::size_t size)
+{
+  // Feeding the parser chunk by chunk means it only ever copies a chunk
+  // into its buffer (not all of it as with xmlCtxtReadMemory()) and
+  // the pages parsed already can be dropped.
+  const std::size_t CHUNK_SIZE = 1 << 20;
+
+  const xmlParserCtxtPtr ctxt = m_parser.get ();
+  if (xmlCtxtResetPush (ctxt, nullptr, 0, file_in, nullptr) != 0) {
+    return nullptr;
+  }
+  xmlCtxtUseOptions (ctxt, XML_PARSE_COMPACT | XML_PARSE_HUGE);
+
+  LineEndNormaliser normaliser;
+  std::vector<char> buffer;
+  bool parsed = true;
+  for (std::size_t offset = 0; parsed && offset < size;
+       offset += CHUNK_SIZE) {
+    const char *chunk = data + offset;
+    std::size_t length = std::min (CHUNK_SIZE, size - offset);
+    const bool last = offset + length == size;
+    // (the mapping is read-only, chunks with line ends to fix are copied)
+    if (normaliser.needed (chunk, length)) {
+      buffer.assign (chunk, chunk + length);
+      length = normaliser.run (buffer.data (), length);
+      chunk = buffer.data ();
+    }
+
+    parsed = xmlParseChunk (ctxt, chunk, length, last) == 0;
+    (void) ::madvise (const_cast<char*> (data + offset),
+		      std::min (CHUNK_SIZE, size - offset), MADV_DONTNEED);
+  }
+
+  xmlDocPtr doc = ctxt->myDoc;
+  ctxt->myDoc = nullptr;
+  if (!parsed || !ctxt->wellFormed) {
+    xmlFreeDoc (doc);
+    doc = nullptr;
+  }
+
+  return doc;
+}
+
+xmlNodePtr
+DomCanonicaliser::select (xmlDocPtr doc)
+{
+  m_xpath->doc = doc;
+  m_xpath->node = reinterpret_cast<xmlNodePtr> (doc);
+
+  // First, lets "focus" on our signature information bit.
+  const auto sinfo_node =
+    make_scoped (xmlXPathCompiledEval (m_select.get (), m_xpath.get ()),
+		 xmlXPathFreeObject);
+  if (!sinfo_node || xmlXPathNodeSetIsEmpty (sinfo_node->nodesetval)) {
+    throw std::runtime_error ("Unable to get object: " + m_expr);
+  }
+
+  return xmlXPathNodeSetItem (sinfo_node->nodesetval, 0);
+}
+
+void
+DomCanonicaliser::run (char const *const file_in, xmlOutputBufferPtr out)
+{
+  // First, let's parse the XML file.
+  const DocPtr doc = parse (file_in);
+
+  // From now on we're operating within the signature information sub-document.
+  m_xpath->node = select (doc.get ());
+
+  const xmlNodePtr c14n_method =
+    m_auto_method && is_xmldsig_element (m_xpath->node, "SignedInfo")
+    ? find_child (m_xpath->node, "CanonicalizationMethod") : nullptr;
+  const C14NMethod method =
+    c14n_method ? get_c14n_method (c14n_method) : m_method;
+
+  // No need for any cheese, just take the whole slice.
+  if (m_walk) {
+    c14n_subtree (doc.get (), Subtree {m_xpath->node, nullptr}, method, out);
+    return;
+  }
+
+  // Get some cheese... all sub-document content we need for canonicalisation.
+  const auto sinfo =
+    make_scoped (xmlXPathCompiledEval (m_content.get (), m_xpath.get ()),
+		 xmlXPathFreeObject);
+  if (!sinfo || !sinfo->nodesetval || sinfo->nodesetval->nodeNr == 0) {
+    throw std::runtime_error ("Unable to get object(s) from path: "
+			      + to_string (C14N_CONTENT));
+  }
+
+  // And finally... bake it!
+  std::vector<xmlChar*> prefixes = get_inclusive_prefixes (method);
+  if (xmlC14NDocSaveTo (doc.get (), sinfo->nodesetval, method.mode,
+			prefixes.data (), method.with_comments, out) < 0) {
+    throw std::runtime_error (
+      "Cannot save selected doc/nodes into canonicalised form");
+  }
+}
+
+/**
+ * Where the canonical form goes: a file or a digest (possibly verifying
+ * a signature).  Either way, it's an xmlOutputBuffer the canonicalisation
+ * writes into, so a digest is calculated on the fly with no intermediate
+ * file or copies.
+ */
+class C14NOutput {
+public:
+  /**
+   * Write the canonical form to <file> (the standard output if null).
+   */
+  explicit C14NOutput (char const *file);
+
+  /**
+   * Calculate <md> digest of the canonical form.  If <key> isn't null,
+   * a signature is verified with it instead.
+   */
+  C14NOutput (const EVP_MD *md, EVP_PKEY *key);
+
+  ~C14NOutput ()
+  {
+    if (m_buffer) {
+      xmlOutputBufferClose (m_buffer);
+    }
+  }
+
+  C14NOutput (const C14NOutput&) = delete;
+  C14NOutput& operator= (const C14NOutput&) = delete;
+
+  xmlOutputBufferPtr
+  get () const
+  {
+    return m_buffer;
+  }
+
+  /**
+   * Flush everything written so far into the file or digest.
+   */
+  void
+  close ();
+
+  /**
+   * Get the digest, once closed.
+   */
+  std::string
+  digest ();
+
+  /**
+   * Verify <signature>, once closed.
+   */
+  bool
+  verify (const std::string& signature);
+
+private:
+  static int
+  write_digest (void *context, const char *buffer, int length);
+
+  std::unique_ptr<EVP_MD_CTX, decltype (&EVP_MD_CTX_free)> m_md_ctx;
+  xmlOutputBufferPtr m_buffer;
+};
+
+C14NOutput::C14NOutput (char const *const file)
+  : m_md_ctx (nullptr, EVP_MD_CTX_free),
+    m_buffer (file
+	      ? xmlOutputBufferCreateFilename (file, nullptr, 0)
+	      : xmlOutputBufferCreateFile (stdout, nullptr))
+{
+  if (!m_buffer) {
+    throw std::runtime_error ("Unable to open file '"
+			      + std::string (file ? file : "<stdout>") + "'");
+  }
+}
+
+C14NOutput::C14NOutput (const EVP_MD *const md, EVP_PKEY *const key)
+  : m_md_ctx (EVP_MD_CTX_new (), EVP_MD_CTX_free), m_buffer (nullptr)
+{
+  if (!m_md_ctx ||
+      !(key
+	? EVP_DigestVerifyInit (m_md_ctx.get (), nullptr, md, nullptr, key)
+	: EVP_DigestInit_ex (m_md_ctx.get (), md, nullptr))) {
+    throw std::runtime_error ("Unable to initialise digest");
+  }
+
+  m_buffer = xmlOutputBufferCreateIO (write_digest, nullptr,
+				      m_md_ctx.get (), nullptr);
+  if (!m_buffer) {
+    throw std::runtime_error ("Unable to create digest output");
+  }
+}
+
+int
+C14NOutput::write_digest (void *const context, const char *const buffer,
+			  const int length)
+{
+  // (it's EVP_DigestVerifyUpdate() if verifying)
+  return EVP_DigestUpdate (static_cast<EVP_MD_CTX*> (context), buffer, length)
+    ? length : -1;
+}
+
+void
+C14NOutput::close ()
+{
+  xmlOutputBufferPtr buffer = m_buffer;
+  m_buffer = nullptr;
+  if (xmlOutputBufferClose (buffer) < 0) {
+    throw std::runtime_error ("Cannot write canonicalised form");
+  }
+}
+
+std::string
+C14NOutput::digest ()
+{
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int length = 0;
+  if (!EVP_DigestFinal_ex (m_md_ctx.get (), md, &length)) {
+    throw std::runtime_error ("Unable to calculate digest");
+  }
+
+  return std::string (reinterpret_cast<const char*> (md), length);
+}
+
+bool
+C14NOutput::verify (const std::string& signature)
+{
+  const int result = EVP_DigestVerifyFinal (
+    m_md_ctx.get (), reinterpret_cast<const unsigned char*> (signature.data ()),
+    signature.size ());
+  ERR_clear_error ();
+
+  return result == 1;
+}
 
 /**
- * A common utility for creating RAII objects.
+ * Encode <data> in base64 (on a single line).
  */
-template<class T, class D = std::default_delete<T>>
-constexpr std::unique_ptr<T, D>
-make_scoped (T *const ptr, D deleter = D ())
+std::string
+base64_encode (const std::string& data)
 {
-  return std::unique_ptr<T, D> (ptr, deleter);
+  std::string encoded (4 * ((data.size () + 2) / 3) + 1, '\0');
+  const int length = EVP_EncodeBlock (
+    reinterpret_cast<unsigned char*> (&encoded[0]),
+    reinterpret_cast<const unsigned char*> (data.data ()), data.size ());
+  encoded.resize (length);
+
+  return encoded;
 }
 
 /**
- * Any libxml2 global initialisation/clean-up happens here in a RAII fashion.
+ * Read the whole (binary) file at <path>.
  */
-struct XmlContext {
-  XmlContext ()
-  {
-    xmlInitParser ();
-    LIBXML_TEST_VERSION
+std::string
+read_file (char const *const path)
+{
+  std::ifstream in (path, std::ios::binary);
+  if (!in) {
+    throw std::runtime_error ("Unable to open file '" + std::string (path)
+			      + "'");
   }
 
-  ~XmlContext ()
-  {
-    xmlCleanupParser ();
+  return std::string (std::istreambuf_iterator<char> (in),
+		      std::istreambuf_iterator<char> ());
+}
+
+/**
+ * Read a PEM public key or certificate (its public key) from <path>.
+ */
+std::unique_ptr<EVP_PKEY, decltype (&EVP_PKEY_free)>
+read_public_key (char const *const path)
+{
+  const std::string pem = read_file (path);
+  const auto new_bio = [&pem] () {
+    return make_scoped (BIO_new_mem_buf (pem.data (), pem.size ()), BIO_free);
+  };
+
+  EVP_PKEY *key =
+    PEM_read_bio_PUBKEY (new_bio ().get (), nullptr, nullptr, nullptr);
+  if (!key) {
+    const auto cert =
+      make_scoped (PEM_read_bio_X509 (new_bio ().get (), nullptr, nullptr,
+				      nullptr),
+		   X509_free);
+    key = cert ? X509_get_pubkey (cert.get ()) : nullptr;
+  }
+
+  ERR_clear_error ();
+  if (!key) {
+    throw std::runtime_error ("Unable to read public key from '"
+			      + std::string (path) + "'");
+  }
+
+  return std::unique_ptr<EVP_PKEY, decltype (&EVP_PKEY_free)> (key,
+							       EVP_PKEY_free);
+}
+
+/**
+ * Look up digest algorithm <name>.
+ */
+const EVP_MD*
+get_digest (const std::string& name)
+{
+  const EVP_MD *const md = EVP_get_digestbyname (name.c_str ());
+  if (!md) {
+    throw std::runtime_error ("Unknown digest algorithm: " + name);
+  }
+
+  return md;
+}
+
+/**
+ * Write base64 encoded digest of closed <out> into <file_out> (the standard
+ * output if null).
+ */
+void
+save_digest (C14NOutput& out, char const *const file_out)
+{
+  std::ofstream file;
+  if (file_out) {
+    file.open (file_out);
+  }
+
+  std::ostream& digest_out = file_out ? file : std::cout;
+  if (!(digest_out << base64_encode (out.digest ()) << std::endl)) {
+    throw std::runtime_error ("Unable to write the digest");
+  }
+}
+
+/**
+ * Read the list of files (one per line) to canonicalise from <path>.
+ */
+std::vector<std::string>
+read_batch (char const *const path)
+{
+  std::ifstream in (path);
+  if (!in) {
+    throw std::runtime_error ("Unable to open file '" + std::string (path)
+			      + "'");
+  }
+
+  std::vector<std::string> files;
+  std::string line;
+  while (std::getline (in, line)) {
+    if (!line.empty ()) {
+      files.push_back (line);
+    }
+  }
+
+  return files;
+}
+
+/**
+ * Decode base64 <encoded>, ignoring any white space in it (like line breaks
+ * in XMLDSig values).
+ */
+std::string
+base64_decode (const std::string& encoded)
+{
+  std::string data;
+  std::remove_copy_if (encoded.begin (), encoded.end (),
+		       std::back_inserter (data), [] (const char c) {
+			 return std::isspace (static_cast<unsigned char> (c));
+		       });
+  if (data.empty ()) {
+    return data;
+  }
+
+  std::string decoded (data.size () / 4 * 3, '\0');
+  const int length = EVP_DecodeBlock (
+    reinterpret_cast<unsigned char*> (&decoded[0]),
+    reinterpret_cast<const unsigned char*> (data.data ()), data.size ());
+  // (EVP_DecodeBlock() includes the padding in the length)
+  const std::size_t padding = data.size () - 1 - data.find_last_not_of ('=');
+  if (length < 0 || data.size () % 4 != 0 || padding > 2) {
+    throw std::runtime_error ("Invalid base64 value: " + encoded);
+  }
+  decoded.resize (length - padding);
+
+  return decoded;
+}
+
+/**
+ * Elements of <doc> by their Id (or ID, id, xml:id) attributes, for
+ * resolving Reference URIs like #PackageContents.  An Id used twice is
+ * an error since it's not clear which element is signed then.
+ */
+std::map<std::string, xmlNodePtr>
+index_ids (xmlDocPtr doc)
+{
+  std::map<std::string, xmlNodePtr> ids;
+  for (xmlNodePtr node = xmlDocGetRootElement (doc); node; ) {
+    for (xmlAttrPtr attr = node->properties; attr; attr = attr->next) {
+      const char *const name = reinterpret_cast<const char*> (attr->name);
+      const bool is_id = attr->ns
+	? xmlStrEqual (attr->ns->href, XML_XML_NAMESPACE) &&
+	  std::strcmp (name, "id") == 0
+	: std::strcmp (name, "Id") == 0 || std::strcmp (name, "ID") == 0 ||
+	  std::strcmp (name, "id") == 0;
+      if (is_id &&
+	  !ids.emplace (get_content (reinterpret_cast<xmlNodePtr> (attr)),
+			node).second) {
+	throw std::runtime_error (
+	  "Duplicate Id: " + get_content (reinterpret_cast<xmlNodePtr> (attr)));
+      }
+    }
+
+    // the next element in document order
+    xmlNodePtr next = xmlFirstElementChild (node);
+    for (; !next && node && node->type == XML_ELEMENT_NODE;
+	 node = node->parent) {
+      next = xmlNextElementSibling (node);
+    }
+    node = next;
+  }
+
+  return ids;
+}
+
+/**
+ * Look up the digest of DigestMethod or SignatureMethod <algorithm>, named
+ * by its fragment, e.g. ...#sha256 or ...#rsa-sha256 (with <key_type> rsa).
+ */
+const EVP_MD*
+get_digest_by_uri (const std::string& algorithm, std::string *key_type)
+{
+  const std::size_t hash = algorithm.rfind ('#');
+  std::string name = hash == std::string::npos
+    ? "" : algorithm.substr (hash + 1);
+  if (key_type) {
+    const std::size_t dash = name.find ('-');
+    *key_type = name.substr (0, dash);
+    name = dash == std::string::npos ? "" : name.substr (dash + 1);
+  }
+
+  const EVP_MD *const md =
+    name.empty () ? nullptr : EVP_get_digestbyname (name.c_str ());
+  if (!md || (key_type && *key_type != "rsa" && *key_type != "ecdsa")) {
+    throw std::runtime_error ("Unsupported algorithm: " + algorithm);
+  }
+
+  return md;
+}
+
+/**
+ * Convert XMLDSig ECDSA signature <raw> (r and s of the same size) into
+ * the DER form OpenSSL verifies.
+ */
+std::string
+ecdsa_signature_to_der (const std::string& raw)
+{
+  const auto sig = make_scoped (ECDSA_SIG_new (), ECDSA_SIG_free);
+  const unsigned char *const data =
+    reinterpret_cast<const unsigned char*> (raw.data ());
+  const int half = raw.size () / 2;
+  BIGNUM *const r = BN_bin2bn (data, half, nullptr);
+  BIGNUM *const s = BN_bin2bn (data + half, half, nullptr);
+  if (!sig || !r || !s || !ECDSA_SIG_set0 (sig.get (), r, s)) {
+    BN_free (r);
+    BN_free (s);
+    throw std::runtime_error ("Invalid ECDSA signature");
+  }
+
+  unsigned char *der = nullptr;
+  const int length = i2d_ECDSA_SIG (sig.get (), &der);
+  if (length < 0) {
+    throw std::runtime_error ("Invalid ECDSA signature");
+  }
+
+  const std::string result (reinterpret_cast<const char*> (der), length);
+  OPENSSL_free (der);
+
+  return result;
+}
+
+/**
+ * Verify the digest of XMLDSig <reference> in <doc> (containing
+ * <signature>), resolving its URI with <ids>.
+ */
+bool
+verify_reference (xmlDocPtr doc, xmlNodePtr signature, xmlNodePtr reference,
+		  const std::map<std::string, xmlNodePtr>& ids)
+{
+  const std::string uri = get_attribute (reference, "URI");
+  Subtree subtree = {nullptr, nullptr};
+  if (uri.empty ()) {
+    subtree.apex = reinterpret_cast<xmlNodePtr> (doc);
+  }
+  else if (uri[0] == '#') {
+    const auto id = ids.find (uri.substr (1));
+    if (id == ids.end ()) {
+      throw std::runtime_error ("Unable to resolve Reference URI: " + uri);
+    }
+    subtree.apex = id->second;
+  }
+  else {
+    throw std::runtime_error ("Unsupported Reference URI: " + uri);
+  }
+
+  // same-document references are canonicalised without comments by default
+  C14NMethod method;
+  for (xmlNodePtr transforms = xmlFirstElementChild (reference); transforms;
+       transforms = xmlNextElementSibling (transforms)) {
+    if (!is_xmldsig_element (transforms, "Transforms")) {
+      continue;
+    }
+
+    for (xmlNodePtr transform = xmlFirstElementChild (transforms); transform;
+	 transform = xmlNextElementSibling (transform)) {
+      const std::string algorithm = get_attribute (transform, "Algorithm");
+      if (algorithm == ENVELOPED_SIGNATURE_ALGORITHM) {
+	subtree.excluded = signature;
+      }
+      else {
+	method = get_c14n_method (transform);
+      }
+    }
+  }
+
+  const EVP_MD *const md = get_digest_by_uri (
+    get_attribute (get_child (reference, "DigestMethod"), "Algorithm"),
+    nullptr);
+  C14NOutput out (md, nullptr);
+  c14n_subtree (doc, subtree, method, out.get ());
+  out.close ();
+
+  return out.digest ()
+    == base64_decode (get_content (get_child (reference, "DigestValue")));
+}
+
+/**
+ * Verify SignatureValue of XMLDSig <signature> in <doc> (SignedInfo)
+ * with the key of X509Certificate (which isn't verified itself).
+ */
+bool
+verify_signature_value (xmlDocPtr doc, xmlNodePtr signature)
+{
+  const xmlNodePtr signed_info = get_child (signature, "SignedInfo");
+  const std::string der = base64_decode (get_content (
+    get_child (get_child (get_child (signature, "KeyInfo"), "X509Data"),
+	       "X509Certificate")));
+  const unsigned char *der_data =
+    reinterpret_cast<const unsigned char*> (der.data ());
+  const auto cert = make_scoped (d2i_X509 (nullptr, &der_data, der.size ()),
+				 X509_free);
+  EVP_PKEY *const key = cert ? X509_get0_pubkey (cert.get ()) : nullptr;
+  if (!key) {
+    throw std::runtime_error ("Unable to read X509Certificate");
+  }
+
+  std::string key_type;
+  const EVP_MD *const md = get_digest_by_uri (
+    get_attribute (get_child (signed_info, "SignatureMethod"), "Algorithm"),
+    &key_type);
+  std::string signature_value =
+    base64_decode (get_content (get_child (signature, "SignatureValue")));
+  if (key_type == "ecdsa") {
+    signature_value = ecdsa_signature_to_der (signature_value);
+  }
+
+  C14NOutput out (md, key);
+  c14n_subtree (doc, Subtree {signed_info, nullptr},
+		get_c14n_method (get_child (signed_info,
+					    "CanonicalizationMethod")),
+		out.get ());
+  out.close ();
+
+  return out.verify (signature_value);
+}
+
+/**
+ * Verify XMLDSig <signature> in <doc>: the digests of all the References
+ * and SignatureValue (see verify_signature_value()).  The References are
+ * canonicalised and digested by up to <workers> threads sharing the
+ * (read-only) document while the signature is verified.  Failures are
+ * reported into <report>.
+ */
+bool
+verify_xmldsig (xmlDocPtr doc, xmlNodePtr signature, const unsigned workers,
+		std::ostream& report)
+{
+  if (!is_xmldsig_element (signature, "Signature")) {
+    throw std::runtime_error ("Not a Signature: "
+			      + to_string (signature->name));
+  }
+
+  const xmlNodePtr signed_info = get_child (signature, "SignedInfo");
+  const std::map<std::string, xmlNodePtr> ids = index_ids (doc);
+
+  std::vector<xmlNodePtr> references;
+  for (xmlNodePtr reference = xmlFirstElementChild (signed_info); reference;
+       reference = xmlNextElementSibling (reference)) {
+    if (is_xmldsig_element (reference, "Reference")) {
+      references.push_back (reference);
+    }
+  }
+
+  if (references.empty ()) {
+    throw std::runtime_error ("Missing Reference in SignedInfo");
+  }
+
+  // (not vector<bool>, its elements can't be written by different threads)
+  std::vector<char> digested (references.size (), false);
+  std::vector<std::exception_ptr> errors (references.size ());
+  std::atomic<std::size_t> next (0);
+  const auto work = [&] () {
+    for (std::size_t i; (i = next++) < references.size (); ) {
+      try {
+	digested[i] = verify_reference (doc, signature, references[i], ids);
+      }
+      catch (...) {
+	errors[i] = std::current_exception ();
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  const std::size_t count =
+    std::min<std::size_t> (workers, references.size ());
+  for (std::size_t i = 1; i < count; ++i) {
+    threads.emplace_back (work);
+  }
+
+  bool signed_ok = false;
+  std::exception_ptr signature_error;
+  try {
+    signed_ok = verify_signature_value (doc, signature);
+  }
+  catch (...) {
+    signature_error = std::current_exception ();
+  }
+
+  work ();
+  for (std::thread& t : threads) {
+    t.join ();
+  }
+
+  errors.insert (errors.begin (), signature_error);
+  for (const std::exception_ptr& error : errors) {
+    if (error) {
+      std::rethrow_exception (error);
+    }
   }
-};
+
+  bool verified = signed_ok;
+  for (std::size_t i = 0; i < references.size (); ++i) {
+    if (!digested[i]) {
+      report << "Reference " << get_attribute (references[i], "URI")
+	     << ": digest mismatch\n";
+      verified = false;
+    }
+  }
+
+  if (!signed_ok) {
+    report << "SignatureValue: signature mismatch\n";
+  }
+
+  return verified;
+}
 
 void
 usage (char const *const arg0, std::ostream& out)
@@ -43,7 +1750,9 @@ usage (char const *const arg0, std::ostream& out)
   out <<
 "Usage:\n"
 "\n"
-"    " << arg0 << " <XPath expr> [<XML input file> [<XML output file>]]\n"
+"    " << arg0 << " [<options>] <XPath expr> [<XML input file> [<XML output file>]]\n"
+"    " << arg0 << " [<options>] --batch <list file> <XPath expr>\n"
+"    " << arg0 << " --xmldsig <XPath expr> [<XML input file>]\n"
 "\n"
 "Canonicalises (C14N, see [1]) <XML infput file> which is assumed to be\n"
 "an XML Signature (XMLDSig) file [2].  This briefly means removing redundant\n"
@@ -51,12 +1760,79 @@ usage (char const *const arg0, std::ostream& out)
 "so that it has standard formatting applied ready for signing or verifying.\n"
 "The first (top-level) node to process is specified with <XPath expr>.\n"
 "\n"
-"The result is written to <XML output file>.\n"
+"The result is written to <XML output file>.  It can also be digested or\n"
+"its signature verified straight away (see --digest and --verify).\n"
 "\n"
 "If <XML output file> is not provided, the result is printed into\n"
 "the standard output.  If <XML input file> is also not provided, it's read\n"
 "from the standard input.\n"
 "\n"
+"Options:\n"
+"\n"
+"    -s, --stream\n"
+"        Canonicalise while reading the input rather than building the whole\n"
+"        document in memory first, so that huge documents can be processed\n"
+"        with little memory.  <XPath expr> has to be a simple absolute path\n"
+"        like /default:Signature/default:SignedInfo.  Only C14N 1.0 without\n"
+"        comments is done, so a SignedInfo with any other\n"
+"        CanonicalizationMethod fails.\n"
+"\n"
+"    -c, --c14n <method>\n"
+"        Canonicalisation method: 1.0, 1.1, exclusive or an XMLDSig\n"
+"        algorithm URI (e.g. for #WithComments).  The default is\n"
+"        the CanonicalizationMethod of the element if it's a SignedInfo,\n"
+"        or 1.0 otherwise.  --stream can only do 1.0.\n"
+"\n"
+"    -i, --inclusive-prefixes <prefixes>\n"
+"        Space separated prefixes of namespaces which are treated the C14N\n"
+"        1.0 way by exclusive canonicalisation (#default is the default\n"
+"        namespace), like the PrefixList of InclusiveNamespaces.\n"
+"\n"
+"    -m, --mmap\n"
+"        Map the input file into memory and parse it from there rather than\n"
+"        read it through libxml2's buffers, with compact text nodes and no\n"
+"        limits on the document (e.g. the depth or sizes of text nodes).\n"
+"\n"
+"    -w, --walk\n"
+"        Canonicalise the element selected with <XPath expr> by walking its\n"
+"        subtree rather than selecting all of its nodes with XPath first,\n"
+"        which is much faster for big elements.\n"
+"\n"
+"    -d, --digest <algorithm>\n"
+"        Write base64 encoded <algorithm> (e.g. sha256) digest of the result\n"
+"        rather than the result itself, like a DigestValue.\n"
+"\n"
+"    -v, --verify <key or certificate>\n"
+"    -S, --signature <signature file>\n"
+"        Verify binary <signature file> of the result, e.g. a decoded\n"
+"        SignatureValue, with PEM public key or certificate rather than write\n"
+"        the result.  The result is digested with --digest <algorithm> (sha1\n"
+"        by default).  \"Verified OK\" or \"Verification Failure\" is\n"
+"        written.\n"
+"\n"
+"    -b, --batch <list file>\n"
+"        Canonicalise every XML file listed in <list file> (one per line)\n"
+"        rather than a single one, writing the result of <file> into\n"
+"        <file>.c14n (or its digest into <file>.<algorithm> with --digest).\n"
+"        Files which fail are reported and the rest is processed anyway.\n"
+"        Can't be used with --verify.\n"
+"\n"
+"    -j, --workers <count>\n"
+"        Number of threads canonicalising the files of --batch or\n"
+"        the References of --xmldsig, 1 to 1024 (default: the number of\n"
+"        CPU cores).\n"
+"\n"
+"    -x, --xmldsig\n"
+"        Verify the whole XMLDSig Signature element selected with <XPath\n"
+"        expr> rather than canonicalise it: the digests of all its\n"
+"        References (URI=\"#Id\" or URI=\"\") and its SignatureValue with\n"
+"        the key of its X509Certificate.  \"Verified OK\" or mismatches and\n"
+"        \"Verification Failure\" are written.  The certificate itself\n"
+"        isn't verified.  Like all the other canonicalisation here, white\n"
+"        space only text nodes are left out, which standard C14N keeps, so\n"
+"        signatures of indented (pretty printed) documents made by other\n"
+"        tools don't verify.\n"
+"\n"
 "[1] http://www.w3.org/TR/xml-c14n\n"
 "[2] http://www.w3.org/TR/xmldsig-core\n"
       << std::endl;
@@ -68,6 +1844,225 @@ help_requested (const std::string& arg)
   return arg == "-h" || arg == "-help" || arg == "--help";
 }
 
+/**
+ * Command line options.
+ */
+struct Options {
+  bool stream = false;
+  bool walk = false;
+  bool mmap = false;
+  // empty unless a canonicalisation method is forced
+  std::string c14n;
+  std::string inclusive_prefixes;
+  bool xmldsig = false;
+  // empty unless processing a batch of files
+  std::string batch;
+  unsigned workers = std::max (1u, std::thread::hardware_concurrency ());
+  // empty unless digesting (or verifying with other than the default)
+  std::string digest;
+  // both empty unless verifying
+  std::string verify_key;
+  std::string signature;
+};
+
+// upper bound of --workers
+constexpr unsigned long MAX_WORKERS = 1024;
+
+/**
+ * Parse command line options.  On success, optind points at the first
+ * positional argument.
+ */
+bool
+parse_options (int argc, char* argv[], Options& options)
+{
+  const struct ::option long_options[] = {
+    {"stream", no_argument, nullptr, 's'},
+    {"walk", no_argument, nullptr, 'w'},
+    {"mmap", no_argument, nullptr, 'm'},
+    {"c14n", required_argument, nullptr, 'c'},
+    {"inclusive-prefixes", required_argument, nullptr, 'i'},
+    {"digest", required_argument, nullptr, 'd'},
+    {"verify", required_argument, nullptr, 'v'},
+    {"signature", required_argument, nullptr, 'S'},
+    {"batch", required_argument, nullptr, 'b'},
+    {"workers", required_argument, nullptr, 'j'},
+    {"xmldsig", no_argument, nullptr, 'x'},
+    {nullptr, 0, nullptr, 0}
+  };
+
+  int opt;
+  while ((opt = ::getopt_long (argc, argv, "+swmc:i:d:v:S:b:j:x", long_options,
+			       nullptr)) != -1) {
+    switch (opt) {
+    case 's':
+      options.stream = true;
+      break;
+
+    case 'w':
+      options.walk = true;
+      break;
+
+    case 'm':
+      options.mmap = true;
+      break;
+
+    case 'c':
+      options.c14n = optarg;
+      break;
+
+    case 'i':
+      options.inclusive_prefixes = optarg;
+      break;
+
+    case 'd':
+      options.digest = optarg;
+      break;
+
+    case 'v':
+      options.verify_key = optarg;
+      break;
+
+    case 'S':
+      options.signature = optarg;
+      break;
+
+    case 'b':
+      options.batch = optarg;
+      break;
+
+    case 'x':
+      options.xmldsig = true;
+      break;
+
+    case 'j': {
+      // (strtoul () would skip white space and take negative numbers)
+      char *end;
+      errno = 0;
+      const unsigned long workers = std::strtoul (optarg, &end, 10);
+      if (!std::isdigit (static_cast<unsigned char> (*optarg)) || *end ||
+	  errno || workers == 0 || workers > MAX_WORKERS) {
+	std::cerr << "Invalid number of workers: " << optarg << '\n';
+	return false;
+      }
+      options.workers = workers;
+      break;
+    }
+
+    default:
+      return false;
+    }
+  }
+
+  // a key without a signature (or the other way round) is useless
+  return options.verify_key.empty () == options.signature.empty () &&
+    !(options.stream && (options.walk || options.mmap ||
+			 !options.c14n.empty ())) &&
+    // one signature doesn't make sense for many files
+    (options.batch.empty () || options.verify_key.empty ()) &&
+    // it's all done in one go
+    (!options.xmldsig || (!options.stream && options.c14n.empty () &&
+			  options.digest.empty () &&
+			  options.verify_key.empty () &&
+			  options.batch.empty ()));
+}
+
+/**
+ * The canonicalisation method forced with <options>, null if it isn't.
+ */
+std::unique_ptr<C14NMethod>
+get_forced_c14n_method (const Options& options)
+{
+  return std::unique_ptr<C14NMethod> (
+    options.c14n.empty () ? nullptr
+    : new C14NMethod (get_c14n_method (options.c14n,
+				       options.inclusive_prefixes)));
+}
+
+/**
+ * Canonicalise all the files listed in <options.batch> with a pool of
+ * threads, each reusing its own DomCanonicaliser.
+ */
+int
+run_batch (const std::string& expr, const Options& options)
+{
+  std::vector<std::string> files;
+  const EVP_MD *md = nullptr;
+  std::unique_ptr<C14NMethod> method;
+  try {
+    files = read_batch (options.batch.c_str ());
+    if (!options.digest.empty ()) {
+      md = get_digest (options.digest);
+    }
+
+    method = get_forced_c14n_method (options);
+
+    // fail early rather than for every file
+    DomCanonicaliser (expr, options.walk, options.mmap, method.get ());
+  }
+  catch (const std::exception& e) {
+    std::cerr << "ERROR: " << e.what () << '\n';
+    return EXIT_FAILURE;
+  }
+
+  // empty if the file is canonicalised successfully
+  std::vector<std::string> errors (files.size ());
+  std::atomic<std::size_t> next (0);
+  const auto work = [&] () {
+    DomCanonicaliser canonicaliser (expr, options.walk, options.mmap,
+				    method.get ());
+    const auto canonicalise = [&] (const std::string& file,
+				   xmlOutputBufferPtr out) {
+      if (options.stream) {
+	stream_c14n (expr, file.c_str (), out);
+      }
+      else {
+	canonicaliser.run (file.c_str (), out);
+      }
+    };
+
+    for (std::size_t i; (i = next++) < files.size (); ) {
+      const std::string& file = files[i];
+      try {
+	if (md) {
+	  C14NOutput out (md, nullptr);
+	  canonicalise (file, out.get ());
+	  out.close ();
+	  save_digest (out, (file + '.' + options.digest).c_str ());
+	}
+	else {
+	  C14NOutput out ((file + ".c14n").c_str ());
+	  canonicalise (file, out.get ());
+	  out.close ();
+	}
+      }
+      catch (const std::exception& e) {
+	errors[i] = e.what ();
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  const std::size_t count =
+    std::min<std::size_t> (options.workers, files.size ());
+  for (std::size_t i = 1; i < count; ++i) {
+    threads.emplace_back (work);
+  }
+
+  work ();
+  for (std::thread& t : threads) {
+    t.join ();
+  }
+
+  int status = EXIT_SUCCESS;
+  for (std::size_t i = 0; i < files.size (); ++i) {
+    if (!errors[i].empty ()) {
+      std::cerr << "ERROR: " << files[i] << ": " << errors[i] << '\n';
+      status = EXIT_FAILURE;
+    }
+  }
+
+  return status;
+}
 
 int
 main (int argc, char* argv[])
@@ -79,73 +2074,81 @@ main (int argc, char* argv[])
   }
 
   // misuse
-  if (argc < 2 || 4 < argc) {
+  Options options;
+  if (!parse_options (argc, argv, options) || argc - optind < 1 ||
+      (!options.batch.empty () ? 1 : options.xmldsig ? 2 : 3)
+      < argc - optind) {
     usage (argv[0], std::cerr);
     return EXIT_FAILURE;
   }
 
-  char const *const file_out = argc > 3 ? argv[3] : "/dev/stdout";
-  char const *const file_in = argc > 2 ? argv[2] : "/dev/stdin";
+  char *const *const args = argv + optind;
+  const int nargs = argc - optind;
+  // the standard output if null
+  char const *const file_out = nargs > 2 ? args[2] : nullptr;
+  char const *const file_in = nargs > 1 ? args[1] : "/dev/stdin";
 
   XmlContext context;
 
-  // First, let's parse the XML file.
-  const auto doc = make_scoped (xmlParseFile (file_in), xmlFreeDoc);
-  if (!doc) {
-    std::cerr << "Unable to parse file '" << file_in << "'\n";
-    return EXIT_FAILURE;
+  if (!options.batch.empty ()) {
+    return run_batch (args[0], options);
   }
 
-  // Now we need a context for our bonkers XPath expressions
-  const auto ctx = make_scoped (xmlXPathNewContext (doc.get ()),
-				xmlXPathFreeContext);
-  if (!ctx) {
-    std::cerr << "Unable to create new XPath context\n";
-    return EXIT_FAILURE;
-  }
+  try {
+    if (options.xmldsig) {
+      DomCanonicaliser canonicaliser (args[0], true, options.mmap);
+      const auto doc = canonicaliser.parse (file_in);
+      const bool verified =
+	verify_xmldsig (doc.get (), canonicaliser.select (doc.get ()),
+			options.workers, std::cout);
+      std::cout << (verified ? "Verified OK" : "Verification Failure")
+		<< std::endl;
+      return verified ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
-  // It's handy to have a well known alias to an XML namespace which we can use
-  // later on in XPath expressions.
-  const xmlChar DEFAULT_NS_PREFIX[] = "default";
-  const xmlChar XMLDSIG_NAMESPACE[] = "http://www.w3.org/2000/09/xmldsig#";
-  if (xmlXPathRegisterNs (ctx.get (), DEFAULT_NS_PREFIX, XMLDSIG_NAMESPACE) != 0) {
-    std::cerr
-      << "Unable to register namespace " << DEFAULT_NS_PREFIX
-      << "=" << XMLDSIG_NAMESPACE << '\n';
-    return EXIT_FAILURE;
-  }
+    const bool verifying = !options.verify_key.empty ();
+    std::unique_ptr<C14NOutput> out;
+    std::unique_ptr<EVP_PKEY, decltype (&EVP_PKEY_free)> key (nullptr,
+							       EVP_PKEY_free);
+    if (verifying || !options.digest.empty ()) {
+      const EVP_MD *const md =
+	get_digest (options.digest.empty () ? "sha1" : options.digest);
 
-  // This is what we'll be extracting.
-  xmlChar *const siPath = reinterpret_cast<xmlChar*>(argv[1]);
+      if (verifying) {
+	key = read_public_key (options.verify_key.c_str ());
+      }
 
-  // First, lets "focus" on our signature information bit.
-  const auto sinfo_node =
-    make_scoped (xmlXPathEvalExpression (siPath, ctx.get ()), xmlXPathFreeObject);
-  if (!sinfo_node || xmlXPathNodeSetIsEmpty (sinfo_node->nodesetval)) {
-    std::cerr << "Unable to get object: " << siPath << '\n';
-    return EXIT_FAILURE;
-  }
+      out.reset (new C14NOutput (md, key.get ()));
+    }
+    else {
+      out.reset (new C14NOutput (file_out));
+    }
 
-  // From now on we're operating within the signature information sub-document.
-  ctx->node = xmlXPathNodeSetItem (sinfo_node->nodesetval, 0);
+    if (options.stream) {
+      stream_c14n (args[0], file_in, out->get ());
+    }
+    else {
+      DomCanonicaliser (args[0], options.walk, options.mmap,
+			get_forced_c14n_method (options).get ())
+	.run (file_in, out->get ());
+    }
 
-  // Now this is old granny's secret recipe for a delicious cheesecake.
-  const xmlChar C14N_CONTENT[] =
-    "descendant-or-self::* | descendant-or-self::text()[normalize-space(.)]"
-    "| .//attribute::* | .//namespace::* | .//comment()";
+    out->close ();
 
-  // Get some cheese... all sub-document content we need for canonicalisation.
-  const auto sinfo =
-    make_scoped (xmlXPathEvalExpression (C14N_CONTENT, ctx.get ()),
-		 xmlXPathFreeObject);
-  if (!sinfo || !sinfo->nodesetval || sinfo->nodesetval->nodeNr == 0) {
-    std::cerr << "Unable to get object(s) from path: " << C14N_CONTENT << '\n';
-    return EXIT_FAILURE;
-  }
+    if (verifying) {
+      const bool verified =
+	out->verify (read_file (options.signature.c_str ()));
+      std::cout << (verified ? "Verified OK" : "Verification Failure")
+		<< std::endl;
+      return verified ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
-  // And finally... bake it!
-  if (xmlC14NDocSave (doc.get (), sinfo->nodesetval, 0, NULL, 0, file_out, 0) < 0) {
-    std::cerr << "ERROR: Cannot save selected doc/nodes into canonicalised form\n";
+    if (!options.digest.empty ()) {
+      save_digest (*out, file_out);
+    }
+  }
+  catch (const std::exception& e) {
+    std::cerr << "ERROR: " << e.what () << '\n';
     return EXIT_FAILURE;
   }
 